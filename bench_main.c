@@ -0,0 +1,461 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "ezMidi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// SYNTHETIC CORPUS
+// ===================================================================
+typedef struct BenchCorpus {
+    uint16_t Tracks;
+    uint32_t EventsPerTrack; // channel events, half note-on / half note-off
+    uint32_t RunningStatus; // percent of the channel events written without their status byte
+    uint32_t SysExSize; // bytes of one SysEx event emitted every 64 channel events (0 = none)
+} BenchCorpus_t;
+
+typedef struct BenchBuffer {
+    uint8_t* data;
+    uint32_t length;
+    uint32_t capacity;
+} BenchBuffer_t;
+
+static void Bench_Put(BenchBuffer_t* buffer, const void* data, uint32_t length)
+{
+    if (buffer->length + length > buffer->capacity)
+    {
+        while (buffer->length + length > buffer->capacity)
+            buffer->capacity = (buffer->capacity) ? 2*buffer->capacity : 4096;
+
+        if ((buffer->data = realloc(buffer->data, buffer->capacity)) == NULL)
+        {
+            fprintf(stderr, "\nOut of memory generating the corpus");
+            exit(-1);
+        }
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void Bench_PutByte(BenchBuffer_t* buffer, uint8_t byte)
+{
+    Bench_Put(buffer, &byte, 1);
+}
+
+static void Bench_PutBigEndian(BenchBuffer_t* buffer, uint32_t value, uint8_t bytes)
+{
+    while (bytes--)
+        Bench_PutByte(buffer, (uint8_t)(value >> (8*bytes)));
+}
+
+static void Bench_PutVariableLength(BenchBuffer_t* buffer, uint32_t value)
+{
+    uint8_t bytes[4];
+    uint8_t count = 0;
+
+    do
+    {
+        bytes[count++] = value & 0x7F;
+        value >>= 7;
+    } while (value);
+
+    while (count--)
+        Bench_PutByte(buffer, bytes[count] | ((count) ? 0x80 : 0));
+}
+
+// xorshift, so every run generates the same corpus
+static uint32_t Bench_Random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void Bench_GenerateTrack(BenchBuffer_t* file, const BenchCorpus_t* corpus, uint16_t track, uint32_t* seed)
+{
+    BenchBuffer_t body = {NULL, 0, 0};
+    uint8_t channel = track % 16;
+    uint8_t lastStatus = 0;
+
+    if (track == 0)
+    {
+        static const uint8_t tempo[] = {0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20}; // 120 bpm
+        static const uint8_t key[] = {0x00, 0xFF, 0x59, 0x02, 0x00, 0x00}; // C major, needed by Midi_Transpose
+        Bench_Put(&body, tempo, sizeof(tempo));
+        Bench_Put(&body, key, sizeof(key));
+    }
+
+    uint8_t key = 60;
+    for (uint32_t e = 0; e < corpus->EventsPerTrack; e++)
+    {
+        if (corpus->SysExSize && e % 64 == 63)
+        {
+            Bench_PutByte(&body, 0);
+            Bench_PutByte(&body, 0xF0);
+            Bench_PutVariableLength(&body, corpus->SysExSize);
+            for (uint32_t i = 0; i < corpus->SysExSize; i++)
+                Bench_PutByte(&body, (i + 1 == corpus->SysExSize) ? 0xF7 : (uint8_t)(i & 0x7F));
+
+            lastStatus = 0; // SysEx cancels the running status
+        }
+
+        // note-on / note-off pairs; a note-off is a note-on with velocity zero when the status may be repeated
+        uint8_t on = !(e & 1);
+        uint8_t repeat = (Bench_Random(seed) % 100) < corpus->RunningStatus;
+        uint8_t status = ((on || repeat) ? 0x90 : 0x80) | channel;
+
+        if (on)
+            key = 40 + Bench_Random(seed) % 40;
+
+        Bench_PutVariableLength(&body, (on) ? Bench_Random(seed) % 32 : 24 + Bench_Random(seed) % 96);
+
+        if (status != lastStatus || !repeat)
+            Bench_PutByte(&body, status);
+
+        Bench_PutByte(&body, key);
+        Bench_PutByte(&body, (on) ? 64 + Bench_Random(seed) % 64 : 0);
+        lastStatus = status;
+    }
+
+    static const uint8_t endOfTrack[] = {0x00, 0xFF, 0x2F, 0x00};
+    Bench_Put(&body, endOfTrack, sizeof(endOfTrack));
+
+    Bench_Put(file, "MTrk", 4);
+    Bench_PutBigEndian(file, body.length, 4);
+    Bench_Put(file, body.data, body.length);
+    free(body.data);
+}
+
+static BenchBuffer_t Bench_GenerateFile(const BenchCorpus_t* corpus)
+{
+    BenchBuffer_t file = {NULL, 0, 0};
+    uint32_t seed = 2463534242;
+
+    Bench_Put(&file, "MThd", 4);
+    Bench_PutBigEndian(&file, 6, 4);
+    Bench_PutBigEndian(&file, 1, 2); // format
+    Bench_PutBigEndian(&file, corpus->Tracks, 2);
+    Bench_PutBigEndian(&file, 480, 2); // ppq
+
+    for (uint16_t t = 0; t < corpus->Tracks; t++)
+        Bench_GenerateTrack(&file, corpus, t, &seed);
+
+    return file;
+}
+
+// MEASUREMENTS
+// ===================================================================
+typedef struct BenchResult {
+    uint64_t ElapsedNs;
+    uint64_t Events;
+    uint64_t Bytes;
+    MidiAllocStats_t Allocs;
+} BenchResult_t;
+
+static uint64_t Bench_PeakMemoryKb()
+{
+    #if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return counters.PeakWorkingSetSize / 1024;
+    #else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    #if defined(__APPLE__)
+    return usage.ru_maxrss / 1024; // bytes on macOS
+    #else
+    return usage.ru_maxrss;
+    #endif
+    #endif
+}
+
+static uint64_t Bench_CountEvents(const MidiFile_t* midi)
+{
+    uint64_t count = 0;
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+        count += midi->Tracks[t].NumEvents;
+
+    return count;
+}
+
+static void Bench_Begin(BenchResult_t* result)
+{
+    *result = (BenchResult_t){0};
+    result->Allocs = Midi_GetAllocStats();
+    result->ElapsedNs = MidiClock_NowNs();
+}
+
+static void Bench_End(BenchResult_t* result)
+{
+    MidiAllocStats_t allocs = Midi_GetAllocStats();
+    result->ElapsedNs = MidiClock_NowNs() - result->ElapsedNs;
+    result->Allocs.Count = allocs.Count - result->Allocs.Count;
+    result->Allocs.Bytes = allocs.Bytes - result->Allocs.Bytes;
+}
+
+static void Bench_Report(const char* name, const BenchResult_t* result, uint32_t iterations)
+{
+    double seconds = result->ElapsedNs / 1e9;
+    if (seconds <= 0)
+        seconds = 1e-9;
+
+    printf("%-24s %10.3f ms/op %12.0f events/s %10.1f MB/s %10.1f allocs/op %12.0f bytes/op\n",
+           name,
+           1e3 * seconds / iterations,
+           result->Events / seconds,
+           result->Bytes / seconds / 1e6,
+           (double)result->Allocs.Count / iterations,
+           (double)result->Allocs.Bytes / iterations);
+}
+
+// BENCHMARKS
+// ===================================================================
+static void Bench_OpenMemory(const BenchBuffer_t* file, uint32_t flags, const char* name, uint32_t iterations)
+{
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        MidiFile_t* midi = MidiFile_OpenMemory(file->data, file->length, flags);
+        if (midi == NULL)
+        {
+            fprintf(stderr, "\n%s failed: %s\n", name, Midi_GetErrorString(Midi_GetLastError().Code));
+            return;
+        }
+
+        result.Events += Bench_CountEvents(midi);
+        result.Bytes += file->length;
+        MidiFile_Close(midi);
+    }
+
+    Bench_End(&result);
+    Bench_Report(name, &result, iterations);
+}
+
+static void Bench_OpenFile(const char* filename, uint32_t length, uint32_t flags, const char* name, uint32_t iterations)
+{
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        MidiFile_t* midi = MidiFile_OpenEx(filename, flags);
+        if (midi == NULL)
+        {
+            fprintf(stderr, "\n%s failed: %s\n", name, Midi_GetErrorString(Midi_GetLastError().Code));
+            return;
+        }
+
+        result.Events += Bench_CountEvents(midi);
+        result.Bytes += length;
+        MidiFile_Close(midi);
+    }
+
+    Bench_End(&result);
+    Bench_Report(name, &result, iterations);
+}
+
+static void Bench_SaveToBuffer(const MidiFile_t* midi, uint32_t flags, const char* name, uint32_t iterations)
+{
+    int size = MidiFile_GetEncodedSize(midi, flags);
+    void* buffer = (size > 0) ? malloc(size) : NULL;
+    if (buffer == NULL)
+        return;
+
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        if (MidiFile_SaveToBuffer(midi, buffer, size, flags) != size)
+        {
+            fprintf(stderr, "\n%s failed\n", name);
+            break;
+        }
+
+        result.Events += Bench_CountEvents(midi);
+        result.Bytes += size;
+    }
+
+    Bench_End(&result);
+    Bench_Report(name, &result, iterations);
+    free(buffer);
+}
+
+static void Bench_SaveFile(const MidiFile_t* midi, const char* filename, const char* name, uint32_t iterations)
+{
+    int size = MidiFile_GetEncodedSize(midi, MIDI_SAVE_DEFAULT);
+
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        if (MidiFile_Save(filename, midi) != 0)
+        {
+            fprintf(stderr, "\n%s failed\n", name);
+            break;
+        }
+
+        result.Events += Bench_CountEvents(midi);
+        result.Bytes += size;
+    }
+
+    Bench_End(&result);
+    Bench_Report(name, &result, iterations);
+}
+
+static void Bench_MapAbsoluteTime(const MidiFile_t* midi, uint32_t iterations)
+{
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        MidiAbsoluteTimeMap_t* list = NULL;
+        Midi_MapAbsoluteTime(&list, midi);
+        free(list);
+
+        result.Events += Bench_CountEvents(midi);
+    }
+
+    Bench_End(&result);
+    Bench_Report("Midi_MapAbsoluteTime", &result, iterations);
+}
+
+static void Bench_Transpose(MidiFile_t* midi, uint32_t iterations)
+{
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        // alternate between C major and D major so the keys stay in range
+        Midi_Transpose(midi, &Midi_Transposition_Table[(i & 1) ? 7 : 5]);
+        result.Events += Bench_CountEvents(midi);
+    }
+
+    Bench_End(&result);
+    Bench_Report("Midi_Transpose", &result, iterations);
+}
+
+static void Bench_Play(const MidiFile_t* midi, uint32_t iterations)
+{
+    MidiPlayOptions_t options = {0};
+    options.DryRun = 1;
+
+    BenchResult_t result;
+    Bench_Begin(&result);
+
+    for (uint32_t i = 0; i < iterations; i++)
+    {
+        MidiFile_PlayEx(midi, &options);
+        result.Events += Bench_CountEvents(midi);
+    }
+
+    Bench_End(&result);
+    Bench_Report("MidiFile_PlayEx dry run", &result, iterations);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 6)
+    {
+        fprintf(stderr, "\nUsage: [tracks] [events per track] [running status %%] [sysex bytes] [iterations]\n");
+        return -1;
+    }
+
+    BenchCorpus_t corpus = {
+        .Tracks = (argc > 1) ? atoi(argv[1]) : 16,
+        .EventsPerTrack = (argc > 2) ? atoi(argv[2]) : 20000,
+        .RunningStatus = (argc > 3) ? atoi(argv[3]) : 80,
+        .SysExSize = (argc > 4) ? atoi(argv[4]) : 0,
+    };
+    uint32_t iterations = (argc > 5) ? atoi(argv[5]) : 20;
+
+    if (corpus.Tracks == 0 || iterations == 0)
+    {
+        fprintf(stderr, "\nThe corpus needs at least one track and one iteration\n");
+        return -1;
+    }
+
+    Midi_SetLogLevel(MIDI_LOG_ERRORS);
+
+    BenchBuffer_t file = Bench_GenerateFile(&corpus);
+    const char* inputName = "./bench_input.mid";
+    const char* outputName = "./bench_output.mid";
+
+    FILE* input = fopen(inputName, "wb");
+    if (input == NULL || fwrite(file.data, 1, file.length, input) != file.length)
+    {
+        fprintf(stderr, "\nCannot write %s\n", inputName);
+        return -1;
+    }
+    fclose(input);
+
+    printf("Corpus: %u tracks x %u events, %u%% running status, %u byte SysEx, %u bytes, %u iterations\n",
+           corpus.Tracks, corpus.EventsPerTrack, corpus.RunningStatus, corpus.SysExSize, file.length, iterations);
+
+    #ifndef EZMIDI_ALLOC_STATS
+    printf("(allocations are only counted when built with EZMIDI_ALLOC_STATS)\n");
+    #endif
+
+    Bench_OpenMemory(&file, MIDI_OPEN_DEFAULT, "OpenMemory", iterations);
+    Bench_OpenMemory(&file, MIDI_OPEN_ARENA, "OpenMemory arena", iterations);
+    Bench_OpenMemory(&file, MIDI_OPEN_ARENA | MIDI_OPEN_ZERO_COPY, "OpenMemory zero-copy", iterations);
+    Bench_OpenMemory(&file, MIDI_OPEN_ARENA | MIDI_OPEN_PARALLEL, "OpenMemory parallel", iterations);
+    Bench_OpenFile(inputName, file.length, MIDI_OPEN_DEFAULT, "MidiFile_Open", iterations);
+    Bench_OpenFile(inputName, file.length, MIDI_OPEN_MAPPED | MIDI_OPEN_ARENA, "MidiFile_OpenEx mapped", iterations);
+
+    MidiFile_t* midi = MidiFile_OpenMemory(file.data, file.length, MIDI_OPEN_DEFAULT);
+    if (midi == NULL)
+    {
+        fprintf(stderr, "\nCannot parse the corpus: %s\n", Midi_GetErrorString(Midi_GetLastError().Code));
+        return -1;
+    }
+
+    Bench_SaveToBuffer(midi, MIDI_SAVE_DEFAULT, "SaveToBuffer", iterations);
+    Bench_SaveToBuffer(midi, MIDI_SAVE_RUNNING_STATUS, "SaveToBuffer running", iterations);
+    Bench_SaveFile(midi, outputName, "MidiFile_Save", iterations);
+    Bench_MapAbsoluteTime(midi, iterations);
+    Bench_Transpose(midi, iterations);
+    Bench_Play(midi, iterations);
+
+    printf("Peak RSS: %llu kB\n", (unsigned long long)Bench_PeakMemoryKb());
+
+    MidiFile_Close(midi);
+    free(file.data);
+    remove(inputName);
+    remove(outputName);
+
+    return 0;
+}
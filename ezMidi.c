@@ -20,11 +20,244 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 
 
+// ALLOCATION STATISTICS
+// ===================================================================
+// with EZMIDI_ALLOC_STATS defined every allocation made by the library is counted, to be reported by the benchmarks
+#ifdef EZMIDI_ALLOC_STATS
+static atomic_ullong allocCount, allocBytes;
+
+static void* Midi_CountedMalloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocBytes, size, memory_order_relaxed);
+    return malloc(size);
+}
+
+static void* Midi_CountedCalloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&allocCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocBytes, count * size, memory_order_relaxed);
+    return calloc(count, size);
+}
+
+static void* Midi_CountedRealloc(void* ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&allocCount, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&allocBytes, size, memory_order_relaxed);
+    return realloc(ptr, size);
+}
+
+#define malloc(size) Midi_CountedMalloc(size)
+#define calloc(count, size) Midi_CountedCalloc(count, size)
+#define realloc(ptr, size) Midi_CountedRealloc(ptr, size)
+
+MidiAllocStats_t Midi_GetAllocStats()
+{
+    return (MidiAllocStats_t){
+        .Count = atomic_load(&allocCount),
+        .Bytes = atomic_load(&allocBytes),
+    };
+}
+#else
+MidiAllocStats_t Midi_GetAllocStats()
+{
+    return (MidiAllocStats_t){0, 0};
+}
+#endif
+
+// MEMORY ARENA
+// ===================================================================
+// payloads are carved sequentially out of large blocks and released all at once
+// each new block is at least twice as big as the previous, so a file needs only a handful of blocks
+#define MIDI_ARENA_ALIGNMENT 8
+#define MIDI_ARENA_MIN_BLOCK 4096
+
+typedef struct MidiArenaBlock {
+    struct MidiArenaBlock* next; // previously filled block
+    size_t size; // usable bytes in data[]
+    size_t used; // bytes already handed out
+    char data[];
+} MidiArenaBlock_t;
+
+struct MidiArena {
+    MidiArenaBlock_t* head; // block currently being filled
+};
+
+static MidiArenaBlock_t* MidiArena_NewBlock(MidiArena_t* arena, size_t size)
+{
+    MidiArenaBlock_t* block = (MidiArenaBlock_t*)malloc(sizeof(MidiArenaBlock_t) + size);
+    if (block == NULL)
+        return NULL;
+
+    *block = (MidiArenaBlock_t){
+        .next = arena->head,
+        .size = size,
+        .used = 0,
+    };
+
+    arena->head = block;
+    return block;
+}
+
+MidiArena_t* MidiArena_Create(size_t initialSize)
+{
+    MidiArena_t* arena = (MidiArena_t*)malloc(sizeof(MidiArena_t));
+    if (arena == NULL)
+        return NULL;
+
+    arena->head = NULL;
+
+    if (MidiArena_NewBlock(arena, (initialSize > MIDI_ARENA_MIN_BLOCK) ? initialSize : MIDI_ARENA_MIN_BLOCK) == NULL)
+    {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+void* MidiArena_Alloc(MidiArena_t* arena, size_t size)
+{
+    MidiArenaBlock_t* block = arena->head;
+
+    // next aligned position in the current block
+    size_t offset = (block->used + MIDI_ARENA_ALIGNMENT - 1) & ~(size_t)(MIDI_ARENA_ALIGNMENT - 1);
+
+    if (offset + size > block->size)
+    {
+        size_t grow = block->size * 2;
+        if ((block = MidiArena_NewBlock(arena, (grow > size) ? grow : size)) == NULL)
+            return NULL;
+
+        offset = 0;
+    }
+
+    block->used = offset + size;
+    return &block->data[offset];
+}
+
+// moves every block of src into dst and destroys src; dst keeps filling its current block
+void MidiArena_Merge(MidiArena_t* dst, MidiArena_t* src)
+{
+    if (src == NULL)
+        return;
+
+    MidiArenaBlock_t* last = src->head;
+    while (last->next != NULL)
+        last = last->next;
+
+    last->next = dst->head->next;
+    dst->head->next = src->head;
+
+    free(src);
+}
+
+// releases every allocation at once but keeps the current block, so the arena can be filled again without new blocks
+static void MidiArena_Reset(MidiArena_t* arena)
+{
+    for (MidiArenaBlock_t* block = arena->head->next, *next; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+void MidiArena_Destroy(MidiArena_t* arena)
+{
+    if (arena == NULL)
+        return;
+
+    for (MidiArenaBlock_t* block = arena->head, *next; block != NULL; block = next)
+    {
+        next = block->next;
+        free(block);
+    }
+
+    free(arena);
+}
+
+// ERRORS
+// ===================================================================
+// diagnostics go to stderr and progress to stdout, each only up to the log level
+// the level of a thread can be capped further, like the batch workers do to keep off the console
+static atomic_int logLevel = MIDI_LOG_INFO;
+static _Thread_local int threadLogCap = MIDI_LOG_INFO;
+
+void Midi_SetLogLevel(MidiLogLevel_t level)
+{
+    atomic_store_explicit(&logLevel, level, memory_order_relaxed);
+}
+
+MidiLogLevel_t Midi_GetLogLevel()
+{
+    return (MidiLogLevel_t)atomic_load_explicit(&logLevel, memory_order_relaxed);
+}
+
+static void Midi_Log(MidiLogLevel_t level, const char* format, ...)
+{
+    if ((int)level > atomic_load_explicit(&logLevel, memory_order_relaxed) || (int)level > threadLogCap)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf((level == MIDI_LOG_INFO) ? stdout : stderr, format, args);
+    va_end(args);
+}
+
+// the parser does not print: the cause of the last failure is kept per thread, to be queried by the caller
+static _Thread_local MidiErrorInfo_t lastError = {MIDI_OK, -1, 0};
+
+// always returns -1, so failing paths can just "return Midi_SetError(...)"
+static int Midi_SetError(MidiError_t code)
+{
+    lastError = (MidiErrorInfo_t){
+        .Code = code,
+        .Track = -1,
+        .Offset = 0,
+    };
+
+    return -1;
+}
+
+MidiErrorInfo_t Midi_GetLastError()
+{
+    return lastError;
+}
+
+void Midi_ClearError()
+{
+    lastError = (MidiErrorInfo_t){MIDI_OK, -1, 0};
+}
+
+const char* Midi_GetErrorString(MidiError_t error)
+{
+    switch (error)
+    {
+        case MIDI_OK:                   return "No error";
+        case MIDI_ERROR_TRUNCATED:      return "Data ends in the middle of an event or chunk";
+        case MIDI_ERROR_BAD_VLQ:        return "Variable-length quantity longer than 4 bytes";
+        case MIDI_ERROR_BAD_LENGTH:     return "Wrong length for event type";
+        case MIDI_ERROR_UNKNOWN_EVENT:  return "Unknown event type, its size cannot be determined";
+        case MIDI_ERROR_RUNNING_STATUS: return "Data byte without a running status in effect";
+        case MIDI_ERROR_BAD_HEADER:     return "Missing, repeated or malformed header chunk";
+        case MIDI_ERROR_BAD_CHUNK:      return "Unknown chunk type or more tracks than declared";
+        case MIDI_ERROR_ALLOCATION:     return "Allocation error";
+        case MIDI_ERROR_IO:             return "Could not open or read the file";
+    }
+
+    return "Unknown error";
+}
+
 // MIDI EVENTS
 // ===================================================================
-#define read_data_params (const char* buffer_ptr, uint8_t type, void* data_ptr)
+#define read_data_params (const char* buffer_ptr, uint32_t buffer_len, uint8_t type, void* data_ptr)
 #define read_data_dclr(name) static const int name read_data_params
 
 #define write_data_params (char* buffer_ptr, const MidiEvent_t* event)
@@ -33,69 +266,89 @@
 #define print_data_params (const void* data_ptr, char output_text[])
 #define print_data_dclr(name) static const int name print_data_params
 
+#define size_data_params (const MidiEvent_t* event)
+#define size_data_dclr(name) static const int name size_data_params
+#define size_data_fixed(name, size) size_data_dclr(name) { return (size); }
+
 struct MidiEventInterface {
     const int type;
     const char* description;
     const int alloc_size; // how much should we allocate for the data_ptr
-    const int (*read_data) read_data_params;
+    const int (*read_data) read_data_params; // reads at most buffer_len bytes of length and data, returns number of bytes read or -1
     const int (*write_data) write_data_params; // writes type, length and data, returns number of bytes written
     const int (*print_data) print_data_params; // reads length and data, returns number of bytes read
+    const int (*size_data) size_data_params; // how many bytes write_data will write
 };
 
 // META EVENTS
 // format: FF type len <data>
-const static char* err_wrong_size = "\nWrong length for event type: expected %u but got %u";
-#define declare_len() uint8_t len = *((uint8_t*)(buffer_ptr))
-#define assert_len(desired_len) {if((len) != (desired_len)) {fprintf(stderr, err_wrong_size, (desired_len), (len)); return -1;}}
+#define require_len(needed) {if (buffer_len < (needed)) return Midi_SetError(MIDI_ERROR_TRUNCATED);}
+#define declare_len() require_len(1); uint8_t len = *((uint8_t*)(buffer_ptr))
+#define assert_len(desired_len) {if((len) != (desired_len)) return Midi_SetError(MIDI_ERROR_BAD_LENGTH); require_len(1 + (desired_len));}
 #define read_integer_at(i) ( *(uint8_t*)(buffer_ptr + (i)) )
 
+int ReadVariableLength(const char* buffer, uint32_t bufflen, uint32_t *outvalue);
+int WriteVariableLength(char* buffer, uint32_t bufflen, uint32_t value);
+static inline uint32_t VariableLengthSize(uint32_t value);
+
 // FF xx: len <text>
+// the length is a variable-length quantity; the text is left pointing into the buffer (see MidiEvent_CopyPayload)
 read_data_dclr(read_data_Text)
 {
-    declare_len();
-
-    if (len > MidiEventData_Text_Max_Length - 1)
-    {
-        fprintf(stderr, "\nTextEvent has length (%u) larger than buffer!", len);
+    uint32_t len;
+    int lenlen = ReadVariableLength(buffer_ptr, buffer_len, &len);
+    if (lenlen < 0)
         return -1;
-    }
+
+    if (len > buffer_len - lenlen)
+        return Midi_SetError(MIDI_ERROR_TRUNCATED);
 
     *(MidiEventData_Text_t*)data_ptr = (MidiEventData_Text_t){
         .length = len,
+        .text = buffer_ptr + lenlen,
     };
 
-    sprintf(((MidiEventData_Text_t*)data_ptr)->text, "%.*s", len, (char*)(buffer_ptr+1));
-
-    return 1 + len;
+    return lenlen + len;
 }
 
 write_data_dclr(write_data_Text)
 {
-    uint8_t len = ((MidiEventData_Text_t*)event->data)->length;
+    const MidiEventData_Text_t* text = (const MidiEventData_Text_t*)event->data;
+    int header;
 
     if (event->interface->type == Midi_Event_Type_SysEx2)
     {
-        char data[] = {Midi_Event_Type_SysEx2, (char)len};
-
-        memcpy(buffer_ptr, data, 2);
-        memcpy(&buffer_ptr[2], ((MidiEventData_Text_t*)event->data)->text, len);
-
-        return 2 + len;
+        buffer_ptr[0] = Midi_Event_Type_SysEx2;
+        header = 1;
     }
     else
     {
-        char data[] = {0xFF,  (char)(event->interface->type), (char)len};
+        buffer_ptr[0] = 0xFF;
+        buffer_ptr[1] = (char)(event->interface->type);
+        header = 2;
+    }
 
-        memcpy(buffer_ptr, data, 3);
-        memcpy(&buffer_ptr[3], ((MidiEventData_Text_t*)event->data)->text, len);
+    header += WriteVariableLength(&buffer_ptr[header], VariableLengthSize(text->length), text->length);
 
-        return 3 + len;
-    }
+    if (text->length > 0)
+        memcpy(&buffer_ptr[header], text->text, text->length);
+
+    return header + text->length;
 }
 
 print_data_dclr(print_data_Text)
 {
-    return sprintf(output_text, "\"%s\"", ((MidiEventData_Text_t*)data_ptr)->text);
+    const MidiEventData_Text_t* text = (const MidiEventData_Text_t*)data_ptr;
+    int length = (text->length > 250) ? 250 : (int)text->length; // the output holds 256 characters
+
+    return sprintf(output_text, "\"%.*s\"", length, text->text);
+}
+
+size_data_dclr(size_data_Text)
+{
+    uint32_t length = ((MidiEventData_Text_t*)event->data)->length;
+
+    return ((event->interface->type == Midi_Event_Type_SysEx2) ? 1 : 2) + VariableLengthSize(length) + length;
 }
 
 // FF 00: 02 nn-nn
@@ -122,6 +375,8 @@ print_data_dclr(print_data_SequenceNumber)
     return sprintf(output_text, "%u", ((MidiEventData_SequenceNumber_t*)data_ptr)->number);
 }
 
+size_data_fixed(size_data_SequenceNumber, 5)
+
 // FF 20: 01 cc
 read_data_dclr(read_data_ChannelPrefix)
 {
@@ -134,7 +389,7 @@ read_data_dclr(read_data_ChannelPrefix)
     };
 
     if (cp->channel > 15)
-        fprintf(stderr, "\nWarning: ChannelPrefix has invalid channel %u (maximum is 15)", cp->channel);
+        Midi_Log(MIDI_LOG_WARNINGS, "\nWarning: ChannelPrefix has invalid channel %u (maximum is 15)", cp->channel);
 
     return 2;
 }
@@ -150,6 +405,8 @@ print_data_dclr(print_data_ChannelPrefix)
     return sprintf(output_text, "%u", ((MidiEventData_ChannelPrefix_t*)data_ptr)->channel);
 }
 
+size_data_fixed(size_data_ChannelPrefix, 4)
+
 // FF 21: 01 pp
 read_data_dclr(read_data_MidiPort)
 {
@@ -174,6 +431,8 @@ print_data_dclr(print_data_MidiPort)
     return sprintf(output_text, "%u", ((MidiEventData_MidiPort_t*)data_ptr)->port);
 }
 
+size_data_fixed(size_data_MidiPort, 4)
+
 // FF 51: 03 tt-tt-tt
 read_data_dclr(read_data_SetTempo)
 {
@@ -200,6 +459,8 @@ print_data_dclr(print_data_SetTempo)
     return sprintf(output_text, "%u", ((MidiEventData_SetTempo_t*)data_ptr)->tempo);
 }
 
+size_data_fixed(size_data_SetTempo, 6)
+
 // FF 54: 05 hr mn se fr ff
 read_data_dclr(read_data_SMPTEoffset)
 {
@@ -219,8 +480,10 @@ read_data_dclr(read_data_SMPTEoffset)
 
 write_data_dclr(write_data_SMPTEoffset)
 {
-    /* TODO */
-    return 0;
+    MidiEventData_SMPTEoffset_t* offset = (MidiEventData_SMPTEoffset_t*)event->data;
+
+    memcpy(buffer_ptr, (char[]){0xFF, Midi_Event_Type_SMPTEoffset, 5, offset->hr, offset->mn, offset->se, offset->fr, offset->ff}, 8);
+    return 8;
 }
 
 print_data_dclr(print_data_SMPTEoffset)
@@ -230,6 +493,8 @@ print_data_dclr(print_data_SMPTEoffset)
     return sprintf(output_text, "HR:%u  MN:%u  SE:%u  FR:%u  FF:%u", offset->hr, offset->mn, offset->se, offset->fr, offset->ff);
 }
 
+size_data_fixed(size_data_SMPTEoffset, 8)
+
 // FF 58 04 nn dd cc bb
 read_data_dclr(read_data_TimeSignature)
 {
@@ -261,6 +526,8 @@ print_data_dclr(print_data_TimeSignature)
     return sprintf(output_text, "numerator:%u  denominator:%u  cc:%u  bb:%u", ts->nn, ts->dd, ts->cc, ts->bb);
 }
 
+size_data_fixed(size_data_TimeSignature, 7)
+
 // FF 59: 02 sf mi
 read_data_dclr(read_data_KeySignature)
 {
@@ -274,7 +541,7 @@ read_data_dclr(read_data_KeySignature)
     };
 
     if (ks->mi != 0 && ks->mi != 1)
-        fprintf(stderr, "\nWarning: KeySignature has invalid mi=%u", ks->mi);
+        Midi_Log(MIDI_LOG_WARNINGS, "\nWarning: KeySignature has invalid mi=%u", ks->mi);
 
     return 3;
 }
@@ -292,10 +559,12 @@ print_data_dclr(print_data_KeySignature)
     return sprintf(output_text, "sf:%d  mi:%d = %s", (int8_t)((MidiEventData_KeySignature_t*)data_ptr)->sf, ((MidiEventData_KeySignature_t*)data_ptr)->mi, Midi_GetKeySignatureTranspositionInfo((MidiEventData_KeySignature_t*)data_ptr)->description);
 }
 
+size_data_fixed(size_data_KeySignature, 5)
+
 // FF 7F: len <data>
 read_data_dclr(read_data_SysEx)
 {
-    return read_data_Text(buffer_ptr, type, data_ptr);
+    return read_data_Text(buffer_ptr, buffer_len, type, data_ptr);
 }
 
 write_data_dclr(write_data_SysEx)
@@ -308,6 +577,11 @@ print_data_dclr(print_data_SysEx)
     return print_data_Text(data_ptr, output_text);
 }
 
+size_data_dclr(size_data_SysEx)
+{
+    return size_data_Text(event);
+}
+
 // FF 2F: 00
 read_data_dclr(read_data_EndOfTrack)
 {
@@ -328,83 +602,177 @@ print_data_dclr(print_data_EndOfTrack)
     return sprintf(output_text, "End of Track");
 }
 
+size_data_fixed(size_data_EndOfTrack, 3)
+
 // CHANNEL EVENTS
 // format: xxxxnnnn aaaaaa bbbbb
+// a single codec switches on the status nibble: the decode and encode loops inline it (see MidiEvent_ReadData),
+// the interface functions only wrap it for the other callers
+
+// the codec is forced inline: the interface also takes its address, which otherwise keeps the compiler from inlining it
+#if defined(__GNUC__)
+#define MIDI_ALWAYS_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define MIDI_ALWAYS_INLINE __forceinline
+#else
+#define MIDI_ALWAYS_INLINE inline
+#endif
 
-// on = 1001nnnn: 0kkkkkkk 0vvvvvvv
-// off = 1001nnnn: 0kkkkkkk 0vvvvvvv
+// number of data bytes after the status, by status nibble (0: not a channel event)
+static const uint8_t ChannelDataLength[16] = {
+    [Midi_Event_Type_NoteOff >> 4] = 2,
+    [Midi_Event_Type_NoteOn >> 4] = 2,
+    [Midi_Event_Type_PolyphonicKeyPressure >> 4] = 2,
+    [Midi_Event_Type_ControlChange >> 4] = 2,
+    [Midi_Event_Type_ProgramChange >> 4] = 1,
+    [Midi_Event_Type_ChannelPressure >> 4] = 1,
+    [Midi_Event_Type_PitchWheelChange >> 4] = 2,
+};
 
-read_data_dclr(read_data_Note)
+// 0x80 - 0xEF: SysEx2 (0xF0) and the meta types are not channel events
+static inline uint8_t MidiEvent_IsChannelType(int type)
 {
-    *(MidiEventData_NoteEvent_t*)data_ptr = (MidiEventData_NoteEvent_t){
-        .channel = type & 0x0F,
-        .key = read_integer_at(0),
-        .velocity = read_integer_at(1),
-        .OnOff = type & 0xF0
-    };
-
-    return 2;
+    return (unsigned)(type - 0x80) < 0x70;
 }
 
-write_data_dclr(write_data_Note)
+// type is the status byte as found in the track
+static MIDI_ALWAYS_INLINE int MidiChannel_Read read_data_params
 {
-    MidiEventData_NoteEvent_t* note = (MidiEventData_NoteEvent_t*)event->data;
+    uint8_t channel = type & 0x0F;
+    const uint8_t* bytes = (const uint8_t*)buffer_ptr;
 
-    memcpy(buffer_ptr, (char[]){note->OnOff | note->channel, note->key, note->velocity}, 3);
+    require_len(ChannelDataLength[type >> 4]);
 
-    return 3;
-}
+    switch (type >> 4)
+    {
+        // on = 1001nnnn: 0kkkkkkk 0vvvvvvv
+        // off = 1000nnnn: 0kkkkkkk 0vvvvvvv
+        case Midi_Event_Type_NoteOff >> 4:
+        case Midi_Event_Type_NoteOn >> 4:
+            *(MidiEventData_NoteEvent_t*)data_ptr = (MidiEventData_NoteEvent_t){
+                .channel = channel,
+                .key = bytes[0],
+                .velocity = bytes[1],
+                .OnOff = type & 0xF0
+            };
+            return 2;
+
+        // 1010nnnn: 0kkkkkkk 0vvvvvvv
+        case Midi_Event_Type_PolyphonicKeyPressure >> 4:
+            *(MidiEventData_PolyphonicKeyPressure_t*)data_ptr = (MidiEventData_PolyphonicKeyPressure_t){
+                .channel = channel,
+                .key = bytes[0],
+                .pressure = bytes[1],
+            };
+            return 2;
+
+        // 1011nnnn: 0ccccccc 0vvvvvvv
+        case Midi_Event_Type_ControlChange >> 4:
+            *(MidiEventData_ControlChange_t*)data_ptr = (MidiEventData_ControlChange_t){
+                .channel = channel,
+                .control = bytes[0],
+                .value = bytes[1]
+            };
+            return 2;
+
+        // 1100nnnn: 0ppppppp
+        case Midi_Event_Type_ProgramChange >> 4:
+            *(MidiEventData_ProgramChange_t*)data_ptr = (MidiEventData_ProgramChange_t){
+                .channel = channel,
+                .program = bytes[0],
+            };
+            return 1;
+
+        // 1101nnnn: 0vvvvvvv
+        case Midi_Event_Type_ChannelPressure >> 4:
+            *(MidiEventData_ChannelPressure_t*)data_ptr = (MidiEventData_ChannelPressure_t){
+                .channel = channel,
+                .pressure = bytes[0],
+            };
+            return 1;
+
+        // 1110nnnn: 0lllllll 0mmmmmmm
+        case Midi_Event_Type_PitchWheelChange >> 4:
+            *(MidiEventData_PitchWheelChange_t*)data_ptr = (MidiEventData_PitchWheelChange_t){
+                .channel = channel,
+                .wheel = bytes[0] + 128*bytes[1],
+            };
+            return 2;
+    }
 
-print_data_dclr(print_data_Note)
-{
-    return sprintf(output_text, "ch:%u key:%u %s", ((MidiEventData_NoteEvent_t*)data_ptr)->channel, ((MidiEventData_NoteEvent_t*)data_ptr)->key, Midi_GetKeyName(((MidiEventData_NoteEvent_t*)data_ptr)->key));
+    return Midi_SetError(MIDI_ERROR_UNKNOWN_EVENT);
 }
 
-// 1010nnnn: 0kkkkkkk 0vvvvvvv
-read_data_dclr(read_data_PolyphonicKeyPressure)
+static MIDI_ALWAYS_INLINE int MidiChannel_Write write_data_params
 {
-    *(MidiEventData_PolyphonicKeyPressure_t*)data_ptr = (MidiEventData_PolyphonicKeyPressure_t){
-        .channel = type & 0x0F,
-        .key = read_integer_at(0),
-        .pressure = read_integer_at(1),
-    };
+    uint8_t* bytes = (uint8_t*)buffer_ptr;
 
-    return 2;
-}
+    switch (event->interface->type >> 4)
+    {
+        case Midi_Event_Type_NoteOff >> 4:
+        case Midi_Event_Type_NoteOn >> 4:
+        {
+            const MidiEventData_NoteEvent_t* note = (const MidiEventData_NoteEvent_t*)event->data;
+            bytes[0] = note->OnOff | note->channel; bytes[1] = note->key; bytes[2] = note->velocity;
+            return 3;
+        }
 
-write_data_dclr(write_data_PolyphonicKeyPressure)
-{
-    MidiEventData_PolyphonicKeyPressure_t* pkp = (MidiEventData_PolyphonicKeyPressure_t*)event->data;
+        case Midi_Event_Type_PolyphonicKeyPressure >> 4:
+        {
+            const MidiEventData_PolyphonicKeyPressure_t* pkp = (const MidiEventData_PolyphonicKeyPressure_t*)event->data;
+            bytes[0] = Midi_Event_Type_PolyphonicKeyPressure | pkp->channel; bytes[1] = pkp->key; bytes[2] = pkp->pressure;
+            return 3;
+        }
 
-    memcpy(buffer_ptr, (char[]){Midi_Event_Type_PolyphonicKeyPressure | pkp->channel, pkp->key, pkp->pressure}, 3);
+        case Midi_Event_Type_ControlChange >> 4:
+        {
+            const MidiEventData_ControlChange_t* cc = (const MidiEventData_ControlChange_t*)event->data;
+            bytes[0] = Midi_Event_Type_ControlChange | cc->channel; bytes[1] = cc->control; bytes[2] = cc->value;
+            return 3;
+        }
 
-    return 3;
+        case Midi_Event_Type_ProgramChange >> 4:
+        {
+            const MidiEventData_ProgramChange_t* pc = (const MidiEventData_ProgramChange_t*)event->data;
+            bytes[0] = Midi_Event_Type_ProgramChange | pc->channel; bytes[1] = pc->program;
+            return 2;
+        }
+
+        case Midi_Event_Type_ChannelPressure >> 4:
+        {
+            const MidiEventData_ChannelPressure_t* cp = (const MidiEventData_ChannelPressure_t*)event->data;
+            bytes[0] = Midi_Event_Type_ChannelPressure | cp->channel; bytes[1] = cp->pressure;
+            return 2;
+        }
+
+        case Midi_Event_Type_PitchWheelChange >> 4:
+        {
+            const MidiEventData_PitchWheelChange_t* pwc = (const MidiEventData_PitchWheelChange_t*)event->data;
+            bytes[0] = Midi_Event_Type_PitchWheelChange | pwc->channel; bytes[1] = pwc->wheel % 128; bytes[2] = pwc->wheel / 128;
+            return 3;
+        }
+    }
+
+    return 0;
 }
 
-print_data_dclr(print_data_PolyphonicKeyPressure)
+static MIDI_ALWAYS_INLINE int MidiChannel_Size size_data_params
 {
-    return sprintf(output_text, "ch:%u  key:%u  pressure:%u", ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->channel, ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->key, ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->pressure);
+    return 1 + ChannelDataLength[event->interface->type >> 4];
 }
 
-// 1011nnnn: 0ccccccc 0vvvvvvv
-read_data_dclr(read_data_ControlChange)
-{
-    *(MidiEventData_ControlChange_t*)data_ptr = (MidiEventData_ControlChange_t){
-        .channel = type & 0x0F,
-        .control = read_integer_at(0),
-        .value = read_integer_at(1)
-    };
+read_data_dclr(read_data_Channel) { return MidiChannel_Read(buffer_ptr, buffer_len, type, data_ptr); }
+write_data_dclr(write_data_Channel) { return MidiChannel_Write(buffer_ptr, event); }
+size_data_dclr(size_data_Channel) { return MidiChannel_Size(event); }
 
-    return 2;
+print_data_dclr(print_data_Note)
+{
+    return sprintf(output_text, "ch:%u key:%u %s", ((MidiEventData_NoteEvent_t*)data_ptr)->channel, ((MidiEventData_NoteEvent_t*)data_ptr)->key, Midi_GetKeyName(((MidiEventData_NoteEvent_t*)data_ptr)->key));
 }
 
-write_data_dclr(write_data_ControlChange)
+print_data_dclr(print_data_PolyphonicKeyPressure)
 {
-    MidiEventData_ControlChange_t* cc = (MidiEventData_ControlChange_t*)event->data;
-
-    memcpy(buffer_ptr, (char[]){Midi_Event_Type_ControlChange | cc->channel, cc->control, cc->value}, 3);
-
-    return 3;
+    return sprintf(output_text, "ch:%u  key:%u  pressure:%u", ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->channel, ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->key, ((MidiEventData_PolyphonicKeyPressure_t*)data_ptr)->pressure);
 }
 
 print_data_dclr(print_data_ControlChange)
@@ -412,139 +780,167 @@ print_data_dclr(print_data_ControlChange)
     return sprintf(output_text, "ch:%u  control:%u  value:%u", ((MidiEventData_ControlChange_t*)data_ptr)->channel, ((MidiEventData_ControlChange_t*)data_ptr)->control, ((MidiEventData_ControlChange_t*)data_ptr)->value);
 }
 
-// 1100nnnn: 0ppppppp
-read_data_dclr(read_data_ProgramChange)
+print_data_dclr(print_data_ProgramChange)
 {
-    *(MidiEventData_ProgramChange_t*)data_ptr = (MidiEventData_ProgramChange_t){
-        .channel = type & 0x0F,
-        .program = read_integer_at(0),
-    };
-
-    return 1;
+    return sprintf(output_text, "ch:%u  program:%u %s", ((MidiEventData_ProgramChange_t*)data_ptr)->channel, ((MidiEventData_ProgramChange_t*)data_ptr)->program, Midi_GetInstrumentName(((MidiEventData_ProgramChange_t*)data_ptr)->program));
 }
 
-write_data_dclr(write_data_ProgramChange)
+print_data_dclr(print_data_ChannelPressure)
 {
-    MidiEventData_ProgramChange_t* pc = (MidiEventData_ProgramChange_t*)event->data;
-
-    memcpy(buffer_ptr, (char[]){Midi_Event_Type_ProgramChange | pc->channel, pc->program}, 2);
-
-    return 2;
+    return sprintf(output_text, "ch:%u  pressure:%u", ((MidiEventData_ChannelPressure_t*)data_ptr)->channel, ((MidiEventData_ChannelPressure_t*)data_ptr)->pressure);
 }
 
-print_data_dclr(print_data_ProgramChange)
+print_data_dclr(print_data_PitchWheelChange)
 {
-    return sprintf(output_text, "ch:%u  program:%u %s", ((MidiEventData_ProgramChange_t*)data_ptr)->channel, ((MidiEventData_ProgramChange_t*)data_ptr)->program, Midi_GetInstrumentName(((MidiEventData_ProgramChange_t*)data_ptr)->program));
+    return sprintf(output_text, "ch:%u  wheel:%u", ((MidiEventData_PitchWheelChange_t*)data_ptr)->channel, ((MidiEventData_PitchWheelChange_t*)data_ptr)->wheel);
 }
 
-// 1101nnnn: 0vvvvvvv
-read_data_dclr(read_data_ChannelPressure)
+// direct lookup tables: resolving the interface of an event is a single indexed load
+// entries not listed are zero-initialized (read_data == NULL) and mean "unknown event"
+
+// meta events (FF type ...) indexed by their type byte
+static const MidiEventInterface_t MetaInterfaceTable[256] = {
+    [Midi_Event_Type_Text]              = {Midi_Event_Type_Text,              "Text",             sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_Copyright]         = {Midi_Event_Type_Copyright,         "Copyright notice", sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_SequenceName]      = {Midi_Event_Type_SequenceName,      "Sequence name",    sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_InstrumentName]    = {Midi_Event_Type_InstrumentName,    "Instrument name",  sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_Lyric]             = {Midi_Event_Type_Lyric,             "Lyric",            sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_Marker]            = {Midi_Event_Type_Marker,            "Marker",           sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_CuePoint]          = {Midi_Event_Type_CuePoint,          "Cue Point",        sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+    [Midi_Event_Type_ProgramName]       = {Midi_Event_Type_ProgramName,       "Program name",     sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text, size_data_Text},
+
+
+    [Midi_Event_Type_SequenceNumber]    = {Midi_Event_Type_SequenceNumber,    "Sequence number",  sizeof(MidiEventData_SequenceNumber_t), read_data_SequenceNumber,   write_data_SequenceNumber,  print_data_SequenceNumber, size_data_SequenceNumber},
+    [Midi_Event_Type_ChannelPrefix]     = {Midi_Event_Type_ChannelPrefix,     "Channel prefix",   sizeof(MidiEventData_ChannelPrefix_t),  read_data_ChannelPrefix,    write_data_ChannelPrefix,   print_data_ChannelPrefix, size_data_ChannelPrefix},
+    [Midi_Event_Type_MidiPort]          = {Midi_Event_Type_MidiPort,          "Midi port",        sizeof(MidiEventData_MidiPort_t),       read_data_MidiPort,         write_data_MidiPort,        print_data_MidiPort, size_data_MidiPort},
+    [Midi_Event_Type_EndOfTrack]        = {Midi_Event_Type_EndOfTrack,        "End of Track",     0,                                      read_data_EndOfTrack,       write_data_EndOfTrack,      print_data_EndOfTrack, size_data_EndOfTrack},
+    [Midi_Event_Type_SetTempo]          = {Midi_Event_Type_SetTempo,          "Set tempo",        sizeof(MidiEventData_SetTempo_t),       read_data_SetTempo,         write_data_SetTempo,        print_data_SetTempo, size_data_SetTempo},
+    [Midi_Event_Type_SMPTEoffset]       = {Midi_Event_Type_SMPTEoffset,       "SMPTE offset",     sizeof(MidiEventData_SMPTEoffset_t),    read_data_SMPTEoffset,      write_data_SMPTEoffset,     print_data_SMPTEoffset, size_data_SMPTEoffset},
+    [Midi_Event_Type_TimeSignature]     = {Midi_Event_Type_TimeSignature,     "Time signature",   sizeof(MidiEventData_TimeSignature_t),  read_data_TimeSignature,    write_data_TimeSignature,   print_data_TimeSignature, size_data_TimeSignature},
+    [Midi_Event_Type_KeySignature]      = {Midi_Event_Type_KeySignature,      "KeySignature",     sizeof(MidiEventData_KeySignature_t),   read_data_KeySignature,     write_data_KeySignature,    print_data_KeySignature, size_data_KeySignature},
+    [Midi_Event_Type_SysEx]             = {Midi_Event_Type_SysEx,             "SysEx",            sizeof(MidiEventData_SysEx_t),          read_data_SysEx,            write_data_SysEx,           print_data_SysEx, size_data_SysEx},
+};
+
+// channel events (and F0 SysEx) indexed by the upper nibble of the status byte
+static const MidiEventInterface_t ChannelInterfaceTable[16] = {
+    [Midi_Event_Type_NoteOn >> 4]       = {Midi_Event_Type_NoteOn,            "Note on",          sizeof(MidiEventData_NoteEvent_t),      read_data_Channel,           write_data_Channel,              print_data_Note, size_data_Channel},
+    [Midi_Event_Type_NoteOff >> 4]      = {Midi_Event_Type_NoteOff,           "Note off",         sizeof(MidiEventData_NoteEvent_t),      read_data_Channel,          write_data_Channel,             print_data_Note, size_data_Channel},
+    [Midi_Event_Type_PolyphonicKeyPressure >> 4] = {Midi_Event_Type_PolyphonicKeyPressure, "Polyphonic key pressure", sizeof(MidiEventData_PolyphonicKeyPressure_t), read_data_Channel, write_data_Channel, print_data_PolyphonicKeyPressure, size_data_Channel},
+    [Midi_Event_Type_ControlChange >> 4] = {Midi_Event_Type_ControlChange,    "Control change",   sizeof(MidiEventData_ControlChange_t),  read_data_Channel,    write_data_Channel,       print_data_ControlChange, size_data_Channel},
+    [Midi_Event_Type_ProgramChange >> 4] = {Midi_Event_Type_ProgramChange,    "Program change",   sizeof(MidiEventData_ProgramChange_t),  read_data_Channel,    write_data_Channel,       print_data_ProgramChange, size_data_Channel},
+    [Midi_Event_Type_ChannelPressure >> 4] = {Midi_Event_Type_ChannelPressure, "Channel pressure", sizeof(MidiEventData_ChannelPressure_t),read_data_Channel,  write_data_Channel,     print_data_ChannelPressure, size_data_Channel},
+    [Midi_Event_Type_PitchWheelChange >> 4] = {Midi_Event_Type_PitchWheelChange, "Pitch wheel change", sizeof(MidiEventData_PitchWheelChange_t),read_data_Channel, write_data_Channel, print_data_PitchWheelChange, size_data_Channel},
+
+    [Midi_Event_Type_SysEx2 >> 4]       = {Midi_Event_Type_SysEx2,            "SysEx2",           sizeof(MidiEventData_SysEx_t),          read_data_SysEx,            write_data_SysEx,           print_data_SysEx, size_data_SysEx},
+};
+
+// statusByte is the meta type when meta != 0, otherwise the status byte as found in the track
+// returns NULL if the event is not known
+const MidiEventInterface_t* MidiEvent_GetInterface(const uint8_t statusByte, const uint8_t meta)
 {
-    *(MidiEventData_ChannelPressure_t*)data_ptr = (MidiEventData_ChannelPressure_t){
-        .channel = type & 0x0F,
-        .pressure = read_integer_at(0),
-    };
+    const MidiEventInterface_t* interface = (meta) ? &MetaInterfaceTable[statusByte] : &ChannelInterfaceTable[statusByte >> 4];
 
-    return 1;
+    return (interface->read_data) ? interface : NULL;
 }
 
-write_data_dclr(write_data_ChannelPressure)
+// used by the decode and encode loops instead of the interface: channel events take the inlined codec
+// and the indirect call is left to meta events and SysEx
+static inline int MidiEvent_ReadData(const MidiEventInterface_t* interface, const char* buffer, uint32_t length, uint8_t statusByte, void* data)
 {
-    MidiEventData_ChannelPressure_t* cp = (MidiEventData_ChannelPressure_t*)event->data;
-
-    memcpy(buffer_ptr, (char[]){Midi_Event_Type_ChannelPressure | cp->channel, cp->pressure}, 2);
+    if (MidiEvent_IsChannelType(interface->type))
+        return MidiChannel_Read(buffer, length, statusByte, data);
 
-    return 2;
+    return interface->read_data(buffer, length, statusByte, data);
 }
 
-print_data_dclr(print_data_ChannelPressure)
+static inline int MidiEvent_WriteData(char* buffer, const MidiEvent_t* event)
 {
-    return sprintf(output_text, "ch:%u  pressure:%u", ((MidiEventData_ChannelPressure_t*)data_ptr)->channel, ((MidiEventData_ChannelPressure_t*)data_ptr)->pressure);
+    if (MidiEvent_IsChannelType(event->interface->type))
+        return MidiChannel_Write(buffer, event);
+
+    return event->interface->write_data(buffer, event);
 }
 
-// 1110nnnn: 0lllllll 0mmmmmmm
-read_data_dclr(read_data_PitchWheelChange)
+static inline int MidiEvent_SizeData(const MidiEvent_t* event)
 {
-    *(MidiEventData_PitchWheelChange_t*)data_ptr = (MidiEventData_PitchWheelChange_t){
-        .channel = type & 0x0F,
-        .wheel = read_integer_at(0) + 128*read_integer_at(1),
-    };
+    if (MidiEvent_IsChannelType(event->interface->type))
+        return MidiChannel_Size(event);
 
-    return 2;
+    return event->interface->size_data(event);
 }
 
-write_data_dclr(write_data_PitchWheelChange)
+int MidiEvent_Init(MidiEvent_t* event, const MidiEventInterface_t* interface, const uint32_t deltaTime, const uint8_t allocData, MidiArena_t* arena)
 {
-    MidiEventData_PitchWheelChange_t* pwc = (MidiEventData_PitchWheelChange_t*)event->data;
+    void* data = NULL;
 
-    memcpy(buffer_ptr, (char[]){Midi_Event_Type_PitchWheelChange | pwc->channel, pwc->wheel % 128, pwc->wheel / 128}, 3);
+    if (allocData)
+    {
+        data = (arena) ? MidiArena_Alloc(arena, interface->alloc_size) : malloc(interface->alloc_size);
 
-    return 3;
-}
+        if (data == NULL && interface->alloc_size > 0)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %d bytes for event data", interface->alloc_size);
+            return Midi_SetError(MIDI_ERROR_ALLOCATION);
+        }
+    }
 
-print_data_dclr(print_data_PitchWheelChange)
-{
-    return sprintf(output_text, "ch:%u  wheel:%u", ((MidiEventData_PitchWheelChange_t*)data_ptr)->channel, ((MidiEventData_PitchWheelChange_t*)data_ptr)->wheel);
-}
+    *event = (MidiEvent_t){
+        .interface = interface,
+        .data = data,
+        .deltaTime = deltaTime,
+    };
 
-static const MidiEventInterface_t InterfaceTable[] = {
-    {Midi_Event_Type_Text,              "Text",             sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_Copyright,         "Copyright notice", sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_SequenceName,      "Sequence name",    sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_InstrumentName,    "Instrument name",  sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_Lyric,             "Lyric",            sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_Marker,            "Marker",           sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_CuePoint,          "Cue Point",        sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-    {Midi_Event_Type_ProgramName,       "Program name",     sizeof(MidiEventData_Text_t), read_data_Text, write_data_Text, print_data_Text},
-
-
-    {Midi_Event_Type_SequenceNumber,    "Sequence number",  sizeof(MidiEventData_SequenceNumber_t), read_data_SequenceNumber,   write_data_SequenceNumber,  print_data_SequenceNumber},
-    {Midi_Event_Type_ChannelPrefix,     "Channel prefix",   sizeof(MidiEventData_ChannelPrefix_t),  read_data_ChannelPrefix,    write_data_ChannelPrefix,   print_data_ChannelPrefix},
-    {Midi_Event_Type_MidiPort,          "Midi port",        sizeof(MidiEventData_MidiPort_t),       read_data_MidiPort,         write_data_MidiPort,        print_data_MidiPort},
-    {Midi_Event_Type_EndOfTrack,        "End of Track",     0,                                      read_data_EndOfTrack,       write_data_EndOfTrack,      print_data_EndOfTrack},
-    {Midi_Event_Type_SetTempo,          "Set tempo",        sizeof(MidiEventData_SetTempo_t),       read_data_SetTempo,         write_data_SetTempo,        print_data_SetTempo},
-    {Midi_Event_Type_SMPTEoffset,       "SMPTE offset",     sizeof(MidiEventData_SMPTEoffset_t),    read_data_SMPTEoffset,      write_data_SMPTEoffset,     print_data_SMPTEoffset},
-    {Midi_Event_Type_TimeSignature,     "Time signature",   sizeof(MidiEventData_TimeSignature_t),  read_data_TimeSignature,    write_data_TimeSignature,   print_data_TimeSignature},
-    {Midi_Event_Type_KeySignature,      "KeySignature",     sizeof(MidiEventData_KeySignature_t),   read_data_KeySignature,     write_data_KeySignature,    print_data_KeySignature},
-    {Midi_Event_Type_SysEx,             "SysEx",            sizeof(MidiEventData_SysEx_t),          read_data_SysEx,            write_data_SysEx,           print_data_SysEx},
-    {Midi_Event_Type_SysEx2,            "SysEx2",           sizeof(MidiEventData_SysEx_t),          read_data_SysEx,            write_data_SysEx,           print_data_SysEx},
-
-
-    {Midi_Event_Type_NoteOn,            "Note on",          sizeof(MidiEventData_NoteEvent_t),      read_data_Note,           write_data_Note,              print_data_Note},
-    {Midi_Event_Type_NoteOff,           "Note off",         sizeof(MidiEventData_NoteEvent_t),      read_data_Note,          write_data_Note,             print_data_Note},
-    {Midi_Event_Type_PolyphonicKeyPressure, "Polyphonic key pressure", sizeof(MidiEventData_PolyphonicKeyPressure_t), read_data_PolyphonicKeyPressure, write_data_PolyphonicKeyPressure, print_data_PolyphonicKeyPressure},
-    {Midi_Event_Type_ControlChange,     "Control change",   sizeof(MidiEventData_ControlChange_t),  read_data_ControlChange,    write_data_ControlChange,       print_data_ControlChange},
-    {Midi_Event_Type_ProgramChange,     "Program change",   sizeof(MidiEventData_ProgramChange_t),  read_data_ProgramChange,    write_data_ProgramChange,       print_data_ProgramChange},
-    {Midi_Event_Type_ChannelPressure,   "Channel pressure", sizeof(MidiEventData_ChannelPressure_t),read_data_ChannelPressure,  write_data_ChannelPressure,     print_data_ChannelPressure},
-    {Midi_Event_Type_PitchWheelChange,  "Pitch wheel change", sizeof(MidiEventData_PitchWheelChange_t),read_data_PitchWheelChange, write_data_PitchWheelChange, print_data_PitchWheelChange},
-};
+    return 0;
+}
 
-int MidiEvent_Create(MidiEvent_t* event, const uint8_t type, const uint32_t deltaTime, const uint8_t allocData)
+// text and SysEx payloads are decoded in place, pointing into the source buffer: this gives the event its own copy
+// without an arena the copy shares the allocation of the event data, so free(event->data) still releases everything
+static int MidiEvent_CopyPayload(MidiEvent_t* event, MidiArena_t* arena)
 {
-    int interface = -1;
+    if (event->interface->read_data != read_data_Text && event->interface->read_data != read_data_SysEx)
+        return 0;
+
+    const MidiEventData_Text_t* source = (const MidiEventData_Text_t*)event->data;
+    const char* text = source->text;
+    uint32_t length = source->length;
+    char* copy;
 
-    for (int i = 0; i < sizeof(InterfaceTable)/sizeof(InterfaceTable[0]); i++)
+    if (arena)
     {
-        if (InterfaceTable[i].type != type)
-            continue;
+        if ((copy = (char*)MidiArena_Alloc(arena, (size_t)length + 1)) == NULL)
+            return Midi_SetError(MIDI_ERROR_ALLOCATION);
+    }
+    else
+    {
+        void* data = realloc(event->data, sizeof(MidiEventData_Text_t) + (size_t)length + 1);
+        if (data == NULL)
+            return Midi_SetError(MIDI_ERROR_ALLOCATION);
 
-        interface = i;
-        break;
+        event->data = data;
+        copy = (char*)data + sizeof(MidiEventData_Text_t);
     }
 
-    if (interface < 0)
+    if (length > 0)
+        memcpy(copy, text, length);
+
+    copy[length] = '\0';
+    ((MidiEventData_Text_t*)event->data)->text = copy;
+
+    return 0;
+}
+
+// type is the meta type (0x00 - 0x7F), the channel event type (0x80 - 0xE0) or SysEx2 (0xF0)
+int MidiEvent_Create(MidiEvent_t* event, const uint8_t type, const uint32_t deltaTime, const uint8_t allocData, MidiArena_t* arena)
+{
+    const MidiEventInterface_t* interface = MidiEvent_GetInterface(type, (type & 0x80) == 0);
+
+    if (interface == NULL)
     {
-        fprintf(stderr, "\nCould not find interface for event type 0x%.02x", type);
+        Midi_Log(MIDI_LOG_ERRORS, "\nCould not find interface for event type 0x%.02x", type);
         return -1;
     }
 
-    *event = (MidiEvent_t){
-        .interface = &InterfaceTable[interface],
-        .data = (allocData) ? malloc(InterfaceTable[interface].alloc_size) : NULL,
-        .deltaTime = deltaTime,
-    };
-
-    return 0;
+    return MidiEvent_Init(event, interface, deltaTime, allocData, arena);
 }
 
 void MidiEvent_Print(FILE* f, const MidiEvent_t* event)
@@ -590,37 +986,79 @@ void u16toarray(uint16_t value, uint8_t arr[2])
 
 // reads a big-endian value with variable length from the file
 // each byte is 7-bit data and the 8th bit (leftmost) is a flag informing to continue reading the next byte
-// saves the read value in a pointer and return the total number of bytes read
-int ReadVariableLength(const char* buffer, uint32_t bufflen, uint32_t *outvalue)
+// the standard limits a quantity to 4 bytes (0x0FFFFFFF), anything longer is malformed
+// saves the read value in a pointer and returns the total number of bytes read, or -1 if truncated and -2 if too long
+static inline int DecodeVariableLength(const uint8_t* buffer, uint32_t bufflen, uint32_t *outvalue)
 {
-    int size_read = 0; // initialize bytes read counter to 0
-    (*outvalue) = 0;   // initialize the output value
-
-    uint8_t read;
-    do {
-        if(size_read >= bufflen)
-            return -1;
-
-        read = *buffer++; // read ONE byte
-        size_read++; // count how many bytes read
+    // nearly all delta-times and lengths take 1 or 2 bytes
+    if (bufflen >= 2)
+    {
+        if (buffer[0] < 0x80)
+        {
+            (*outvalue) = buffer[0];
+            return 1;
+        }
 
-        if (read < 128)
-            (*outvalue) += read;
-        else
+        if (buffer[1] < 0x80)
         {
-            (*outvalue) += read - 128;
-            (*outvalue) *= 128;
+            (*outvalue) = ((uint32_t)(buffer[0] & 0x7F) << 7) | buffer[1];
+            return 2;
         }
-    } while (read >= 128);
+    }
 
-    return size_read;
-}
+#if defined(__GNUC__)
+    if (bufflen >= 4)
+    {
+        // load 4 bytes at once: the first byte without the continuation bit ends the quantity
+        uint32_t word = u32fromarray(buffer);
+        uint32_t stop = ~word & 0x80808080;
 
-int WriteVariableLength(char* buffer, uint32_t bufflen, uint32_t value)
-{
-    uint32_t i = 0, j, v = value;
+        if (stop == 0)
+            return -2;
 
-    while ((v /= 128) > 0) // count how many bytes
+        int size = __builtin_clz(stop) / 8 + 1;
+
+        // pack the four 7-bit groups and drop those that belong to the following bytes
+        uint32_t value = ((word & 0x7F000000) >> 3) | ((word & 0x007F0000) >> 2) | ((word & 0x00007F00) >> 1) | (word & 0x0000007F);
+
+        (*outvalue) = value >> (7 * (4 - size));
+        return size;
+    }
+#endif
+
+    uint32_t value = 0;
+    for (uint32_t size = 0; size < 4; size++)
+    {
+        if (size >= bufflen)
+            return -1;
+
+        value = (value << 7) | (buffer[size] & 0x7F);
+
+        if (buffer[size] < 0x80)
+        {
+            (*outvalue) = value;
+            return size + 1;
+        }
+    }
+
+    return -2;
+}
+
+int ReadVariableLength(const char* buffer, uint32_t bufflen, uint32_t *outvalue)
+{
+    int size = DecodeVariableLength((const uint8_t*)buffer, bufflen, outvalue);
+
+    if (size < 0)
+        return Midi_SetError((size == -1) ? MIDI_ERROR_TRUNCATED : MIDI_ERROR_BAD_VLQ);
+
+    return size;
+}
+
+int WriteVariableLength(char* buffer, uint32_t bufflen, uint32_t value)
+{
+    uint32_t i = 0, j, v = value;
+
+    while ((v /= 128) > 0) // count how many bytes
         i++;
 
     if ((j = i+1) > bufflen) // check if buffer big enough
@@ -633,643 +1071,6349 @@ int WriteVariableLength(char* buffer, uint32_t bufflen, uint32_t value)
     return j;
 }
 
+static inline uint32_t VariableLengthSize(uint32_t value)
+{
+    uint32_t size = 1;
+
+    while ((value /= 128) > 0)
+        size++;
+
+    return size;
+}
+
+// min-heap of tracks keyed by the time of their next event, to merge tracks in O(log tracks) per event
+// ties go to the lowest track, so the merged order is fully deterministic
+typedef struct MidiHeapEntry {
+    uint64_t ticks;
+    uint16_t track;
+} MidiHeapEntry_t;
+
+static inline int MidiHeapEntry_Less(const MidiHeapEntry_t* a, const MidiHeapEntry_t* b)
+{
+    return (a->ticks < b->ticks) || (a->ticks == b->ticks && a->track < b->track);
+}
+
+static void MidiHeap_SiftDown(MidiHeapEntry_t* heap, uint32_t count, uint32_t i)
+{
+    MidiHeapEntry_t entry = heap[i];
+
+    for (uint32_t child; (child = 2*i + 1) < count; i = child)
+    {
+        if (child + 1 < count && MidiHeapEntry_Less(&heap[child + 1], &heap[child]))
+            child++;
+
+        if (!MidiHeapEntry_Less(&heap[child], &entry))
+            break;
+
+        heap[i] = heap[child];
+    }
+
+    heap[i] = entry;
+}
+
+static void MidiHeap_Build(MidiHeapEntry_t* heap, uint32_t count)
+{
+    for (uint32_t i = count / 2; i-- > 0; )
+        MidiHeap_SiftDown(heap, count, i);
+}
+
+// the track at the top of the heap was consumed: update its time, or remove it if it has finished
+static void MidiHeap_ReplaceTop(MidiHeapEntry_t* heap, uint32_t* count, uint8_t finished, uint64_t ticks)
+{
+    if (finished)
+        heap[0] = heap[--(*count)];
+    else
+        heap[0].ticks = ticks;
+
+    if (*count > 1)
+        MidiHeap_SiftDown(heap, *count, 0);
+}
+
+// lock-free ring of fixed-size elements for exactly one producer and one consumer thread
+// head is only written by the producer and tail only by the consumer, each on its own cache line
+typedef struct MidiRing {
+    uint8_t* data;
+    uint32_t elemSize;
+    uint32_t mask; // capacity - 1, capacity is a power of two
+    _Alignas(64) atomic_uint head; // next slot to write
+    _Alignas(64) atomic_uint tail; // next slot to read
+} MidiRing_t;
+
+static int MidiRing_Init(MidiRing_t* ring, uint32_t elemSize, uint32_t capacity)
+{
+    uint32_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    if ((ring->data = (uint8_t*)malloc((size_t)size * elemSize)) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating ring buffer");
+        return -1;
+    }
+
+    ring->elemSize = elemSize;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return 0;
+}
+
+static void MidiRing_Free(MidiRing_t* ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+// returns -1 when the ring is full
+static int MidiRing_Push(MidiRing_t* ring, const void* elem)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask)
+        return -1;
+
+    memcpy(&ring->data[(size_t)(head & ring->mask) * ring->elemSize], elem, ring->elemSize);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release); // publish after the copy
+
+    return 0;
+}
+
+// returns 0 when the ring is empty
+static int MidiRing_Pop(MidiRing_t* ring, void* elem)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail)
+        return 0;
+
+    memcpy(elem, &ring->data[(size_t)(tail & ring->mask) * ring->elemSize], ring->elemSize);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release); // free the slot after the copy
+
+    return 1;
+}
+
+// THREADS
+// ===================================================================
+#if defined(unix) || defined(__unix__) || defined(__unix)
+
+#include <unistd.h>
+#include <pthread.h> // must include "-lpthread" in linker options
+
+typedef struct MidiThread {
+    pthread_t handle;
+    void (*func)(void* arg);
+    void* arg;
+} MidiThread_t;
+
+static void* MidiThread_Entry(void* param)
+{
+    MidiThread_t* thread = (MidiThread_t*)param;
+    thread->func(thread->arg);
+
+    return NULL;
+}
+
+// the thread object must not move until joined
+static int MidiThread_Start(MidiThread_t* thread, void (*func)(void* arg), void* arg)
+{
+    thread->func = func;
+    thread->arg = arg;
+
+    if (pthread_create(&thread->handle, NULL, MidiThread_Entry, thread) != 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError creating thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void MidiThread_Join(MidiThread_t* thread)
+{
+    pthread_join(thread->handle, NULL);
+}
+
+uint32_t Midi_GetCpuCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (count > 0) ? (uint32_t)count : 1;
+}
+
+#endif
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+
+#include <windows.h>
+
+typedef struct MidiThread {
+    HANDLE handle;
+    void (*func)(void* arg);
+    void* arg;
+} MidiThread_t;
+
+static DWORD WINAPI MidiThread_Entry(LPVOID param)
+{
+    MidiThread_t* thread = (MidiThread_t*)param;
+    thread->func(thread->arg);
+
+    return 0;
+}
+
+// the thread object must not move until joined
+static int MidiThread_Start(MidiThread_t* thread, void (*func)(void* arg), void* arg)
+{
+    thread->func = func;
+    thread->arg = arg;
+
+    if ((thread->handle = CreateThread(NULL, 0, MidiThread_Entry, thread, 0, NULL)) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError creating thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void MidiThread_Join(MidiThread_t* thread)
+{
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+}
+
+uint32_t Midi_GetCpuCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+}
+
+#endif
+
 // TRACKS
 // ===================================================================
-void MidiTrack_Read(const char* buffer, uint32_t length, MidiTrack_t* track)
+
+// reads the delta-time and the status of the event at the start of buffer, resolving running status
+// returns how many bytes were read (the data of the event follows), or -1 on error
+// only the header is bounds-checked here: the data is checked by read_data, against the length that is left
+int MidiEvent_ReadHeader(const char* buffer, uint32_t length, uint8_t* running_status, uint32_t* deltaTime, uint8_t* statusByte, const MidiEventInterface_t** interface)
+{
+    uint32_t read = 0;
+
+    // read event delta-time
+    {
+        int variablelen = ReadVariableLength(&buffer[read], length - read, deltaTime); // returns number of bytes read or error code
+        if (variablelen <= 0)
+            return -1;
+        else
+            read += variablelen;
+    }
+
+    if (read >= length)
+        return Midi_SetError(MIDI_ERROR_TRUNCATED);
+
+    // read the status byte ("type" of the event)
+    uint8_t meta = 0;
+    (*statusByte) = buffer[read++];
+
+    if ((*statusByte) == 0xFF) // this is a META event
+    {
+        if (read >= length)
+            return Midi_SetError(MIDI_ERROR_TRUNCATED);
+
+        (*statusByte) = buffer[read++]; // read the actual type
+        meta = 1;
+    }
+    else
+    {
+        // not a meta event
+        if ((*statusByte) < 0x80) // running status is in effect
+        {
+            if ((*running_status) == 0)
+                return Midi_SetError(MIDI_ERROR_RUNNING_STATUS);
+
+            (*statusByte) = (*running_status);
+            read--; // we actually read the first data byte ... let's go back
+        }
+        else
+            (*running_status) = (*statusByte);
+    }
+
+    // without an interface the size of the event is unknown and the rest of the track cannot be read
+    if (((*interface) = MidiEvent_GetInterface(*statusByte, meta)) == NULL)
+        return Midi_SetError(MIDI_ERROR_UNKNOWN_EVENT);
+
+    return read;
+}
+
+// cheap pre-pass over the raw track: only skips over the events to count them, without decoding any data
+// the count is used to size the list of events up-front; if the track is malformed the count is merely a hint
+uint32_t MidiTrack_CountEvents(const char* buffer, uint32_t length)
+{
+    uint32_t read = 0, count = 0;
+    uint8_t running_status = 0;
+
+    while (read < length)
+    {
+        // the pre-pass does not record errors: MidiTrack_Read reports them when it gets there
+        uint32_t value;
+        int variablelen = DecodeVariableLength((const uint8_t*)&buffer[read], length - read, &value); // skip delta-time
+        if (variablelen <= 0 || (read += variablelen) >= length)
+            break;
+
+        uint8_t statusByte = buffer[read++];
+
+        if (statusByte == 0xFF || statusByte == 0xF0 || statusByte == 0xF7) // META or SysEx: <type> len <data>
+        {
+            if (statusByte == 0xFF)
+                read++; // skip type
+
+            if (read >= length || (variablelen = DecodeVariableLength((const uint8_t*)&buffer[read], length - read, &value)) <= 0)
+                break;
+
+            if (value > length - read - variablelen) // truncated
+                break;
+
+            read += variablelen + value;
+        }
+        else
+        {
+            if (statusByte < 0x80) // running status: this was the first data byte
+                statusByte = running_status, read--;
+            else
+                running_status = statusByte;
+
+            // program change and channel pressure have a single data byte
+            read += ((statusByte & 0xF0) == 0xC0 || (statusByte & 0xF0) == 0xD0) ? 1 : 2;
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+// decodes the events of a track chunk and appends them to the track
+// returns 0, or -1 if the chunk is malformed: the events before the error are kept and the error offset is where the bad event starts
+int MidiTrack_Read(const char* buffer, uint32_t length, MidiTrack_t* track, MidiArena_t* arena, uint32_t flags)
 {
     uint32_t read = 0;
     uint8_t running_status = 0;
+    int result = 0;
 
-    do {
-        // read event delta-time
+    // reserve the list of events up-front, then grow geometrically if the estimate turns out short
+    uint32_t capacity = track->NumEvents + MidiTrack_CountEvents(buffer, length);
+    if (capacity == 0)
+        capacity = 1 + length / 4; // at least 4 bytes per event, on average
+
+    {
+        MidiEvent_t *new_list = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * capacity);
+        if (new_list == NULL)
+            return Midi_SetError(MIDI_ERROR_ALLOCATION);
+
+        track->Events = new_list;
+    }
+
+    while (read < length)
+    {
         uint32_t deltaTime;
+        uint8_t statusByte;
+        const MidiEventInterface_t* interface;
+
+        int headerlen = MidiEvent_ReadHeader(&buffer[read], length - read, &running_status, &deltaTime, &statusByte, &interface);
+        if (headerlen < 0)
+        {
+            result = -1;
+            break;
+        }
+
+        // expand the list if it does not fit one more event
+        if (track->NumEvents >= capacity)
+        {
+            MidiEvent_t *new_list = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * capacity * 2);
+            if (new_list == NULL)
+            {
+                result = Midi_SetError(MIDI_ERROR_ALLOCATION);
+                break;
+            }
+            else
+            {
+                track->Events = new_list;
+                capacity *= 2;
+            }
+        }
+
+        MidiEvent_t* new_event = &track->Events[track->NumEvents];
+
+        if (MidiEvent_Init(new_event, interface, deltaTime, 1, arena) != 0)
+        {
+            result = -1;
+            break;
+        }
+
+        int datalen = MidiEvent_ReadData(interface, &buffer[read + headerlen], length - read - headerlen, statusByte, new_event->data);
+        if (datalen < 0 || (!(flags & MIDI_OPEN_ZERO_COPY) && MidiEvent_CopyPayload(new_event, arena) != 0))
+        {
+            if (arena == NULL)
+                free(new_event->data); // the slot is not kept, so nobody else will release it
+
+            result = -1;
+            break;
+        }
+
+        track->NumEvents++;
+        read += headerlen + datalen;
+    }
+
+    if (result != 0)
+        lastError.Offset = read;
+
+    // shrink-to-fit if the list ended up noticeably bigger than needed
+    if (track->NumEvents == 0)
+    {
+        free(track->Events);
+        track->Events = NULL;
+    }
+    else if (capacity - track->NumEvents > capacity / 8)
+    {
+        MidiEvent_t *new_list = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * track->NumEvents);
+        if (new_list != NULL) // on failure the original (bigger) list is still good
+            track->Events = new_list;
+    }
+
+    return result;
+}
+
+// FILE MAPPING
+// ===================================================================
+// the whole file is either memory-mapped (zero-copy) or read with a single fread to a buffer
+typedef struct MidiMapping {
+    const char* data;
+    uint32_t size;
+    uint8_t mapped; // if 0, data was malloc'd
+} MidiMapping_t;
+
+#define MIDI_MAPPING_MAX_SIZE UINT32_MAX // lengths within the file are 32-bit
+
+static int MidiMapping_Read(const char* filename, MidiMapping_t* map)
+{
+    FILE* fp;
+    if ((fp = fopen(filename, "rb")) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open MIDI file %s: %d %s", filename, errno, strerror(errno));
+        return -1;
+    }
+
+    long filesize = -1;
+    if (fseek(fp, 0, SEEK_END) == 0)
+        filesize = ftell(fp);
+    rewind(fp);
+
+    if (filesize < 0 || (unsigned long)filesize > MIDI_MAPPING_MAX_SIZE)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to get size of MIDI file %s", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    char* buffer;
+    if ((buffer = (char*)malloc(filesize + 1)) == NULL) // +1 so an empty file is not an allocation error
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating buffer of %ld bytes to read file", filesize);
+        fclose(fp);
+        return -1;
+    }
+
+    size_t readlen;
+    if ((readlen = fread(buffer, sizeof(char), filesize, fp)) != (size_t)filesize)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError reading file: read %u of expected %ld: %d %s", (unsigned int)readlen, filesize, errno, strerror(errno));
+        free(buffer);
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+
+    *map = (MidiMapping_t){
+        .data = buffer,
+        .size = (uint32_t)filesize,
+        .mapped = 0,
+    };
+
+    return 0;
+}
+
+#if defined(unix) || defined(__unix__) || defined(__unix)
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+static int MidiMapping_Map(const char* filename, MidiMapping_t* map)
+{
+    int fd;
+    if ((fd = open(filename, O_RDONLY)) < 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open MIDI file %s: %d %s", filename, errno, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > MIDI_MAPPING_MAX_SIZE)
+    {
+        close(fd);
+        return MidiMapping_Read(filename, map); // nothing to map (or too big): let the regular path handle/report it
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps a reference to the file
+
+    if (data == MAP_FAILED)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to map MIDI file %s: %d %s", filename, errno, strerror(errno));
+        return -1;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL); // the parser reads it front to back
+
+    *map = (MidiMapping_t){
+        .data = (const char*)data,
+        .size = (uint32_t)st.st_size,
+        .mapped = 1,
+    };
+
+    return 0;
+}
+
+static void MidiMapping_Unmap(MidiMapping_t* map)
+{
+    munmap((void*)map->data, map->size);
+}
+
+#elif defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+
+#include <windows.h>
+
+static int MidiMapping_Map(const char* filename, MidiMapping_t* map)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open MIDI file %s: error %lu", filename, GetLastError());
+        return -1;
+    }
+
+    LARGE_INTEGER filesize;
+    if (!GetFileSizeEx(file, &filesize) || filesize.QuadPart <= 0 || (uint64_t)filesize.QuadPart > MIDI_MAPPING_MAX_SIZE)
+    {
+        CloseHandle(file);
+        return MidiMapping_Read(filename, map); // nothing to map (or too big): let the regular path handle/report it
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file); // the mapping keeps a reference to the file
+
+    if (mapping == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to map MIDI file %s: error %lu", filename, GetLastError());
+        return -1;
+    }
+
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping); // the view keeps a reference to the mapping
+
+    if (data == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to map view of MIDI file %s: error %lu", filename, GetLastError());
+        return -1;
+    }
+
+    *map = (MidiMapping_t){
+        .data = (const char*)data,
+        .size = (uint32_t)filesize.QuadPart,
+        .mapped = 1,
+    };
+
+    return 0;
+}
+
+static void MidiMapping_Unmap(MidiMapping_t* map)
+{
+    UnmapViewOfFile(map->data);
+}
+
+#else
+
+// no mapping support on this platform
+static int MidiMapping_Map(const char* filename, MidiMapping_t* map) { return MidiMapping_Read(filename, map); }
+static void MidiMapping_Unmap(MidiMapping_t* map) { }
+
+#endif
+
+int MidiMapping_Open(const char* filename, uint8_t mapped, MidiMapping_t* map)
+{
+    return (mapped) ? MidiMapping_Map(filename, map) : MidiMapping_Read(filename, map);
+}
+
+void MidiMapping_Close(MidiMapping_t* map)
+{
+    if (map->mapped)
+        MidiMapping_Unmap(map);
+    else
+        free((void*)map->data);
+
+    map->data = NULL;
+    map->size = 0;
+}
+
+// MIDI FILES
+// ===================================================================
+
+// the arena is left alone if the caller lent it to the file (see MidiFile_Parse)
+static void MidiFile_Free(MidiFile_t *close, uint8_t ownsArena)
+{
+    // sanity check
+    if (!close)
+        return;
+
+    // make sure there are tracks
+    if (close->Tracks && close->nTrks)
+    {
+        for (int t = 0; t < close->nTrks; t++)
+        {
+            // make sure there are events (an edited track may have an empty list)
+            if (!close->Tracks[t].Events)
+                continue;
+
+            if (!close->Arena) // otherwise the data is released all at once with the arena
+                for (int e = 0; e < close->Tracks[t].NumEvents; e++)
+                    free(close->Tracks[t].Events[e].data); // free the data for each event
+
+            // free the list of events in each track
+            free(close->Tracks[t].Events);
+        }
+
+        // free the list of tracks
+        free(close->Tracks);
+        close->Tracks = NULL;
+    }
+
+    MidiFile_Invalidate(close);
+
+    if (ownsArena)
+        MidiArena_Destroy(close->Arena);
+
+    if (close->Source)
+    {
+        MidiMapping_Close((MidiMapping_t*)close->Source);
+        free(close->Source);
+    }
+
+    // free the file
+    free(close);
+}
+
+void MidiFile_Close(MidiFile_t *close)
+{
+    MidiFile_Free(close, 1);
+}
+
+// treat chunk type accordingly
+#define MIDI_CHUNK_SIZE 4
+#define MIDI_CHUNK_LEN_BYTES 4
+#define MIDI_CHUNK_HEADER "MThd"
+#define MIDI_CHUNK_TRACK "MTrk"
+#define MIDI_CHUNK_HEADER_LEN 6
+
+// finds the chunk at (*offset) and advances it to the next chunk
+// returns 1 if a chunk was found, 0 at the end of the buffer (trailing bytes too short to be a chunk are ignored) or -1 if the chunk is truncated
+int MidiChunk_Next(const char* data, uint32_t length, uint32_t* offset, const char** chunktype, const char** chunkdata, uint32_t* chunklength)
+{
+    if (length - (*offset) < MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES)
+        return 0;
+
+    (*chunktype) = &data[*offset];
+    (*chunklength) = u32fromarray((const uint8_t*)&data[(*offset) + MIDI_CHUNK_SIZE]); // MThd|MTrk len-len-len-len <data>
+    (*offset) += MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES;
+    (*chunkdata) = &data[*offset];
+
+    if ((*chunklength) > length - (*offset))
+    {
+        Midi_SetError(MIDI_ERROR_TRUNCATED);
+        lastError.Offset = (*offset);
+        return -1;
+    }
+
+    (*offset) += (*chunklength);
+    return 1;
+}
+
+// a track chunk waiting to be decoded
+typedef struct MidiTrackJob {
+    const char* data;
+    uint32_t length;
+    MidiTrack_t* track;
+    MidiArena_t* arena;
+    uint32_t flags;
+    MidiErrorInfo_t error; // errors are thread-local, so each job keeps its own
+} MidiTrackJob_t;
+
+static void MidiTrackJob_Run(MidiTrackJob_t* job)
+{
+    job->error = (MidiErrorInfo_t){MIDI_OK, -1, 0};
+
+    if (MidiTrack_Read(job->data, job->length, job->track, job->arena, job->flags) != 0)
+        job->error = lastError;
+}
+
+typedef struct MidiTrackPool {
+    MidiTrackJob_t* jobs;
+    uint32_t numJobs;
+    atomic_uint next; // next job nobody has claimed yet
+} MidiTrackPool_t;
+
+static void MidiTrackPool_Worker(void* arg)
+{
+    MidiTrackPool_t* pool = (MidiTrackPool_t*)arg;
+
+    for (uint32_t j; (j = atomic_fetch_add(&pool->next, 1)) < pool->numJobs; )
+        MidiTrackJob_Run(&pool->jobs[j]);
+}
+
+// decodes one track per task on a pool of threads; the calling thread works too
+// arenas are not thread-safe, so each track fills its own and they are all merged into the file arena afterwards
+static int MidiFile_ReadTracksParallel(MidiFile_t* mf, MidiTrackJob_t* jobs, uint32_t numJobs)
+{
+    int result = -1;
+
+    if (mf->Arena)
+    {
+        // the jobs start out on the file arena: none may still point at it if creating the others fails
+        for (uint32_t j = 0; j < numJobs; j++)
+            jobs[j].arena = NULL;
+
+        for (uint32_t j = 0; j < numJobs; j++)
+            if ((jobs[j].arena = MidiArena_Create((size_t)jobs[j].length * 3)) == NULL)
+            {
+                Midi_SetError(MIDI_ERROR_ALLOCATION);
+                goto finish;
+            }
+    }
+
+    uint32_t numThreads = Midi_GetCpuCount();
+    if (numThreads > numJobs)
+        numThreads = numJobs;
+
+    MidiTrackPool_t pool = {.jobs = jobs, .numJobs = numJobs};
+    atomic_init(&pool.next, 0);
+
+    MidiThread_t* threads = (MidiThread_t*)calloc(numThreads, sizeof(MidiThread_t));
+    uint32_t started = 0;
+
+    if (threads != NULL)
+        while (started + 1 < numThreads && MidiThread_Start(&threads[started], MidiTrackPool_Worker, &pool) == 0)
+            started++;
+
+    MidiTrackPool_Worker(&pool);
+
+    for (uint32_t t = 0; t < started; t++)
+        MidiThread_Join(&threads[t]);
+
+    free(threads);
+    result = 0;
+
+    finish:
+    for (uint32_t j = 0; j < numJobs; j++)
+    {
+        if (result == 0)
+            MidiArena_Merge(mf->Arena, jobs[j].arena);
+        else
+            MidiArena_Destroy(jobs[j].arena);
+
+        jobs[j].arena = NULL;
+    }
+
+    return result;
+}
+
+// if arena is not NULL, the file allocates from it (as with MIDI_OPEN_ARENA) and must be released by MidiFile_Free(mf, 0)
+static MidiFile_t *MidiFile_Parse(const void* buffer, uint32_t length, uint32_t flags, MidiArena_t* arena)
+{
+    Midi_ClearError();
+
+    // sanity check
+    if (buffer == NULL)
+        return NULL;
+
+    const char* data = (const char*)buffer;
+
+    // validate the chunk boundaries once, so the parsing below never reads outside the buffer
+    {
+        uint32_t offset = 0;
+        const char *chunktype, *chunkdata;
+        uint32_t chunklength;
+        int result;
+
+        while ((result = MidiChunk_Next(data, length, &offset, &chunktype, &chunkdata, &chunklength)) > 0)
+            continue;
+
+        if (result < 0)
+            return NULL;
+    }
+
+    // read to the midi file structure
+    MidiFile_t *mf;
+    if ((mf = (MidiFile_t*)malloc(sizeof(MidiFile_t))) == NULL)
+    {
+        Midi_SetError(MIDI_ERROR_ALLOCATION);
+        return NULL;
+    }
+    else
+    {
+        // make sure we start fresh on the file
+        (*mf) = (MidiFile_t){0, 0, 0, NULL, NULL, NULL, NULL};
+    }
+
+    MidiTrackJob_t* jobs = NULL;
+
+    if (arena)
+        mf->Arena = arena;
+    else if (flags & MIDI_OPEN_ARENA)
+    {
+        // payloads in memory take roughly 3x the encoded size of the events
+        if ((mf->Arena = MidiArena_Create((size_t)length * 3)) == NULL)
+        {
+            Midi_SetError(MIDI_ERROR_ALLOCATION);
+            goto error;
+        }
+    }
+
+    uint16_t trackNumber = 0;
+
+    // Read chunks: the header is decoded right away, the tracks once they have all been found
+    const char *chunktype, *chunkdata;
+    uint32_t chunklength;
+
+    for (uint32_t offset = 0; MidiChunk_Next(data, length, &offset, &chunktype, &chunkdata, &chunklength) > 0; )
+    {
+        if (memcmp(chunktype, MIDI_CHUNK_HEADER, MIDI_CHUNK_SIZE) == 0) // MThd (header chunk)
+        {
+            if (chunklength != MIDI_CHUNK_HEADER_LEN || mf->Tracks) // header is comprised of 3 words of 16-bits, and there is only one
+            {
+                Midi_SetError(MIDI_ERROR_BAD_HEADER);
+                goto error;
+            }
+
+            const uint8_t* header = (const uint8_t*)chunkdata;
+
+            mf->Format = u16fromarray(&header[0]);
+            mf->nTrks = u16fromarray(&header[2]);
+            mf->PulsesPerQuarterNote = u16fromarray(&header[4]);
+
+            if ((mf->Format == MIDI_FORMAT_SINGLE_TRACK) && (mf->nTrks != 1))
+            {
+                Midi_SetError(MIDI_ERROR_BAD_HEADER);
+                goto error;
+            }
+
+            mf->Tracks = (MidiTrack_t*)calloc(mf->nTrks, sizeof(MidiTrack_t));
+            jobs = (MidiTrackJob_t*)calloc(mf->nTrks + 1, sizeof(MidiTrackJob_t));
+            if (!mf->Tracks || !jobs)
+            {
+                Midi_SetError(MIDI_ERROR_ALLOCATION);
+                goto error;
+            }
+        }
+        else if (memcmp(chunktype, MIDI_CHUNK_TRACK, MIDI_CHUNK_SIZE) == 0) // MTrk (track chunk)
+        {
+            // sanity check
+            if (!mf->Tracks)
+            {
+                Midi_SetError(MIDI_ERROR_BAD_HEADER);
+                goto error;
+            }
+            else if (trackNumber >= mf->nTrks)
+            {
+                Midi_SetError(MIDI_ERROR_BAD_CHUNK);
+                goto error;
+            }
+
+            jobs[trackNumber] = (MidiTrackJob_t){
+                .data = chunkdata,
+                .length = chunklength,
+                .track = &mf->Tracks[trackNumber],
+                .arena = mf->Arena,
+                .flags = flags,
+            };
+
+            trackNumber++;
+        }
+        else
+        {
+            Midi_SetError(MIDI_ERROR_BAD_CHUNK);
+            goto error;
+        }
+    }
+
+    if (jobs == NULL) // no header chunk at all
+    {
+        Midi_SetError(MIDI_ERROR_BAD_HEADER);
+        goto error;
+    }
+
+    // actually read the tracks, straight from the buffer
+    if ((flags & MIDI_OPEN_PARALLEL) && trackNumber > 1)
+    {
+        if (MidiFile_ReadTracksParallel(mf, jobs, trackNumber) != 0)
+            goto error;
+    }
+    else
+    {
+        for (uint16_t t = 0; t < trackNumber; t++)
+        {
+            Midi_Log(MIDI_LOG_INFO, "\n\nReading track #%u:", t); // progress, so any error of the track follows it
+            MidiTrackJob_Run(&jobs[t]);
+        }
+    }
+
+    // report the first malformed track (the others are still decoded up to their own error)
+    for (uint16_t t = 0; t < trackNumber; t++)
+        if (jobs[t].error.Code != MIDI_OK)
+        {
+            lastError = jobs[t].error;
+            lastError.Track = t;
+
+            if (flags & MIDI_OPEN_STRICT)
+                goto error;
+
+            break;
+        }
+
+    // the original bytes of the tracks decoded without errors, to be saved verbatim until edited
+    if (flags & MIDI_OPEN_KEEP_SOURCE)
+        for (uint16_t t = 0; t < trackNumber; t++)
+            if (jobs[t].error.Code == MIDI_OK)
+            {
+                mf->Tracks[t].Encoded = (const uint8_t*)jobs[t].data;
+                mf->Tracks[t].EncodedLength = jobs[t].length;
+            }
+
+    free(jobs);
+    return mf;
+
+    error:
+    free(jobs);
+    MidiFile_Free(mf, arena == NULL);
+    return NULL;
+}
+
+MidiFile_t *MidiFile_Create(uint16_t format, uint16_t nTrks, uint16_t ppq)
+{
+    MidiFile_t *mf;
+    if ((mf = (MidiFile_t*)malloc(sizeof(MidiFile_t))) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating midi file");
+        return NULL;
+    }
+
+    (*mf) = (MidiFile_t){format, nTrks, ppq, NULL, NULL, NULL, NULL};
+
+    if (nTrks > 0 && (mf->Tracks = (MidiTrack_t*)calloc(nTrks, sizeof(MidiTrack_t))) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %u tracks", nTrks);
+        free(mf);
+        return NULL;
+    }
+
+    return mf;
+}
+
+MidiFile_t *MidiFile_OpenMemory(const void* buffer, uint32_t length, uint32_t flags)
+{
+    return MidiFile_Parse(buffer, length, flags, NULL);
+}
+
+MidiFile_t *MidiFile_Open(const char* filename)
+{
+    return MidiFile_OpenEx(filename, MIDI_OPEN_DEFAULT);
+}
+
+MidiFile_t *MidiFile_OpenEx(const char* filename, uint32_t flags)
+{
+    // sanity check
+    if (filename == NULL)
+        return NULL;
+
+    // bring the whole file to memory at once (either mapped or read to a buffer)
+    MidiMapping_t map;
+    if (MidiMapping_Open(filename, (flags & MIDI_OPEN_MAPPED) != 0, &map) != 0)
+    {
+        Midi_SetError(MIDI_ERROR_IO);
+        return NULL;
+    }
+
+    MidiFile_t *mf = MidiFile_OpenMemory(map.data, map.size, flags);
+
+    // zero-copy payloads and kept tracks point into the mapping, so the file keeps it until closed
+    if (mf && (flags & (MIDI_OPEN_ZERO_COPY | MIDI_OPEN_KEEP_SOURCE)))
+    {
+        if ((mf->Source = malloc(sizeof(MidiMapping_t))) != NULL)
+        {
+            *(MidiMapping_t*)mf->Source = map;
+            return mf;
+        }
+
+        Midi_SetError(MIDI_ERROR_ALLOCATION);
+        MidiFile_Close(mf);
+        mf = NULL;
+    }
+
+    MidiMapping_Close(&map);
+    return mf;
+}
+
+// running status may only carry over between channel events: meta events and SysEx cancel it
+static inline uint8_t MidiEvent_UsesRunningStatus(const MidiEvent_t* event)
+{
+    return MidiEvent_IsChannelType(event->interface->type);
+}
+
+static uint8_t MidiEvent_GetStatusByte(const MidiEvent_t* event)
+{
+    char encoded[4]; // channel events are never longer
+    MidiEvent_WriteData(encoded, event);
+
+    return (uint8_t)encoded[0];
+}
+
+// exact size of the track data, without the chunk header
+static uint32_t MidiTrack_EncodedSize(const MidiTrack_t* track, uint32_t flags)
+{
+    uint32_t size = 0;
+    uint8_t running = 0;
+
+    if (track->Encoded && !(flags & MIDI_SAVE_REENCODE))
+        return track->EncodedLength;
+
+    for (uint32_t e = 0; e < track->NumEvents; e++)
+    {
+        const MidiEvent_t* event = &track->Events[e];
+
+        size += VariableLengthSize(event->deltaTime) + MidiEvent_SizeData(event);
+
+        if (!(flags & MIDI_SAVE_RUNNING_STATUS))
+            continue;
+
+        if (MidiEvent_UsesRunningStatus(event))
+        {
+            uint8_t status = MidiEvent_GetStatusByte(event);
+
+            if (status == running)
+                size--;
+
+            running = status;
+        }
+        else
+            running = 0;
+    }
+
+    return size;
+}
+
+static uint32_t MidiTrack_Encode(const MidiTrack_t* track, char* buffer, uint32_t length, uint32_t flags)
+{
+    uint32_t offset = 0;
+    uint8_t running = 0;
+
+    if (track->Encoded && !(flags & MIDI_SAVE_REENCODE)) // not edited since it was read
+    {
+        memcpy(buffer, track->Encoded, track->EncodedLength);
+        return track->EncodedLength;
+    }
+
+    for (uint32_t e = 0; e < track->NumEvents; e++)
+    {
+        const MidiEvent_t* event = &track->Events[e];
+
+        offset += WriteVariableLength(&buffer[offset], length - offset, event->deltaTime);
+
+        char* encoded = &buffer[offset];
+        uint32_t size = MidiEvent_WriteData(encoded, event);
+
+        if (flags & MIDI_SAVE_RUNNING_STATUS)
+        {
+            if (MidiEvent_UsesRunningStatus(event))
+            {
+                uint8_t status = (uint8_t)encoded[0];
+
+                if (status == running) // drop the repeated status byte
+                    memmove(encoded, &encoded[1], --size);
+
+                running = status;
+            }
+            else
+                running = 0;
+        }
+
+        offset += size;
+    }
+
+    return offset;
+}
+
+int MidiFile_GetEncodedSize(const MidiFile_t* midi, uint32_t flags)
+{
+    if (midi == NULL)
+        return -1;
+
+    uint64_t size = MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES + MIDI_CHUNK_HEADER_LEN;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+        size += MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES + MidiTrack_EncodedSize(&midi->Tracks[t], flags);
+
+    if (size > INT32_MAX)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nMIDI file is too large to encode");
+        return -1;
+    }
+
+    return (int)size;
+}
+
+int MidiFile_SaveToBuffer(const MidiFile_t* midi, void* buffer, uint32_t capacity, uint32_t flags)
+{
+    int size = MidiFile_GetEncodedSize(midi, flags);
+
+    if (size < 0)
+        return -1;
+
+    if (buffer == NULL || capacity < (uint32_t)size)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nBuffer of %u bytes too small to save MIDI file of %d bytes", capacity, size);
+        return -1;
+    }
+
+    uint8_t* out = (uint8_t*)buffer;
+    uint32_t offset = 0;
+
+    // header
+    memcpy(&out[offset], MIDI_CHUNK_HEADER, MIDI_CHUNK_SIZE);
+    u32toarray(MIDI_CHUNK_HEADER_LEN, &out[offset + MIDI_CHUNK_SIZE]);
+    offset += MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES;
+
+    u16toarray(midi->Format, &out[offset]);
+    u16toarray(midi->nTrks, &out[offset + 2]);
+    u16toarray(midi->PulsesPerQuarterNote, &out[offset + 4]);
+    offset += MIDI_CHUNK_HEADER_LEN;
+
+    // tracks
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+    {
+        memcpy(&out[offset], MIDI_CHUNK_TRACK, MIDI_CHUNK_SIZE);
+        offset += MIDI_CHUNK_SIZE + MIDI_CHUNK_LEN_BYTES;
+
+        uint32_t trackLen = MidiTrack_Encode(&midi->Tracks[t], (char*)&out[offset], size - offset, flags);
+        u32toarray(trackLen, &out[offset - MIDI_CHUNK_LEN_BYTES]);
+
+        offset += trackLen;
+    }
+
+    return offset;
+}
+
+int MidiFile_SaveEx(const char* filename, const MidiFile_t *save, uint32_t flags)
+{
+    if (filename == NULL || save == NULL)
+        return -1;
+
+    int size = MidiFile_GetEncodedSize(save, flags);
+    if (size < 0)
+        return -1;
+
+    // the whole file is encoded in memory and written at once
+    void* buffer = malloc(size);
+    if (buffer == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %d bytes to save MIDI file", size);
+        return -1;
+    }
+
+    if (MidiFile_SaveToBuffer(save, buffer, size, flags) != size)
+    {
+        free(buffer);
+        return -1;
+    }
+
+    FILE* fp;
+    if ((fp = fopen(filename, "wb+")) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open/create MIDI file %s: %d %s", filename, errno, strerror(errno));
+        free(buffer);
+        return -1;
+    }
+
+    int result = (fwrite(buffer, 1, size, fp) == (size_t)size) ? 0 : -1;
+
+    if (result != 0)
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to write MIDI file %s: %d %s", filename, errno, strerror(errno));
+
+    if (fclose(fp) != 0)
+        result = -1;
+
+    free(buffer);
+    return result;
+}
+
+int MidiFile_Save(const char* filename, const MidiFile_t *save)
+{
+    return MidiFile_SaveEx(filename, save, MIDI_SAVE_DEFAULT);
+}
+
+// STREAMING READER
+// ===================================================================
+// decodes one event at a time straight from the (mapped) file: only one pending event is held per track
+
+// big enough to hold the data of any event
+typedef union MidiEventData_Storage {
+    MidiEventData_Text_t text;
+    MidiEventData_SequenceNumber_t sequenceNumber;
+    MidiEventData_ChannelPrefix_t channelPrefix;
+    MidiEventData_MidiPort_t midiPort;
+    MidiEventData_SetTempo_t setTempo;
+    MidiEventData_SMPTEoffset_t smpteOffset;
+    MidiEventData_TimeSignature_t timeSignature;
+    MidiEventData_KeySignature_t keySignature;
+    MidiEventData_NoteEvent_t note;
+    MidiEventData_PolyphonicKeyPressure_t polyphonicKeyPressure;
+    MidiEventData_ControlChange_t controlChange;
+    MidiEventData_ProgramChange_t programChange;
+    MidiEventData_ChannelPressure_t channelPressure;
+    MidiEventData_PitchWheelChange_t pitchWheelChange;
+} MidiEventData_Storage_t;
+
+typedef struct MidiReaderTrack {
+    const char* data; // contents of the MTrk chunk
+    uint32_t length;
+    uint32_t read; // position of the next event to decode
+    uint8_t running_status;
+    uint8_t pending; // if 1, "event" holds the next event of the track
+    uint64_t ticks; // absolute time of the pending event
+    MidiEvent_t event;
+    MidiEventData_Storage_t storage; // data of the pending event
+} MidiReaderTrack_t;
+
+struct MidiReader {
+    MidiMapping_t map; // the mapped file (data is NULL when reading from a caller's buffer)
+    MidiFile_t header; // Format, nTrks and PulsesPerQuarterNote; Tracks is always NULL
+    MidiReaderTrack_t* tracks;
+    MidiHeapEntry_t* heap; // tracks with a pending event
+    uint32_t heapCount;
+    int32_t current; // track of the event last returned, which must be advanced on the next call (-1 if none)
+};
+
+// decodes the next event of the track into its pending slot
+// returns 1 if an event is pending, 0 at the end of the track or -1 on error (the caller sets lastError.Track)
+static int MidiReaderTrack_Advance(MidiReaderTrack_t* track)
+{
+    track->pending = 0;
+
+    if (track->read >= track->length)
+        return 0;
+
+    const uint32_t start = track->read;
+
+    uint32_t deltaTime;
+    uint8_t statusByte;
+    const MidiEventInterface_t* interface;
+
+    int headerlen = MidiEvent_ReadHeader(&track->data[track->read], track->length - track->read, &track->running_status, &deltaTime, &statusByte, &interface);
+    if (headerlen < 0)
+        goto error;
+
+    track->read += headerlen;
+
+    MidiEvent_Init(&track->event, interface, deltaTime, 0, NULL);
+    track->event.data = &track->storage;
+
+    int datalen = MidiEvent_ReadData(interface, &track->data[track->read], track->length - track->read, statusByte, track->event.data);
+    if (datalen < 0)
+        goto error;
+
+    track->read += datalen;
+    track->ticks += deltaTime;
+    track->pending = 1;
+
+    return 1;
+
+    error:
+    lastError.Offset = start; // within the track chunk, like the parser
+    track->read = track->length; // don't try to read this track any further
+    return -1;
+}
+
+static MidiReader_t* MidiReader_Create(const char* data, uint32_t length)
+{
+    MidiReader_t* reader;
+    if ((reader = (MidiReader_t*)calloc(1, sizeof(MidiReader_t))) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nAllocation error!");
+        return NULL;
+    }
+
+    reader->current = -1;
+
+    // only the chunk headers are read here: the tracks are decoded on demand
+    const char *chunktype, *chunkdata;
+    uint32_t chunklength, offset = 0;
+    uint16_t trackNumber = 0;
+    int result;
+
+    while ((result = MidiChunk_Next(data, length, &offset, &chunktype, &chunkdata, &chunklength)) > 0)
+    {
+        if (memcmp(chunktype, MIDI_CHUNK_HEADER, MIDI_CHUNK_SIZE) == 0) // MThd (header chunk)
+        {
+            if (chunklength != MIDI_CHUNK_HEADER_LEN || reader->tracks)
+            {
+                Midi_Log(MIDI_LOG_ERRORS, "\nError reading header");
+                goto error;
+            }
+
+            const uint8_t* header = (const uint8_t*)chunkdata;
+
+            reader->header.Format = u16fromarray(&header[0]);
+            reader->header.nTrks = u16fromarray(&header[2]);
+            reader->header.PulsesPerQuarterNote = u16fromarray(&header[4]);
+
+            reader->tracks = (MidiReaderTrack_t*)calloc(reader->header.nTrks + 1, sizeof(MidiReaderTrack_t));
+            reader->heap = (MidiHeapEntry_t*)calloc(reader->header.nTrks + 1, sizeof(MidiHeapEntry_t));
+
+            if (!reader->tracks || !reader->heap)
+            {
+                Midi_Log(MIDI_LOG_ERRORS, "\nError trying to allocate memory for %u tracks", reader->header.nTrks);
+                goto error;
+            }
+        }
+        else if (memcmp(chunktype, MIDI_CHUNK_TRACK, MIDI_CHUNK_SIZE) == 0) // MTrk (track chunk)
+        {
+            if (!reader->tracks || trackNumber >= reader->header.nTrks)
+            {
+                Midi_Log(MIDI_LOG_ERRORS, "\nFound track before header or more tracks than specified in header!");
+                goto error;
+            }
+
+            reader->tracks[trackNumber].data = chunkdata;
+            reader->tracks[trackNumber].length = chunklength;
+            trackNumber++;
+        }
+        else
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nUnknown chunk type %.*s", MIDI_CHUNK_SIZE, chunktype);
+            goto error;
+        }
+    }
+
+    if (result < 0 || !reader->tracks)
+        goto error;
+
+    // decode the first event of every track
+    for (uint16_t t = 0; t < trackNumber; t++)
+    {
+        int advanced = MidiReaderTrack_Advance(&reader->tracks[t]);
+
+        if (advanced < 0)
+        {
+            lastError.Track = t;
+            Midi_Log(MIDI_LOG_ERRORS, "\nError reading the first event of track %u", t);
+            goto error;
+        }
+
+        if (advanced > 0)
+            reader->heap[reader->heapCount++] = (MidiHeapEntry_t){.ticks = reader->tracks[t].ticks, .track = t};
+    }
+
+    MidiHeap_Build(reader->heap, reader->heapCount);
+
+    return reader;
+
+    error:
+    free(reader->tracks);
+    free(reader->heap);
+    free(reader);
+    return NULL;
+}
+
+MidiReader_t* MidiReader_Open(const char* filename)
+{
+    if (filename == NULL)
+        return NULL;
+
+    MidiMapping_t map;
+    if (MidiMapping_Open(filename, 1, &map) != 0)
+        return NULL;
+
+    MidiReader_t* reader = MidiReader_Create(map.data, map.size);
+
+    if (reader == NULL)
+        MidiMapping_Close(&map);
+    else
+        reader->map = map;
+
+    return reader;
+}
+
+MidiReader_t* MidiReader_OpenMemory(const void* buffer, uint32_t length)
+{
+    if (buffer == NULL)
+        return NULL;
+
+    return MidiReader_Create((const char*)buffer, length);
+}
+
+const MidiFile_t* MidiReader_GetHeader(const MidiReader_t* reader)
+{
+    return (reader) ? &reader->header : NULL;
+}
+
+int MidiReader_Next(MidiReader_t* reader, MidiEvent_t** event, uint16_t* track, uint64_t* timeTicks)
+{
+    if (reader == NULL)
+        return -1;
+
+    int result = 1;
+
+    // the event returned last time is no longer needed: replace it with the next one of its track (which is at the top of the heap)
+    if (reader->current >= 0)
+    {
+        MidiReaderTrack_t* last = &reader->tracks[reader->current];
+
+        if (MidiReaderTrack_Advance(last) < 0)
+        {
+            lastError.Track = reader->current;
+            result = -1;
+        }
+
+        MidiHeap_ReplaceTop(reader->heap, &reader->heapCount, !last->pending, last->ticks);
+    }
+
+    reader->current = -1;
+
+    if (result < 0)
+        return result;
+
+    if (reader->heapCount == 0)
+        return 0; // all tracks finished
+
+    // the next event is the earliest pending one; ties go to the lowest track, like the player
+    reader->current = reader->heap[0].track;
+
+    MidiReaderTrack_t* next = &reader->tracks[reader->current];
+
+    if (event)
+        (*event) = &next->event;
+    if (track)
+        (*track) = reader->current;
+    if (timeTicks)
+        (*timeTicks) = next->ticks;
+
+    return 1;
+}
+
+void MidiReader_Close(MidiReader_t* reader)
+{
+    if (reader == NULL)
+        return;
+
+    if (reader->map.data)
+        MidiMapping_Close(&reader->map);
+
+    free(reader->tracks);
+    free(reader->heap);
+    free(reader);
+}
+
+// PACKED TRACKS
+// ===================================================================
+// channel events are encoded to a small scratch buffer first, meta events to one as big as the largest of them
+#define MIDI_PACKED_SCRATCH_LEN 8
+
+static uint32_t MidiPackedTrack_CountMeta(const MidiTrack_t* track, uint32_t* payloadSize, uint32_t* maxEncoded)
+{
+    uint32_t count = 0;
+
+    *payloadSize = 0;
+    *maxEncoded = MIDI_PACKED_SCRATCH_LEN;
+
+    for (uint32_t e = 0; e < track->NumEvents; e++)
+    {
+        const MidiEvent_t* event = &track->Events[e];
+        uint8_t type = event->interface->type;
+
+        if ((type & 0x80) && type != Midi_Event_Type_SysEx2)
+            continue; // channel event: stored inline
+
+        uint32_t size = MidiEvent_SizeData(event);
+        uint32_t header = (type == Midi_Event_Type_SysEx2) ? 1 : 2; // F0 | FF type
+
+        (*payloadSize) += (size > header) ? size - header : 0;
+
+        if (size > (*maxEncoded))
+            (*maxEncoded) = size;
+
+        count++;
+    }
+
+    return count;
+}
+
+// all the arrays of a track are carved out of a single allocation
+static int MidiPackedTrack_Alloc(MidiPackedTrack_t* packed, uint32_t numEvents, uint32_t numMeta, uint32_t payloadSize)
+{
+    size_t size = (size_t)numEvents * (2*sizeof(uint32_t) + 3*sizeof(uint8_t)) + (size_t)numMeta * sizeof(MidiPackedMeta_t) + payloadSize;
+
+    char* block = (char*)malloc(size + 1); // +1 so an empty track is not an allocation error
+    if (block == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %lu bytes for packed track", (unsigned long)size);
+        return -1;
+    }
+
+    // widest types first so every array stays aligned
+    *packed = (MidiPackedTrack_t){
+        .NumEvents = numEvents,
+        .DeltaTime = (uint32_t*)block,
+        .AbsoluteTicks = (uint32_t*)(block + (size_t)numEvents * sizeof(uint32_t)),
+        .NumMeta = numMeta,
+        .Meta = (MidiPackedMeta_t*)(block + (size_t)numEvents * 2*sizeof(uint32_t)),
+        .PayloadSize = payloadSize,
+    };
+
+    char* bytes = (char*)&packed->Meta[numMeta];
+
+    packed->Status = (uint8_t*)bytes;
+    packed->Data1 = (uint8_t*)(bytes + numEvents);
+    packed->Data2 = (uint8_t*)(bytes + 2*(size_t)numEvents);
+    packed->Payload = (uint8_t*)(bytes + 3*(size_t)numEvents);
+
+    return 0;
+}
+
+static int MidiPackedTrack_FromTrack(MidiPackedTrack_t* packed, const MidiTrack_t* track)
+{
+    uint32_t payloadSize, maxEncoded;
+    uint32_t numMeta = MidiPackedTrack_CountMeta(track, &payloadSize, &maxEncoded);
+
+    if (MidiPackedTrack_Alloc(packed, track->NumEvents, numMeta, payloadSize) != 0)
+        return -1;
+
+    char* scratch = (char*)malloc(maxEncoded);
+    if (scratch == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %lu bytes to encode packed events", (unsigned long)maxEncoded);
+        return -1;
+    }
+
+    uint32_t absoluteTicks = 0, meta = 0, payload = 0;
+
+    for (uint32_t e = 0; e < track->NumEvents; e++)
+    {
+        const MidiEvent_t* event = &track->Events[e];
+        uint8_t type = event->interface->type;
+
+        absoluteTicks += event->deltaTime;
+        packed->DeltaTime[e] = event->deltaTime;
+        packed->AbsoluteTicks[e] = absoluteTicks;
+
+        int written = MidiEvent_WriteData(scratch, event);
+
+        if ((type & 0x80) && type != Midi_Event_Type_SysEx2)
+        {
+            // channel event: status + 1 or 2 data bytes
+            packed->Status[e] = (uint8_t)scratch[0];
+            packed->Data1[e] = (uint8_t)scratch[1];
+            packed->Data2[e] = (written > 2) ? (uint8_t)scratch[2] : 0;
+            continue;
+        }
+
+        // meta / SysEx: the payload (len <data>) goes to the side buffer
+        int header = (type == Midi_Event_Type_SysEx2) ? 1 : 2;
+        uint32_t length = (written > header) ? written - header : 0;
+
+        packed->Status[e] = (type == Midi_Event_Type_SysEx2) ? 0xF0 : 0xFF;
+        packed->Data1[e] = (type == Midi_Event_Type_SysEx2) ? 0 : type;
+        packed->Data2[e] = 0;
+
+        packed->Meta[meta++] = (MidiPackedMeta_t){
+            .offset = payload,
+            .length = length,
+        };
+
+        memcpy(&packed->Payload[payload], &scratch[header], length);
+        payload += length;
+    }
+
+    free(scratch);
+    return 0;
+}
+
+MidiPackedFile_t* MidiPackedFile_FromFile(const MidiFile_t* midi)
+{
+    if (midi == NULL)
+        return NULL;
+
+    MidiPackedFile_t* packed;
+    if ((packed = (MidiPackedFile_t*)malloc(sizeof(MidiPackedFile_t))) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nAllocation error!");
+        return NULL;
+    }
+
+    *packed = (MidiPackedFile_t){
+        .Format = midi->Format,
+        .nTrks = midi->nTrks,
+        .PulsesPerQuarterNote = midi->PulsesPerQuarterNote,
+        .Tracks = (MidiPackedTrack_t*)calloc(midi->nTrks + 1, sizeof(MidiPackedTrack_t)),
+    };
+
+    if (packed->Tracks == NULL)
+        goto error;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+        if (MidiPackedTrack_FromTrack(&packed->Tracks[t], &midi->Tracks[t]) != 0)
+            goto error;
+
+    return packed;
+
+    error:
+    Midi_Log(MIDI_LOG_ERRORS, "\nError packing MIDI file");
+    MidiPackedFile_Close(packed);
+    return NULL;
+}
+
+MidiFile_t* MidiPackedFile_ToFile(const MidiPackedFile_t* packed, uint32_t flags)
+{
+    if (packed == NULL)
+        return NULL;
+
+    MidiFile_t* mf;
+    if ((mf = (MidiFile_t*)malloc(sizeof(MidiFile_t))) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nAllocation error!");
+        return NULL;
+    }
+
+    *mf = (MidiFile_t){
+        .Format = packed->Format,
+        .nTrks = packed->nTrks,
+        .PulsesPerQuarterNote = packed->PulsesPerQuarterNote,
+        .Tracks = (MidiTrack_t*)calloc(packed->nTrks + 1, sizeof(MidiTrack_t)),
+    };
+
+    if (mf->Tracks == NULL)
+        goto error;
+
+    if ((flags & MIDI_OPEN_ARENA) && (mf->Arena = MidiArena_Create(0)) == NULL)
+        goto error;
+
+    for (uint16_t t = 0; t < packed->nTrks; t++)
+    {
+        const MidiPackedTrack_t* ptrack = &packed->Tracks[t];
+        MidiTrack_t* track = &mf->Tracks[t];
+
+        if (ptrack->NumEvents == 0)
+            continue;
+
+        if ((track->Events = (MidiEvent_t*)malloc(sizeof(MidiEvent_t) * ptrack->NumEvents)) == NULL)
+            goto error;
+
+        for (uint32_t e = 0, meta = 0; e < ptrack->NumEvents; e++)
+        {
+            uint8_t status = ptrack->Status[e];
+            uint8_t isMeta = (status == 0xFF);
+            const MidiEventInterface_t* interface = MidiEvent_GetInterface((isMeta) ? ptrack->Data1[e] : status, isMeta);
+
+            if (interface == NULL || MidiEvent_Init(&track->Events[e], interface, ptrack->DeltaTime[e], 1, mf->Arena) != 0)
+                goto error;
+
+            track->NumEvents++;
+
+            if (status < 0xF0)
+                MidiEvent_ReadData(interface, (const char[]){ptrack->Data1[e], ptrack->Data2[e]}, 2, status, track->Events[e].data);
+            else
+            {
+                // the payload is copied out, the packed file may be closed first
+                const MidiPackedMeta_t* payload = &ptrack->Meta[meta++];
+                if (MidiEvent_ReadData(interface, (const char*)&ptrack->Payload[payload->offset], payload->length, (isMeta) ? ptrack->Data1[e] : status, track->Events[e].data) < 0
+                    || MidiEvent_CopyPayload(&track->Events[e], mf->Arena) != 0)
+                    goto error;
+            }
+        }
+    }
+
+    return mf;
+
+    error:
+    Midi_Log(MIDI_LOG_ERRORS, "\nError unpacking MIDI file");
+    MidiFile_Close(mf);
+    return NULL;
+}
+
+void MidiPackedFile_Close(MidiPackedFile_t* packed)
+{
+    if (packed == NULL)
+        return;
+
+    if (packed->Tracks)
+    {
+        for (uint16_t t = 0; t < packed->nTrks; t++)
+            free(packed->Tracks[t].DeltaTime); // start of the block holding all the arrays of the track
+
+        free(packed->Tracks);
+    }
+
+    free(packed);
+}
+
+// bulk transforms: every array is rewritten in a single pass with lookup tables indexed by the status byte
+// so there is no branch per event, and the transposition runs 16 events at a time where SSE2 is available
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIDI_TRANSFORM_SSE2
+#endif
+
+static inline uint8_t MidiTransform_IsSelected(const MidiTransform_t* transform, uint8_t channel)
+{
+    return (transform->Channels == 0) || ((transform->Channels >> channel) & 1);
+}
+
+static inline uint8_t MidiTransform_ClampKey(int key)
+{
+    return (key < 0) ? 0 : (key > 127) ? 127 : (uint8_t)key;
+}
+
+static inline uint8_t MidiTransform_Velocity(const MidiTransform_t* transform, int velocity)
+{
+    if (transform->VelocityScale != 0)
+        velocity = (velocity * transform->VelocityScale + 128) >> 8;
+
+    velocity = (velocity < 1) ? 1 : (velocity > 127) ? 127 : velocity;
+
+    if (transform->VelocityCurve)
+        velocity = transform->VelocityCurve[velocity];
+
+    return (velocity < 1) ? 1 : (velocity > 127) ? 127 : (uint8_t)velocity;
+}
+
+// keys of note on / off and polyphonic pressure on the selected channels
+static void MidiPackedTrack_Transpose(MidiPackedTrack_t* track, const MidiTransform_t* transform, const uint8_t* keyTable[256])
+{
+    uint32_t e = 0;
+
+#ifdef MIDI_TRANSFORM_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i delta = _mm_set1_epi8(transform->Transpose);
+
+    for (; e + 16 <= track->NumEvents; e += 16)
+    {
+        __m128i status = _mm_loadu_si128((const __m128i*)&track->Status[e]);
+        __m128i data = _mm_loadu_si128((const __m128i*)&track->Data1[e]);
+
+        __m128i type = _mm_and_si128(status, _mm_set1_epi8((char)0xF0));
+        __m128i channel = _mm_and_si128(status, _mm_set1_epi8(0x0F));
+
+        __m128i selected = _mm_or_si128(_mm_or_si128(
+            _mm_cmpeq_epi8(type, _mm_set1_epi8((char)Midi_Event_Type_NoteOff)),
+            _mm_cmpeq_epi8(type, _mm_set1_epi8((char)Midi_Event_Type_NoteOn))),
+            _mm_cmpeq_epi8(type, _mm_set1_epi8((char)Midi_Event_Type_PolyphonicKeyPressure)));
+
+        selected = _mm_andnot_si128(_mm_cmplt_epi8(data, zero), selected); // not a valid key: left as is, like the tables do
+
+        if (transform->Channels != 0)
+            for (uint8_t c = 0; c < 16; c++)
+                if (!MidiTransform_IsSelected(transform, c))
+                    selected = _mm_andnot_si128(_mm_cmpeq_epi8(channel, _mm_set1_epi8(c)), selected);
+
+        // signed saturation clamps at 127, negative results are zeroed
+        __m128i moved = _mm_adds_epi8(data, delta);
+        moved = _mm_andnot_si128(_mm_cmplt_epi8(moved, zero), moved);
+
+        data = _mm_or_si128(_mm_and_si128(selected, moved), _mm_andnot_si128(selected, data));
+        _mm_storeu_si128((__m128i*)&track->Data1[e], data);
+    }
+#endif
+
+    for (; e < track->NumEvents; e++)
+        track->Data1[e] = keyTable[track->Status[e]][track->Data1[e]];
+}
+
+// ticks are scaled from the start of the track, so the rounding errors of the deltas do not accumulate
+static void MidiPackedTrack_Stretch(MidiPackedTrack_t* track, uint32_t stretch)
+{
+    uint32_t previous = 0;
+
+    for (uint32_t e = 0; e < track->NumEvents; e++)
+    {
+        uint64_t ticks = ((uint64_t)track->AbsoluteTicks[e] * stretch + 0x8000) >> 16;
+        uint32_t scaled = (ticks > UINT32_MAX) ? UINT32_MAX : (uint32_t)ticks;
+
+        track->AbsoluteTicks[e] = scaled;
+        track->DeltaTime[e] = scaled - previous;
+        previous = scaled;
+    }
+}
+
+int MidiPackedFile_Transform(MidiPackedFile_t* packed, const MidiTransform_t* transform)
+{
+    if (packed == NULL || transform == NULL)
+        return -1;
+
+    // tables indexed by a data byte: unchanged, transposed key, new velocity (bytes >= 0x80 are never valid data and stay the same)
+    uint8_t identity[256], transposed[256], velocity[256];
+
+    for (int i = 0; i < 256; i++)
+    {
+        identity[i] = transposed[i] = velocity[i] = (uint8_t)i;
+
+        if (i >= 128)
+            continue;
+
+        transposed[i] = MidiTransform_ClampKey(i + transform->Transpose);
+
+        if (i > 0) // velocity 0 is a note off and must remain so
+            velocity[i] = MidiTransform_Velocity(transform, i);
+    }
+
+    // tables indexed by the status byte: which data table applies to each event, and the remapped status
+    const uint8_t* keyTable[256];
+    const uint8_t* velocityTable[256];
+    uint8_t statusTable[256];
+
+    for (int status = 0; status < 256; status++)
+    {
+        uint8_t type = status & 0xF0, channel = status & 0x0F;
+        uint8_t isChannelEvent = (status >= 0x80 && status < 0xF0);
+        uint8_t selected = isChannelEvent && MidiTransform_IsSelected(transform, channel);
+
+        keyTable[status] = (selected && (type == Midi_Event_Type_NoteOff || type == Midi_Event_Type_NoteOn || type == Midi_Event_Type_PolyphonicKeyPressure)) ? transposed : identity;
+        velocityTable[status] = (selected && type == Midi_Event_Type_NoteOn) ? velocity : identity;
+        statusTable[status] = (isChannelEvent && transform->ChannelMap) ? (type | (transform->ChannelMap[channel] & 0x0F)) : (uint8_t)status;
+    }
+
+    uint8_t changesVelocity = (transform->VelocityScale != 0 && transform->VelocityScale != 256) || transform->VelocityCurve != NULL;
+    uint8_t changesTiming = (transform->Stretch != 0 && transform->Stretch != 0x10000);
+
+    for (uint16_t t = 0; t < packed->nTrks; t++)
+    {
+        MidiPackedTrack_t* track = &packed->Tracks[t];
+
+        if (transform->Transpose != 0)
+            MidiPackedTrack_Transpose(track, transform, keyTable);
+
+        if (changesVelocity)
+            for (uint32_t e = 0; e < track->NumEvents; e++)
+                track->Data2[e] = velocityTable[track->Status[e]][track->Data2[e]];
+
+        if (transform->ChannelMap)
+            for (uint32_t e = 0; e < track->NumEvents; e++)
+                track->Status[e] = statusTable[track->Status[e]];
+
+        if (changesTiming)
+            MidiPackedTrack_Stretch(track, transform->Stretch);
+    }
+
+    return 0;
+}
+
+// TIMELINE
+// ===================================================================
+// converting between ticks and seconds is not trivial because "SetTempo" events may change the conversion factor several times along the song
+#define MIDI_DEFAULT_TEMPO 500000 // microseconds per quarter-note, when no SetTempo is given (120 bpm)
+
+typedef struct MidiTempoChange {
+    uint64_t ticks;
+    uint16_t track;
+    uint32_t index;
+    uint32_t tempo;
+} MidiTempoChange_t;
+
+static int MidiTempoChange_Compare(const void* a, const void* b)
+{
+    const MidiTempoChange_t* x = (const MidiTempoChange_t*)a;
+    const MidiTempoChange_t* y = (const MidiTempoChange_t*)b;
+
+    // same order as the timeline: time, then track, then position in the track
+    if (x->ticks != y->ticks)
+        return (x->ticks < y->ticks) ? -1 : 1;
+    if (x->track != y->track)
+        return (x->track < y->track) ? -1 : 1;
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+MidiTempoMap_t* MidiTempoMap_Create(const MidiFile_t* midi)
+{
+    if (midi == NULL)
+        return NULL;
+
+    uint16_t division = midi->PulsesPerQuarterNote;
+    uint8_t smpte = (division & 0x8000) != 0; // negative SMPTE format: ticks per frame * frames per second
+
+    if (division == 0 || (smpte && (division & 0xFF) == 0))
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nInvalid time division in header: %u", division);
+        return NULL;
+    }
+
+    // collect the tempo changes of all tracks
+    MidiTempoChange_t* changes = NULL;
+    uint32_t numChanges = 0, capacity = 0;
+
+    for (uint16_t t = 0; t < midi->nTrks && !smpte; t++) // with SMPTE division tempo events do not affect timing
+    {
+        uint64_t ticks = 0;
+
+        for (uint32_t e = 0; e < midi->Tracks[t].NumEvents; e++)
+        {
+            const MidiEvent_t* event = &midi->Tracks[t].Events[e];
+            ticks += event->deltaTime;
+
+            if (MidiEvent_GetType(event) != Midi_Event_Type_SetTempo)
+                continue;
+
+            if (((MidiEventData_SetTempo_t*)event->data)->tempo == 0) // would stop the clock, and nothing could be converted back to ticks
+            {
+                Midi_Log(MIDI_LOG_WARNINGS, "\nWarning: ignoring Set tempo of 0 in track %u at tick %llu", t, (unsigned long long)ticks);
+                continue;
+            }
+
+            if (numChanges >= capacity)
+            {
+                capacity = (capacity) ? capacity * 2 : 16;
+
+                MidiTempoChange_t* new_changes = (MidiTempoChange_t*)realloc(changes, sizeof(MidiTempoChange_t) * capacity);
+                if (new_changes == NULL)
+                {
+                    Midi_Log(MIDI_LOG_ERRORS, "\nError allocating list of tempo changes");
+                    free(changes);
+                    return NULL;
+                }
+
+                changes = new_changes;
+            }
+
+            changes[numChanges++] = (MidiTempoChange_t){
+                .ticks = ticks,
+                .track = t,
+                .index = e,
+                .tempo = ((MidiEventData_SetTempo_t*)event->data)->tempo,
+            };
+        }
+    }
+
+    if (numChanges > 1)
+        qsort(changes, numChanges, sizeof(MidiTempoChange_t), MidiTempoChange_Compare);
+
+    MidiTempoMap_t* map = (MidiTempoMap_t*)malloc(sizeof(MidiTempoMap_t));
+    MidiTempoMapEntry_t* entries = (MidiTempoMapEntry_t*)malloc(sizeof(MidiTempoMapEntry_t) * (numChanges + 1));
+
+    if (map == NULL || entries == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating tempo map");
+        free(changes);
+        free(entries);
+        free(map);
+        return NULL;
+    }
+
+    (*map) = (MidiTempoMap_t){
+        .PulsesPerQuarterNote = (smpte) ? (uint16_t)(-(int8_t)(division >> 8)) * (division & 0xFF) : division, // ticks per second, when SMPTE
+        .NumEntries = 1,
+        .Entries = entries,
+    };
+
+    // SMPTE: "quarter-note" becomes one second of ticks
+    entries[0] = (MidiTempoMapEntry_t){.ticks = 0, .usec = 0, .units = 0, .tempo = (smpte) ? 1000000 : MIDI_DEFAULT_TEMPO};
+
+    for (uint32_t c = 0; c < numChanges; c++)
+    {
+        MidiTempoMapEntry_t* last = &entries[map->NumEntries - 1];
+
+        if (changes[c].ticks == last->ticks) // the latest change at the same tick wins
+        {
+            last->tempo = changes[c].tempo;
+            continue;
+        }
+
+        // keep the time exact (in 1/PPQ us): rounding never accumulates across tempo changes
+        uint64_t units = last->units + (changes[c].ticks - last->ticks) * last->tempo;
+
+        entries[map->NumEntries++] = (MidiTempoMapEntry_t){
+            .ticks = changes[c].ticks,
+            .usec = units / map->PulsesPerQuarterNote,
+            .units = units,
+            .tempo = changes[c].tempo,
+        };
+    }
+
+    free(changes);
+    return map;
+}
+
+void MidiTempoMap_Destroy(MidiTempoMap_t* map)
+{
+    if (map == NULL)
+        return;
+
+    free(map->Entries);
+    free(map);
+}
+
+// index of the last entry starting at or before the given time (binary search)
+static uint32_t MidiTempoMap_FindTicks(const MidiTempoMap_t* map, uint64_t ticks)
+{
+    uint32_t low = 0, high = map->NumEntries - 1;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+
+        if (map->Entries[mid].ticks <= ticks)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+static uint32_t MidiTempoMap_FindUs(const MidiTempoMap_t* map, uint64_t usec)
+{
+    uint32_t low = 0, high = map->NumEntries - 1;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+
+        if (map->Entries[mid].usec <= usec)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+// exact time of a tick within a tempo segment, in 1/PPQ microseconds
+static inline uint64_t MidiTempoMapEntry_TicksToUnits(const MidiTempoMapEntry_t* entry, uint64_t ticks)
+{
+    return entry->units + (ticks - entry->ticks) * entry->tempo;
+}
+
+static inline uint64_t MidiTempoMapEntry_TicksToUs(const MidiTempoMap_t* map, const MidiTempoMapEntry_t* entry, uint64_t ticks)
+{
+    return MidiTempoMapEntry_TicksToUnits(entry, ticks) / map->PulsesPerQuarterNote;
+}
+
+static inline uint64_t MidiTempoMapEntry_TicksToNs(const MidiTempoMap_t* map, const MidiTempoMapEntry_t* entry, uint64_t ticks)
+{
+    uint64_t units = MidiTempoMapEntry_TicksToUnits(entry, ticks);
+
+    // split to avoid overflowing units * 1000
+    return (units / map->PulsesPerQuarterNote) * 1000 + (units % map->PulsesPerQuarterNote) * 1000 / map->PulsesPerQuarterNote;
+}
+
+uint64_t MidiTempoMap_TicksToUs(const MidiTempoMap_t* map, uint64_t ticks)
+{
+    return MidiTempoMapEntry_TicksToUs(map, &map->Entries[MidiTempoMap_FindTicks(map, ticks)], ticks);
+}
+
+uint64_t MidiTempoMap_TicksToNs(const MidiTempoMap_t* map, uint64_t ticks)
+{
+    return MidiTempoMapEntry_TicksToNs(map, &map->Entries[MidiTempoMap_FindTicks(map, ticks)], ticks);
+}
+
+uint64_t MidiTempoMap_UsToTicks(const MidiTempoMap_t* map, uint64_t usec)
+{
+    const MidiTempoMapEntry_t* entry = &map->Entries[MidiTempoMap_FindUs(map, usec)];
+
+    uint64_t units = usec * map->PulsesPerQuarterNote;
+    if (units < entry->units || entry->tempo == 0) // entry->usec was rounded down, or a map not built by MidiTempoMap_Create
+        return entry->ticks;
+
+    return entry->ticks + (units - entry->units) / entry->tempo;
+}
+
+// walks all tracks of a file merged in time order, without any waiting
+struct MidiTimeline {
+    const MidiFile_t* midi;
+    MidiTempoMap_t* tempo;
+    uint32_t segment; // entry of the tempo map in effect
+    uint32_t* index; // next event, for each track
+    MidiHeapEntry_t* heap; // unfinished tracks, keyed by the absolute time of their next event
+    uint32_t heapCount;
+
+    // seek index, built by the first seek and reused by the next ones
+    uint64_t** eventTicks; // for each track, absolute time of every event
+    uint32_t** stateEvents; // for each track, position of the events that change the state of a channel (program, controllers...)
+    uint32_t* numStateEvents;
+
+    MidiTimelineEvent_t* chase; // state to restore after the last seek
+    uint32_t chaseCapacity;
+};
+
+MidiTimeline_t* MidiTimeline_Create(const MidiFile_t* midi)
+{
+    if (midi == NULL)
+        return NULL;
+
+    MidiTimeline_t* timeline = (MidiTimeline_t*)calloc(1, sizeof(MidiTimeline_t));
+    if (timeline == NULL)
+        goto error;
+
+    timeline->midi = midi;
+    timeline->index = (uint32_t*)calloc(midi->nTrks + 1, sizeof(uint32_t));
+    timeline->heap = (MidiHeapEntry_t*)calloc(midi->nTrks + 1, sizeof(MidiHeapEntry_t));
+
+    if (!timeline->index || !timeline->heap || (timeline->tempo = MidiTempoMap_Create(midi)) == NULL)
+        goto error;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+        if (midi->Tracks[t].NumEvents)
+            timeline->heap[timeline->heapCount++] = (MidiHeapEntry_t){.ticks = midi->Tracks[t].Events[0].deltaTime, .track = t};
+
+    MidiHeap_Build(timeline->heap, timeline->heapCount);
+
+    return timeline;
+
+    error:
+    Midi_Log(MIDI_LOG_ERRORS, "\nError creating timeline");
+    MidiTimeline_Destroy(timeline);
+    return NULL;
+}
+
+const MidiTempoMap_t* MidiTimeline_GetTempoMap(const MidiTimeline_t* timeline)
+{
+    return timeline->tempo;
+}
+
+int MidiTimeline_Next(MidiTimeline_t* timeline, MidiTimelineEvent_t* next)
+{
+    const MidiFile_t* midi = timeline->midi;
+
+    if (timeline->heapCount == 0)
+        return 0; // all tracks finished
+
+    // earliest pending event; ties go to the lowest track
+    uint16_t track = timeline->heap[0].track;
+    uint64_t ticks = timeline->heap[0].ticks;
+    uint32_t index = timeline->index[track]++;
+
+    uint8_t finished = (timeline->index[track] >= midi->Tracks[track].NumEvents);
+    MidiHeap_ReplaceTop(timeline->heap, &timeline->heapCount, finished, (finished) ? 0 : ticks + midi->Tracks[track].Events[timeline->index[track]].deltaTime);
+
+    // time only moves forward, so the tempo in effect only moves forward too
+    const MidiTempoMap_t* tempo = timeline->tempo;
+    while (timeline->segment + 1 < tempo->NumEntries && tempo->Entries[timeline->segment + 1].ticks <= ticks)
+        timeline->segment++;
+
+    (*next) = (MidiTimelineEvent_t){
+        .event = &midi->Tracks[track].Events[index],
+        .track = track,
+        .index = index,
+        .ticks = ticks,
+        .usec = MidiTempoMapEntry_TicksToUs(tempo, &tempo->Entries[timeline->segment], ticks),
+        .nsec = MidiTempoMapEntry_TicksToNs(tempo, &tempo->Entries[timeline->segment], ticks),
+    };
+
+    return 1;
+}
+
+// events whose effect persists on the channel, and must be re-applied after seeking past them
+static uint8_t MidiEvent_IsChannelState(const MidiEvent_t* event)
+{
+    MidiEventType_t type = MidiEvent_GetType(event);
+
+    return (type == Midi_Event_Type_ProgramChange) || (type == Midi_Event_Type_ControlChange) || (type == Midi_Event_Type_PitchWheelChange) || (type == Midi_Event_Type_ChannelPressure);
+}
+
+// the index counts as built while eventTicks is set, so it is released completely or not at all
+static void MidiTimeline_FreeSeekIndex(MidiTimeline_t* timeline)
+{
+    for (uint16_t t = 0; t < timeline->midi->nTrks; t++)
+    {
+        if (timeline->eventTicks)
+            free(timeline->eventTicks[t]);
+        if (timeline->stateEvents)
+            free(timeline->stateEvents[t]);
+    }
+
+    free(timeline->eventTicks);
+    free(timeline->stateEvents);
+    free(timeline->numStateEvents);
+
+    timeline->eventTicks = NULL;
+    timeline->stateEvents = NULL;
+    timeline->numStateEvents = NULL;
+}
+
+static int MidiTimeline_BuildSeekIndex(MidiTimeline_t* timeline)
+{
+    const MidiFile_t* midi = timeline->midi;
+
+    timeline->eventTicks = (uint64_t**)calloc(midi->nTrks + 1, sizeof(uint64_t*));
+    timeline->stateEvents = (uint32_t**)calloc(midi->nTrks + 1, sizeof(uint32_t*));
+    timeline->numStateEvents = (uint32_t*)calloc(midi->nTrks + 1, sizeof(uint32_t));
+
+    if (!timeline->eventTicks || !timeline->stateEvents || !timeline->numStateEvents)
+        goto error;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+    {
+        const MidiTrack_t* track = &midi->Tracks[t];
+
+        uint32_t numState = 0;
+        for (uint32_t e = 0; e < track->NumEvents; e++)
+            numState += MidiEvent_IsChannelState(&track->Events[e]);
+
+        timeline->eventTicks[t] = (uint64_t*)malloc(sizeof(uint64_t) * (track->NumEvents + 1));
+        timeline->stateEvents[t] = (uint32_t*)malloc(sizeof(uint32_t) * (numState + 1));
+
+        if (!timeline->eventTicks[t] || !timeline->stateEvents[t])
+            goto error;
+
+        uint64_t ticks = 0;
+        for (uint32_t e = 0; e < track->NumEvents; e++)
+        {
+            timeline->eventTicks[t][e] = (ticks += track->Events[e].deltaTime);
+
+            if (MidiEvent_IsChannelState(&track->Events[e]))
+                timeline->stateEvents[t][timeline->numStateEvents[t]++] = e;
+        }
+    }
+
+    return 0;
+
+    error:
+    Midi_Log(MIDI_LOG_ERRORS, "\nError allocating seek index for timeline");
+    MidiTimeline_FreeSeekIndex(timeline); // the next seek tries again
+    return -1;
+}
+
+// first position in a sorted list that is >= value (binary search)
+static uint32_t MidiTimeline_LowerBound(const uint64_t* list, uint32_t count, uint64_t value)
+{
+    uint32_t low = 0, high = count;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (list[mid] < value)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+static int MidiTimelineEvent_Compare(const void* a, const void* b)
+{
+    const MidiTimelineEvent_t* x = (const MidiTimelineEvent_t*)a;
+    const MidiTimelineEvent_t* y = (const MidiTimelineEvent_t*)b;
+
+    if (x->ticks != y->ticks)
+        return (x->ticks < y->ticks) ? -1 : 1;
+    if (x->track != y->track)
+        return (x->track < y->track) ? -1 : 1;
+    return (x->index < y->index) ? -1 : (x->index > y->index);
+}
+
+// collects the latest state-bearing event of each kind on each channel before the current position
+static int MidiTimeline_Chase(MidiTimeline_t* timeline, uint32_t* numChase)
+{
+    const MidiFile_t* midi = timeline->midi;
+
+    // kind: 0-127 controller number, then program, pitch wheel and channel pressure
+    #define CHASE_KINDS (128 + 3)
+    static const int32_t none = -1;
+    int32_t latest[16][CHASE_KINDS]; // index in the chase list
+    uint32_t count = 0;
+
+    for (int ch = 0; ch < 16; ch++)
+        for (int k = 0; k < CHASE_KINDS; k++)
+            latest[ch][k] = none;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+    {
+        // tracks are walked in order and events forward, so the last one seen at the same time is the one the timeline would play last
+        for (uint32_t s = 0; s < timeline->numStateEvents[t] && timeline->stateEvents[t][s] < timeline->index[t]; s++)
+        {
+            uint32_t e = timeline->stateEvents[t][s];
+            MidiEvent_t* event = &midi->Tracks[t].Events[e];
+
+            uint8_t channel, kind;
+            switch (MidiEvent_GetType(event))
+            {
+                case Midi_Event_Type_ControlChange:
+                    channel = ((MidiEventData_ControlChange_t*)event->data)->channel;
+                    kind = ((MidiEventData_ControlChange_t*)event->data)->control & 0x7F;
+                    break;
+
+                case Midi_Event_Type_ProgramChange:
+                    channel = ((MidiEventData_ProgramChange_t*)event->data)->channel;
+                    kind = 128;
+                    break;
+
+                case Midi_Event_Type_PitchWheelChange:
+                    channel = ((MidiEventData_PitchWheelChange_t*)event->data)->channel;
+                    kind = 129;
+                    break;
+
+                default:
+                    channel = ((MidiEventData_ChannelPressure_t*)event->data)->channel;
+                    kind = 130;
+                    break;
+            }
+
+            int32_t* slot = &latest[channel & 0x0F][kind];
+            uint64_t ticks = timeline->eventTicks[t][e];
+
+            if (*slot != none && timeline->chase[*slot].ticks > ticks)
+                continue; // a later change was already found on a previous track
+
+            if (*slot == none)
+            {
+                if (count >= timeline->chaseCapacity)
+                {
+                    uint32_t capacity = (timeline->chaseCapacity) ? timeline->chaseCapacity * 2 : 64;
+
+                    MidiTimelineEvent_t* new_chase = (MidiTimelineEvent_t*)realloc(timeline->chase, sizeof(MidiTimelineEvent_t) * capacity);
+                    if (new_chase == NULL)
+                    {
+                        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating chase list for timeline");
+                        return -1;
+                    }
+
+                    timeline->chase = new_chase;
+                    timeline->chaseCapacity = capacity;
+                }
+
+                (*slot) = count++;
+            }
+
+            timeline->chase[*slot] = (MidiTimelineEvent_t){
+                .event = event,
+                .track = t,
+                .index = e,
+                .ticks = ticks,
+                .usec = MidiTempoMap_TicksToUs(timeline->tempo, ticks),
+                .nsec = MidiTempoMap_TicksToNs(timeline->tempo, ticks),
+            };
+        }
+    }
+    #undef CHASE_KINDS
+
+    // re-apply in the original order (e.g. bank select before program change)
+    if (count > 1)
+        qsort(timeline->chase, count, sizeof(MidiTimelineEvent_t), MidiTimelineEvent_Compare);
+
+    (*numChase) = count;
+    return 0;
+}
+
+int MidiTimeline_Seek(MidiTimeline_t* timeline, uint64_t usec, const MidiTimelineEvent_t** chase, uint32_t* numChase)
+{
+    if (timeline == NULL)
+        return -1;
+
+    if (!timeline->eventTicks && MidiTimeline_BuildSeekIndex(timeline) != 0)
+        return -1;
+
+    const MidiFile_t* midi = timeline->midi;
+
+    // first tick that is not earlier than the requested time
+    uint64_t target = MidiTempoMap_UsToTicks(timeline->tempo, usec);
+    if (MidiTempoMap_TicksToUs(timeline->tempo, target) < usec)
+        target++;
+
+    timeline->heapCount = 0;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+    {
+        uint32_t index = MidiTimeline_LowerBound(timeline->eventTicks[t], midi->Tracks[t].NumEvents, target);
+
+        timeline->index[t] = index;
+
+        if (index < midi->Tracks[t].NumEvents)
+            timeline->heap[timeline->heapCount++] = (MidiHeapEntry_t){.ticks = timeline->eventTicks[t][index], .track = t};
+    }
+
+    MidiHeap_Build(timeline->heap, timeline->heapCount);
+
+    timeline->segment = MidiTempoMap_FindTicks(timeline->tempo, target);
+
+    uint32_t count = 0;
+    if (chase && MidiTimeline_Chase(timeline, &count) != 0)
+        return -1;
+
+    if (chase)
+        (*chase) = timeline->chase;
+    if (numChase)
+        (*numChase) = count;
+
+    return 0;
+}
+
+void MidiTimeline_Destroy(MidiTimeline_t* timeline)
+{
+    if (timeline == NULL)
+        return;
+
+    MidiTimeline_FreeSeekIndex(timeline);
+    free(timeline->chase);
+
+    MidiTempoMap_Destroy(timeline->tempo);
+    free(timeline->index);
+    free(timeline->heap);
+    free(timeline);
+}
+
+// INDEX
+// ===================================================================
+// all events grouped by type, each group in time order, plus the range of keys played on each channel
+// type codes are unique in a byte: meta types are 0x00 - 0x7F, channel events 0x80 - 0xE0 and SysEx2 0xF0
+struct MidiIndex {
+    MidiTimelineEvent_t* events;
+    uint32_t first[257]; // the events of type t are events[first[t]] ... events[first[t+1] - 1]
+    MidiNoteRange_t notes[16];
+};
+
+static MidiIndex_t* MidiIndex_Build(const MidiFile_t* midi)
+{
+    MidiIndex_t* index = (MidiIndex_t*)calloc(1, sizeof(MidiIndex_t));
+    MidiTimeline_t* timeline = NULL;
+    uint32_t total = 0;
+
+    if (index == NULL)
+        goto error;
+
+    // count the events of each type, so every group can be laid out in a single array
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+        for (uint32_t e = 0; e < midi->Tracks[t].NumEvents; e++)
+            index->first[(uint8_t)midi->Tracks[t].Events[e].interface->type + 1]++;
+
+    for (uint32_t type = 1; type < 257; type++)
+        index->first[type] += index->first[type - 1];
+
+    total = index->first[256];
+
+    if ((index->events = (MidiTimelineEvent_t*)malloc(sizeof(MidiTimelineEvent_t) * (total + 1))) == NULL)
+        goto error;
+
+    if ((timeline = MidiTimeline_Create(midi)) == NULL)
+        goto error;
+
+    // the events come out of the timeline in time order, so each group ends up sorted without any further work
+    uint32_t fill[256];
+    memcpy(fill, index->first, sizeof(fill));
+
+    for (uint8_t c = 0; c < 16; c++)
+        index->notes[c] = (MidiNoteRange_t){.NumNotes = 0, .LowestKey = 127, .HighestKey = 0};
+
+    MidiTimelineEvent_t next;
+    while (MidiTimeline_Next(timeline, &next))
+    {
+        uint8_t type = (uint8_t)next.event->interface->type;
+        index->events[fill[type]++] = next;
+
+        if (type == Midi_Event_Type_NoteOn && ((MidiEventData_NoteEvent_t*)next.event->data)->velocity > 0)
+        {
+            const MidiEventData_NoteEvent_t* note = (const MidiEventData_NoteEvent_t*)next.event->data;
+            MidiNoteRange_t* range = &index->notes[note->channel & 0x0F];
+
+            range->NumNotes++;
+
+            if (note->key < range->LowestKey)
+                range->LowestKey = note->key;
+
+            if (note->key > range->HighestKey)
+                range->HighestKey = note->key;
+        }
+    }
+
+    MidiTimeline_Destroy(timeline);
+    return index;
+
+    error:
+    Midi_Log(MIDI_LOG_ERRORS, "\nError building index of MIDI file");
+    MidiTimeline_Destroy(timeline);
+
+    if (index)
+        free(index->events);
+
+    free(index);
+    return NULL;
+}
+
+// the index is a cache: building it does not change the contents of the file, hence the const
+static const MidiIndex_t* MidiFile_GetIndex(const MidiFile_t* midi)
+{
+    if (midi == NULL)
+        return NULL;
+
+    if (midi->Index == NULL)
+        ((MidiFile_t*)midi)->Index = MidiIndex_Build(midi);
+
+    return midi->Index;
+}
+
+static void MidiFile_DropIndex(MidiFile_t* midi)
+{
+    if (midi->Index == NULL)
+        return;
+
+    free(midi->Index->events);
+    free(midi->Index);
+    midi->Index = NULL;
+}
+
+void MidiFile_Invalidate(MidiFile_t* midi)
+{
+    if (midi == NULL)
+        return;
+
+    MidiFile_DropIndex(midi);
+
+    for (uint16_t t = 0; t < midi->nTrks && midi->Tracks; t++)
+        midi->Tracks[t].Encoded = NULL;
+}
+
+void MidiFile_InvalidateTrack(MidiFile_t* midi, uint16_t track)
+{
+    if (midi == NULL)
+        return;
+
+    MidiFile_DropIndex(midi);
+
+    if (track < midi->nTrks && midi->Tracks)
+        midi->Tracks[track].Encoded = NULL;
+}
+
+int Midi_FindEvents(const MidiFile_t* midi, MidiEventType_t type, const MidiTimelineEvent_t** events)
+{
+    const MidiIndex_t* index = MidiFile_GetIndex(midi);
+
+    if (index == NULL || events == NULL)
+        return -1;
+
+    (*events) = &index->events[index->first[(uint8_t)type]];
+
+    return index->first[(uint8_t)type + 1] - index->first[(uint8_t)type];
+}
+
+// first of the count events that is not before ticks
+static uint32_t MidiIndex_LowerBound(const MidiTimelineEvent_t* events, uint32_t count, uint64_t ticks)
+{
+    uint32_t low = 0, high = count;
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (events[mid].ticks < ticks)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+int Midi_FindEventsInRange(const MidiFile_t* midi, MidiEventType_t type, uint64_t fromTicks, uint64_t toTicks, const MidiTimelineEvent_t** events)
+{
+    const MidiTimelineEvent_t* group;
+    int count = Midi_FindEvents(midi, type, &group);
+
+    if (count < 0)
+        return -1;
+
+    uint32_t first = MidiIndex_LowerBound(group, count, fromTicks);
+    uint32_t last = (toTicks > fromTicks) ? MidiIndex_LowerBound(group, count, toTicks) : first;
+
+    (*events) = &group[first];
+
+    return last - first;
+}
+
+int Midi_GetNoteRange(const MidiFile_t* midi, uint8_t channel, MidiNoteRange_t* range)
+{
+    const MidiIndex_t* index = MidiFile_GetIndex(midi);
+
+    if (index == NULL || range == NULL || channel > 15)
+        return -1;
+
+    (*range) = index->notes[channel];
+
+    return 0;
+}
+
+// EDITING
+// ===================================================================
+// the events of a track are kept in one array: an edit moves the events after it, and fixes the delta times on both sides
+#define MIDI_EDIT_MAX_DELTA 0x0FFFFFFF // largest variable-length quantity
+
+uint64_t MidiTrack_GetTicks(const MidiTrack_t* track, uint32_t index)
+{
+    uint64_t ticks = 0;
+
+    for (uint32_t e = 0; e <= index && e < track->NumEvents; e++)
+        ticks += track->Events[e].deltaTime;
+
+    return ticks;
+}
+
+uint32_t MidiTrack_FindTicks(const MidiTrack_t* track, uint64_t ticks)
+{
+    uint64_t now = 0;
+    uint32_t e;
+
+    for (e = 0; e < track->NumEvents; e++)
+        if ((now += track->Events[e].deltaTime) >= ticks)
+            break;
+
+    return e;
+}
+
+static MidiTrack_t* MidiFile_GetEditableTrack(MidiFile_t* midi, uint16_t track)
+{
+    if (midi == NULL || midi->Tracks == NULL || track >= midi->nTrks)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCannot edit track %u: no such track", track);
+        return NULL;
+    }
+
+    return &midi->Tracks[track];
+}
+
+static inline uint8_t MidiTrack_HasEnd(const MidiTrack_t* track)
+{
+    return track->NumEvents > 0 && MidiEvent_GetType(&track->Events[track->NumEvents - 1]) == Midi_Event_Type_EndOfTrack;
+}
+
+// puts the event at the absolute time, after the events already at that time but before the End of Track
+// an End of Track goes after every other event, later than ticks if needed; a track only has one
+// the track takes the event (and its data); returns its index, or -1 leaving the track unchanged
+static int MidiTrack_Place(MidiTrack_t* track, MidiEvent_t event, uint64_t ticks)
+{
+    uint64_t before = 0; // time of the event preceding the position
+    uint32_t e;
+
+    if (MidiEvent_GetType(&event) == Midi_Event_Type_EndOfTrack)
+    {
+        if (MidiTrack_HasEnd(track))
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nCannot place an End of Track: the track already has one");
+            return -1;
+        }
+
+        uint64_t end = (track->NumEvents > 0) ? MidiTrack_GetTicks(track, track->NumEvents - 1) : 0;
+        if (ticks < end)
+            ticks = end;
+    }
+
+    for (e = 0; e < track->NumEvents; e++)
+    {
+        if (before + track->Events[e].deltaTime > ticks)
+            break;
+
+        before += track->Events[e].deltaTime;
+    }
+
+    // past the End of Track: insert in front of it and let it move to the new time
+    uint8_t extendsTrack = 0;
+    if (e == track->NumEvents && MidiTrack_HasEnd(track) && MidiEvent_GetType(&event) != Midi_Event_Type_EndOfTrack)
+    {
+        e--;
+        before -= track->Events[e].deltaTime;
+        extendsTrack = 1;
+    }
+
+    if (ticks - before > MIDI_EDIT_MAX_DELTA)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCannot place an event %llu ticks after the previous one", (unsigned long long)(ticks - before));
+        return -1;
+    }
+
+    MidiEvent_t* events = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * (track->NumEvents + 1));
+    if (events == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %u events", track->NumEvents + 1);
+        return -1;
+    }
+
+    track->Events = events;
+
+    event.deltaTime = (uint32_t)(ticks - before);
+
+    if (e < track->NumEvents)
+    {
+        // the next event keeps its absolute time, or becomes simultaneous if it is the End of Track being pushed back
+        events[e].deltaTime = (extendsTrack) ? 0 : events[e].deltaTime - event.deltaTime;
+        memmove(&events[e + 1], &events[e], sizeof(MidiEvent_t) * (track->NumEvents - e));
+    }
+
+    events[e] = event;
+    track->NumEvents++;
+
+    return (int)e;
+}
+
+// takes the event out of the track, the next event keeps its absolute time
+static int MidiTrack_Remove(MidiTrack_t* track, uint32_t index, MidiEvent_t* removed)
+{
+    if (index >= track->NumEvents)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCannot edit event %u: the track has %u events", index, track->NumEvents);
+        return -1;
+    }
+
+    MidiEvent_t* events = track->Events;
+
+    if (index + 1 < track->NumEvents)
+    {
+        uint64_t delta = (uint64_t)events[index + 1].deltaTime + events[index].deltaTime;
+
+        if (delta > MIDI_EDIT_MAX_DELTA)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nCannot remove an event: the gap left would be %llu ticks", (unsigned long long)delta);
+            return -1;
+        }
+
+        events[index + 1].deltaTime = (uint32_t)delta;
+    }
+
+    *removed = events[index];
+    memmove(&events[index], &events[index + 1], sizeof(MidiEvent_t) * (track->NumEvents - index - 1));
+    track->NumEvents--;
+
+    return 0;
+}
+
+// undoes MidiTrack_Remove: the array still has room for the event, so nothing is allocated and nothing can fail
+static void MidiTrack_Restore(MidiTrack_t* track, uint32_t index, MidiEvent_t removed)
+{
+    MidiEvent_t* events = track->Events;
+
+    memmove(&events[index + 1], &events[index], sizeof(MidiEvent_t) * (track->NumEvents - index));
+
+    if (index < track->NumEvents)
+        events[index + 1].deltaTime -= removed.deltaTime;
+
+    events[index] = removed;
+    track->NumEvents++;
+}
+
+int MidiFile_InsertEvent(MidiFile_t* midi, uint16_t track, uint64_t ticks, uint8_t type, const void* data)
+{
+    MidiTrack_t* t = MidiFile_GetEditableTrack(midi, track);
+    if (t == NULL)
+        return -1;
+
+    MidiEvent_t event;
+    if (MidiEvent_Create(&event, type, 0, 1, midi->Arena) != 0)
+        return -1;
+
+    if (event.interface->alloc_size > 0)
+    {
+        if (data == NULL)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nEvent type 0x%.02x needs data", type);
+            goto error;
+        }
+
+        memcpy(event.data, data, event.interface->alloc_size);
+
+        if (MidiEvent_CopyPayload(&event, midi->Arena) != 0) // text and SysEx get their own copy
+            goto error;
+    }
+
+    int index = MidiTrack_Place(t, event, ticks);
+    if (index < 0)
+        goto error;
+
+    MidiFile_InvalidateTrack(midi, track);
+    return index;
+
+    error:
+    if (!midi->Arena)
+        free(event.data);
+
+    return -1;
+}
+
+int MidiFile_DeleteEvent(MidiFile_t* midi, uint16_t track, uint32_t index)
+{
+    MidiTrack_t* t = MidiFile_GetEditableTrack(midi, track);
+    MidiEvent_t removed;
+
+    if (t == NULL || MidiTrack_Remove(t, index, &removed) != 0)
+        return -1;
+
+    if (!midi->Arena)
+        free(removed.data);
+
+    MidiFile_InvalidateTrack(midi, track);
+    return 0;
+}
+
+int MidiFile_MoveEvent(MidiFile_t* midi, uint16_t track, uint32_t index, uint64_t ticks)
+{
+    MidiTrack_t* t = MidiFile_GetEditableTrack(midi, track);
+    MidiEvent_t moved;
+
+    if (t == NULL || index >= t->NumEvents)
+        return -1;
+
+    if (MidiTrack_Remove(t, index, &moved) != 0)
+        return -1;
+
+    int result = MidiTrack_Place(t, moved, ticks);
+
+    if (result < 0)
+    {
+        MidiTrack_Restore(t, index, moved); // the track is left as it was
+        return -1;
+    }
+
+    MidiFile_InvalidateTrack(midi, track);
+    return result;
+}
+
+// TIME MAP
+// ===================================================================
+uint32_t Midi_MapAbsoluteTime64(MidiAbsoluteTimeMap64_t** list, const MidiFile_t* midi, uint32_t* orphans)
+{
+    if (*list != NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nMake sure your pointer starts NULL!");
+        return -1;
+    }
+
+    MidiTimeline_t* timeline = MidiTimeline_Create(midi);
+    if (timeline == NULL)
+        return 0;
+
+    // notes still waiting for their note-off: one stack per (track, channel, key)
+    // openNotes[] holds 1 + the index in the list of the latest unterminated note-on (0 if none) and
+    // nextOpen[i] links each entry to the previous unterminated note-on of the same stack
+    #define OPEN_NOTE_SLOT(track, channel, key) ((((uint32_t)(track) * 16) + ((channel) & 0x0F)) * 128 + ((key) & 0x7F))
+
+    uint32_t* openNotes = (uint32_t*)calloc((size_t)midi->nTrks * 16 * 128 + 1, sizeof(uint32_t));
+    uint32_t* nextOpen = NULL;
+    uint32_t numEvents = 0, capacity = 0, numOpen = 0;
+
+    if (openNotes == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating table of open notes");
+        MidiTimeline_Destroy(timeline);
+        return 0;
+    }
+
+    MidiTimelineEvent_t next;
+    while (MidiTimeline_Next(timeline, &next))
+    {
+        MidiEvent_t* event = next.event;
+
+        if ((event->interface->type != Midi_Event_Type_NoteOff) && (event->interface->type != Midi_Event_Type_NoteOn))
+            continue;
+
+        if (!event->data) // sanity check
+            continue;
+
+        MidiEventData_NoteEvent_t* this_note = (MidiEventData_NoteEvent_t*)event->data;
+        uint32_t* slot = &openNotes[OPEN_NOTE_SLOT(next.track, this_note->channel, this_note->key)];
+
+        if ((this_note->OnOff == Midi_Event_Type_NoteOff) || (this_note->velocity == 0))
+        {
+            // NOTE OFF
+            // terminate the latest unterminated note on with same key and channel in this track
+            if (*slot == 0)
+                continue; // nothing to terminate
+
+            MidiAbsoluteTimeMap64_t* match = &((*list)[*slot - 1]);
+
+            match->OffEvent = event;
+            match->endTicks = next.ticks;
+            match->endTime = next.usec;
+
+            (*slot) = nextOpen[*slot - 1]; // pop
+            numOpen--;
+        }
+        else
+        {
+            // NOTE ON
+            if (numEvents >= capacity) // grow geometrically
+            {
+                uint32_t new_capacity = (capacity) ? capacity * 2 : 256;
+
+                MidiAbsoluteTimeMap64_t* new_list = (MidiAbsoluteTimeMap64_t*)realloc((*list), sizeof(MidiAbsoluteTimeMap64_t)*new_capacity);
+                if (new_list == NULL)
+                    break; // failed to realloc - original pointer still good
+
+                *list = new_list; // update old pointer
+
+                uint32_t* new_next = (uint32_t*)realloc(nextOpen, sizeof(uint32_t)*new_capacity);
+                if (new_next == NULL)
+                    break;
+
+                nextOpen = new_next;
+                capacity = new_capacity;
+            }
+
+            (*list)[numEvents++] = (MidiAbsoluteTimeMap64_t) {
+                .OnEvent = event,
+                .OffEvent = NULL,
+                .track = next.track,
+                .startTicks = next.ticks,
+                .startTime = next.usec,
+                .endTicks = UINT64_MAX,
+                .endTime = UINT64_MAX, // we figure out end time when we get the note-off
+            };
+
+            // push
+            nextOpen[numEvents - 1] = (*slot);
+            (*slot) = numEvents;
+            numOpen++;
+        }
+    }
+
+    #undef OPEN_NOTE_SLOT
+    free(openNotes);
+    free(nextOpen);
+    MidiTimeline_Destroy(timeline);
+
+    // notes that were never terminated keep OffEvent = NULL and endTime = UINT64_MAX
+    if (orphans)
+        (*orphans) = numOpen;
+
+    return numEvents;
+}
+
+static inline uint32_t Midi_SaturateTime32(uint64_t time)
+{
+    return (time > UINT32_MAX) ? UINT32_MAX : (uint32_t)time;
+}
+
+uint32_t Midi_MapAbsoluteTimeEx(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi, uint32_t* orphans)
+{
+    if (*list != NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nMake sure your pointer starts NULL!");
+        return -1;
+    }
+
+    MidiAbsoluteTimeMap64_t* list64 = NULL;
+    uint32_t numEvents = Midi_MapAbsoluteTime64(&list64, midi, orphans);
+
+    if (list64 == NULL)
+        return 0;
+
+    // narrow in place: each 32-bit entry is smaller than, and never ahead of, the 64-bit one it comes from
+    MidiAbsoluteTimeMap_t* narrow = (MidiAbsoluteTimeMap_t*)(void*)list64;
+
+    for (uint32_t i = 0; i < numEvents; i++)
+    {
+        MidiAbsoluteTimeMap64_t wide = list64[i];
+
+        narrow[i] = (MidiAbsoluteTimeMap_t) {
+            .track = wide.track,
+            .OnEvent = wide.OnEvent,
+            .OffEvent = wide.OffEvent,
+            .startTime = Midi_SaturateTime32(wide.startTime),
+            .endTime = Midi_SaturateTime32(wide.endTime),
+        };
+    }
+
+    MidiAbsoluteTimeMap_t* shrunk = (MidiAbsoluteTimeMap_t*)realloc(narrow, sizeof(MidiAbsoluteTimeMap_t) * ((numEvents) ? numEvents : 1));
+    *list = (shrunk) ? shrunk : narrow;
+
+    return numEvents;
+}
+
+uint32_t Midi_MapAbsoluteTime(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi)
+{
+    return Midi_MapAbsoluteTimeEx(list, midi, NULL);
+}
+
+// CACHE
+// ===================================================================
+// a file decoded once and stored in the layout of the packed tracks and the tempo map: the arrays are used straight from the mapped cache
+// everything is referenced by offset from the start of the cache, in the byte order and struct layout of the machine that wrote it
+#define MIDI_CACHE_MAGIC "EZMC"
+#define MIDI_CACHE_VERSION 1
+#define MIDI_CACHE_BYTE_ORDER 0x01020304
+#define MIDI_CACHE_ALIGN 8
+
+typedef struct MidiCacheHeader {
+    char magic[4];
+    uint16_t version;
+    uint16_t headerSize; // sizeof(MidiCacheHeader_t), catches a different struct layout
+    uint32_t byteOrder;
+    uint32_t sourceSize; // of the SMF file the cache was made from
+    uint64_t sourceHash; // FNV-1a of the same file
+    uint64_t totalSize; // of the cache file, catches a truncated write
+    uint16_t Format;
+    uint16_t nTrks;
+    uint16_t PulsesPerQuarterNote;
+    uint16_t tempoDivision; // MidiTempoMap_t.PulsesPerQuarterNote
+    uint32_t numTempo;
+    uint32_t reserved;
+    uint64_t tempoOffset; // MidiTempoMapEntry_t[numTempo]
+    uint64_t tracksOffset; // MidiCacheTrack_t[nTrks]
+} MidiCacheHeader_t;
+
+typedef struct MidiCacheTrack {
+    uint32_t NumEvents;
+    uint32_t NumMeta;
+    uint32_t PayloadSize;
+    uint32_t reserved;
+    uint64_t deltaTime, absoluteTicks, status, data1, data2, meta, payload; // offsets of the arrays
+} MidiCacheTrack_t;
+
+struct MidiCache {
+    MidiPackedFile_t packed; // arrays inside the mapping, or owned by decoded
+    MidiTempoMap_t tempo;
+    MidiMapping_t map;
+    uint8_t hit; // 1 if loaded from the cache
+    MidiPackedFile_t* decoded; // when the cache was stale
+    MidiTempoMap_t* decodedTempo;
+};
+
+uint64_t Midi_Hash(const void* data, uint32_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 14695981039346656037ull; // FNV-1a 64-bit
+
+    for (uint32_t i = 0; i < length; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+
+    return hash;
+}
+
+static inline uint64_t MidiCache_Align(uint64_t offset)
+{
+    return (offset + MIDI_CACHE_ALIGN - 1) & ~(uint64_t)(MIDI_CACHE_ALIGN - 1);
+}
+
+// writes length bytes at *offset after padding it to the alignment
+static int MidiCache_Put(FILE* file, uint64_t* offset, const void* data, size_t length)
+{
+    static const char zeros[MIDI_CACHE_ALIGN] = {0};
+    uint64_t aligned = MidiCache_Align(*offset);
+
+    if (aligned > *offset && fwrite(zeros, 1, aligned - *offset, file) != aligned - *offset)
+        return -1;
+
+    if (length > 0 && fwrite(data, 1, length, file) != length)
+        return -1;
+
+    *offset = aligned + length;
+    return 0;
+}
+
+// same layout as MidiCache_Put, without writing
+static uint64_t MidiCache_Reserve(uint64_t* offset, size_t length)
+{
+    uint64_t position = MidiCache_Align(*offset);
+    *offset = position + length;
+
+    return position;
+}
+
+static int MidiCache_Write(const char* filename, const MidiPackedFile_t* packed, const MidiTempoMap_t* tempo, uint64_t sourceHash, uint32_t sourceSize)
+{
+    MidiCacheTrack_t* tracks = (MidiCacheTrack_t*)calloc(packed->nTrks + 1, sizeof(MidiCacheTrack_t));
+    if (tracks == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating cache layout");
+        return -1;
+    }
+
+    MidiCacheHeader_t header = {
+        .magic = MIDI_CACHE_MAGIC,
+        .version = MIDI_CACHE_VERSION,
+        .headerSize = sizeof(MidiCacheHeader_t),
+        .byteOrder = MIDI_CACHE_BYTE_ORDER,
+        .sourceSize = sourceSize,
+        .sourceHash = sourceHash,
+        .Format = packed->Format,
+        .nTrks = packed->nTrks,
+        .PulsesPerQuarterNote = packed->PulsesPerQuarterNote,
+        .tempoDivision = tempo->PulsesPerQuarterNote,
+        .numTempo = tempo->NumEntries,
+    };
+
+    // lay everything out first, so the header can be written with the final offsets
+    uint64_t size = sizeof(MidiCacheHeader_t);
+    header.tempoOffset = MidiCache_Reserve(&size, (size_t)tempo->NumEntries * sizeof(MidiTempoMapEntry_t));
+    header.tracksOffset = MidiCache_Reserve(&size, (size_t)packed->nTrks * sizeof(MidiCacheTrack_t));
+
+    for (uint16_t t = 0; t < packed->nTrks; t++)
+    {
+        const MidiPackedTrack_t* ptrack = &packed->Tracks[t];
+        MidiCacheTrack_t* ctrack = &tracks[t];
+
+        ctrack->NumEvents = ptrack->NumEvents;
+        ctrack->NumMeta = ptrack->NumMeta;
+        ctrack->PayloadSize = ptrack->PayloadSize;
+        ctrack->deltaTime = MidiCache_Reserve(&size, (size_t)ptrack->NumEvents * sizeof(uint32_t));
+        ctrack->absoluteTicks = MidiCache_Reserve(&size, (size_t)ptrack->NumEvents * sizeof(uint32_t));
+        ctrack->status = MidiCache_Reserve(&size, ptrack->NumEvents);
+        ctrack->data1 = MidiCache_Reserve(&size, ptrack->NumEvents);
+        ctrack->data2 = MidiCache_Reserve(&size, ptrack->NumEvents);
+        ctrack->meta = MidiCache_Reserve(&size, (size_t)ptrack->NumMeta * sizeof(MidiPackedMeta_t));
+        ctrack->payload = MidiCache_Reserve(&size, ptrack->PayloadSize);
+    }
+
+    header.totalSize = size;
+
+    // write to the side and move it in place, so a reader never maps a half-written cache
+    size_t nameLength = strlen(filename);
+    char* temporary = (char*)malloc(nameLength + 5);
+    if (temporary == NULL)
+    {
+        free(tracks);
+        return -1;
+    }
+
+    memcpy(temporary, filename, nameLength);
+    memcpy(temporary + nameLength, ".tmp", 5);
+
+    FILE* file;
+    if ((file = fopen(temporary, "wb")) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to create cache file %s: %d %s", temporary, errno, strerror(errno));
+        free(temporary);
+        free(tracks);
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    int result = MidiCache_Put(file, &offset, &header, sizeof(header));
+    result |= MidiCache_Put(file, &offset, tempo->Entries, (size_t)tempo->NumEntries * sizeof(MidiTempoMapEntry_t));
+    result |= MidiCache_Put(file, &offset, tracks, (size_t)packed->nTrks * sizeof(MidiCacheTrack_t));
+
+    for (uint16_t t = 0; t < packed->nTrks && result == 0; t++)
+    {
+        const MidiPackedTrack_t* ptrack = &packed->Tracks[t];
+
+        result |= MidiCache_Put(file, &offset, ptrack->DeltaTime, (size_t)ptrack->NumEvents * sizeof(uint32_t));
+        result |= MidiCache_Put(file, &offset, ptrack->AbsoluteTicks, (size_t)ptrack->NumEvents * sizeof(uint32_t));
+        result |= MidiCache_Put(file, &offset, ptrack->Status, ptrack->NumEvents);
+        result |= MidiCache_Put(file, &offset, ptrack->Data1, ptrack->NumEvents);
+        result |= MidiCache_Put(file, &offset, ptrack->Data2, ptrack->NumEvents);
+        result |= MidiCache_Put(file, &offset, ptrack->Meta, (size_t)ptrack->NumMeta * sizeof(MidiPackedMeta_t));
+        result |= MidiCache_Put(file, &offset, ptrack->Payload, ptrack->PayloadSize);
+    }
+
+    if (fclose(file) != 0)
+        result = -1;
+
+    if (result == 0 && rename(temporary, filename) != 0)
+    {
+        remove(filename); // windows does not replace an existing file
+        result = (rename(temporary, filename) == 0) ? 0 : -1;
+    }
+
+    if (result != 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError writing cache file %s", filename);
+        remove(temporary);
+    }
+
+    free(temporary);
+    free(tracks);
+
+    return result;
+}
+
+// the array of count elements at offset must lie within the cache, aligned
+static inline uint8_t MidiCache_IsInside(const MidiMapping_t* map, uint64_t offset, uint64_t count, uint64_t elemSize)
+{
+    return (offset % MIDI_CACHE_ALIGN == 0) && (offset <= map->size) && (count * elemSize <= map->size - offset);
+}
+
+// the hash only ties the cache to the source, not the cache to its own content: the arrays are trusted once
+// every event is known, each meta / SysEx event has its entry in Meta and every payload lies within Payload
+static int MidiCache_CheckEvents(const MidiMapping_t* map, const MidiCacheTrack_t* ctrack)
+{
+    const uint8_t* status = (const uint8_t*)(map->data + ctrack->status);
+    const uint8_t* data1 = (const uint8_t*)(map->data + ctrack->data1);
+    const MidiPackedMeta_t* meta = (const MidiPackedMeta_t*)(map->data + ctrack->meta);
+    uint32_t numMeta = 0;
+
+    for (uint32_t e = 0; e < ctrack->NumEvents; e++)
+    {
+        uint8_t isMeta = (status[e] == 0xFF);
+
+        if (MidiEvent_GetInterface((isMeta) ? data1[e] : status[e], isMeta) == NULL)
+            return -1;
+
+        if (status[e] >= 0xF0)
+            numMeta++;
+    }
+
+    if (numMeta != ctrack->NumMeta)
+        return -1;
+
+    for (uint32_t m = 0; m < ctrack->NumMeta; m++)
+        if ((uint64_t)meta[m].offset + meta[m].length > ctrack->PayloadSize)
+            return -1;
+
+    return 0;
+}
+
+// the lookups divide by the tempo and the division, and search the entries by ticks, units and usec
+// (a later entry is always later in ticks and units, usec may repeat after rounding)
+static int MidiCache_CheckTempo(const MidiMapping_t* map, const MidiCacheHeader_t* header)
+{
+    const MidiTempoMapEntry_t* entries = (const MidiTempoMapEntry_t*)(map->data + header->tempoOffset);
+
+    if (header->tempoDivision == 0 || entries[0].ticks != 0)
+        return -1;
+
+    for (uint32_t i = 0; i < header->numTempo; i++)
+    {
+        if (entries[i].tempo == 0)
+            return -1;
+
+        if (i > 0 && (entries[i].ticks <= entries[i - 1].ticks || entries[i].units <= entries[i - 1].units || entries[i].usec < entries[i - 1].usec))
+            return -1;
+    }
+
+    return 0;
+}
+
+// points the views at the mapped cache, returns -1 if it is not a valid cache of the source
+static int MidiCache_Attach(MidiCache_t* cache, uint64_t sourceHash, uint32_t sourceSize)
+{
+    const MidiMapping_t* map = &cache->map;
+    const MidiCacheHeader_t* header = (const MidiCacheHeader_t*)map->data;
+
+    if (map->size < sizeof(MidiCacheHeader_t)
+        || memcmp(header->magic, MIDI_CACHE_MAGIC, 4) != 0
+        || header->version != MIDI_CACHE_VERSION
+        || header->headerSize != sizeof(MidiCacheHeader_t)
+        || header->byteOrder != MIDI_CACHE_BYTE_ORDER
+        || header->totalSize != map->size)
+        return -1;
+
+    if (header->sourceSize != sourceSize || header->sourceHash != sourceHash)
+        return -1; // stale
+
+    if (header->numTempo == 0
+        || !MidiCache_IsInside(map, header->tempoOffset, header->numTempo, sizeof(MidiTempoMapEntry_t))
+        || !MidiCache_IsInside(map, header->tracksOffset, header->nTrks, sizeof(MidiCacheTrack_t))
+        || MidiCache_CheckTempo(map, header) != 0)
+        return -1;
+
+    const MidiCacheTrack_t* ctracks = (const MidiCacheTrack_t*)(map->data + header->tracksOffset);
+
+    if ((cache->packed.Tracks = (MidiPackedTrack_t*)calloc(header->nTrks + 1, sizeof(MidiPackedTrack_t))) == NULL)
+        return -1;
+
+    for (uint16_t t = 0; t < header->nTrks; t++)
+    {
+        const MidiCacheTrack_t* ctrack = &ctracks[t];
+
+        if (!MidiCache_IsInside(map, ctrack->deltaTime, ctrack->NumEvents, sizeof(uint32_t))
+            || !MidiCache_IsInside(map, ctrack->absoluteTicks, ctrack->NumEvents, sizeof(uint32_t))
+            || !MidiCache_IsInside(map, ctrack->status, ctrack->NumEvents, 1)
+            || !MidiCache_IsInside(map, ctrack->data1, ctrack->NumEvents, 1)
+            || !MidiCache_IsInside(map, ctrack->data2, ctrack->NumEvents, 1)
+            || !MidiCache_IsInside(map, ctrack->meta, ctrack->NumMeta, sizeof(MidiPackedMeta_t))
+            || !MidiCache_IsInside(map, ctrack->payload, ctrack->PayloadSize, 1)
+            || MidiCache_CheckEvents(map, ctrack) != 0)
+            return -1;
+
+        cache->packed.Tracks[t] = (MidiPackedTrack_t){
+            .NumEvents = ctrack->NumEvents,
+            .DeltaTime = (uint32_t*)(map->data + ctrack->deltaTime),
+            .AbsoluteTicks = (uint32_t*)(map->data + ctrack->absoluteTicks),
+            .Status = (uint8_t*)(map->data + ctrack->status),
+            .Data1 = (uint8_t*)(map->data + ctrack->data1),
+            .Data2 = (uint8_t*)(map->data + ctrack->data2),
+            .NumMeta = ctrack->NumMeta,
+            .Meta = (MidiPackedMeta_t*)(map->data + ctrack->meta),
+            .PayloadSize = ctrack->PayloadSize,
+            .Payload = (uint8_t*)(map->data + ctrack->payload),
+        };
+    }
+
+    cache->packed.Format = header->Format;
+    cache->packed.nTrks = header->nTrks;
+    cache->packed.PulsesPerQuarterNote = header->PulsesPerQuarterNote;
+
+    cache->tempo = (MidiTempoMap_t){
+        .PulsesPerQuarterNote = header->tempoDivision,
+        .NumEntries = header->numTempo,
+        .Entries = (MidiTempoMapEntry_t*)(map->data + header->tempoOffset),
+    };
+
+    return 0;
+}
+
+// the slow path: parse the source, and store the result for the next time
+static int MidiCache_Decode(MidiCache_t* cache, const MidiMapping_t* source, uint64_t sourceHash, const char* cacheFile, uint32_t flags)
+{
+    MidiFile_t* midi = MidiFile_OpenMemory(source->data, source->size, MIDI_OPEN_ARENA);
+    if (midi == NULL)
+        return -1;
+
+    cache->decoded = MidiPackedFile_FromFile(midi);
+    cache->decodedTempo = MidiTempoMap_Create(midi);
+    MidiFile_Close(midi);
+
+    if (cache->decoded == NULL || cache->decodedTempo == NULL)
+        return -1;
+
+    cache->packed = *cache->decoded;
+    cache->tempo = *cache->decodedTempo;
+
+    if (flags & MIDI_CACHE_WRITE)
+        MidiCache_Write(cacheFile, cache->decoded, cache->decodedTempo, sourceHash, source->size); // a failure only costs the next load
+
+    return 0;
+}
+
+MidiCache_t* MidiCache_Open(const char* cacheFile, const char* midiFile, uint32_t flags)
+{
+    if (cacheFile == NULL || midiFile == NULL)
+        return NULL;
+
+    MidiCache_t* cache = (MidiCache_t*)calloc(1, sizeof(MidiCache_t));
+    if (cache == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating cache");
+        return NULL;
+    }
+
+    // the source is only hashed, unless the cache turns out stale
+    MidiMapping_t source;
+    if (MidiMapping_Open(midiFile, 1, &source) != 0)
+    {
+        Midi_SetError(MIDI_ERROR_IO);
+        free(cache);
+        return NULL;
+    }
+
+    uint64_t sourceHash = Midi_Hash(source.data, source.size);
+
+    // a missing cache is the expected first case, so do not report it
+    int logCap = threadLogCap;
+    threadLogCap = MIDI_LOG_SILENT;
+    int mapped = MidiMapping_Open(cacheFile, 1, &cache->map);
+    threadLogCap = logCap;
+
+    if (mapped == 0)
+    {
+        if (MidiCache_Attach(cache, sourceHash, source.size) == 0)
+        {
+            cache->hit = 1;
+            MidiMapping_Close(&source);
+            return cache;
+        }
+
+        free(cache->packed.Tracks);
+        cache->packed.Tracks = NULL;
+        MidiMapping_Close(&cache->map);
+    }
+
+    int result = MidiCache_Decode(cache, &source, sourceHash, cacheFile, flags);
+    MidiMapping_Close(&source);
+
+    if (result != 0)
+    {
+        MidiCache_Close(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+const MidiPackedFile_t* MidiCache_GetPacked(const MidiCache_t* cache)
+{
+    return (cache) ? &cache->packed : NULL;
+}
+
+const MidiTempoMap_t* MidiCache_GetTempoMap(const MidiCache_t* cache)
+{
+    return (cache) ? &cache->tempo : NULL;
+}
+
+uint8_t MidiCache_IsHit(const MidiCache_t* cache)
+{
+    return (cache) ? cache->hit : 0;
+}
+
+void MidiCache_Close(MidiCache_t* cache)
+{
+    if (cache == NULL)
+        return;
+
+    if (cache->hit)
+    {
+        free(cache->packed.Tracks); // only the descriptors, the arrays are in the mapping
+        MidiMapping_Close(&cache->map);
+    }
+
+    MidiPackedFile_Close(cache->decoded);
+    MidiTempoMap_Destroy(cache->decodedTempo);
+    free(cache);
+}
+
+// TIMING MONITOR
+// ===================================================================
+// log-linear buckets as in HDR histograms: values below 32 have a bucket each, larger ones keep their 5 most significant bits
+// so no bucket is wider than 1/16 of its values, from 1 ns up to 2^40 ns (about 18 minutes)
+#define MIDI_HISTOGRAM_SUB_BUCKETS 16
+#define MIDI_HISTOGRAM_MAX_BITS 40
+#define MIDI_HISTOGRAM_BUCKETS (MIDI_HISTOGRAM_SUB_BUCKETS * (MIDI_HISTOGRAM_MAX_BITS - 3))
+
+// every counter has a single writer (the playing thread), so it is updated with a plain load and store, never a locked instruction
+struct MidiTimingMonitor {
+    atomic_uint_least64_t histogram[Midi_Timing_Metrics][MIDI_HISTOGRAM_BUCKETS];
+    atomic_uint_least64_t ticks, events, missed, dropped;
+    atomic_uint_least64_t minLateness, maxLateness, maxDispatch, maxDevice;
+    atomic_uint resetRequested; // set by the reader, honored by the writer at the next tick
+    uint64_t budgetNs;
+    MidiRing_t trace;
+    uint8_t hasTrace;
+};
+
+static uint32_t MidiHistogram_Bucket(uint64_t value)
+{
+    if (value >> MIDI_HISTOGRAM_MAX_BITS)
+        value = (1ull << MIDI_HISTOGRAM_MAX_BITS) - 1;
+
+    if (value < 2*MIDI_HISTOGRAM_SUB_BUCKETS)
+        return (uint32_t)value;
+
+#if defined(__GNUC__)
+    uint32_t shift = 63 - __builtin_clzll(value) - 4;
+#else
+    uint32_t shift = 0;
+    while ((value >> shift) >= 2*MIDI_HISTOGRAM_SUB_BUCKETS)
+        shift++;
+#endif
+
+    return shift * MIDI_HISTOGRAM_SUB_BUCKETS + (uint32_t)(value >> shift);
+}
+
+// largest value that falls in the bucket
+static uint64_t MidiHistogram_UpperBound(uint32_t bucket)
+{
+    if (bucket < 2*MIDI_HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+
+    uint32_t shift = bucket / MIDI_HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket - shift * MIDI_HISTOGRAM_SUB_BUCKETS;
+
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static inline void MidiCounter_Add(atomic_uint_least64_t* counter, uint64_t value)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline void MidiCounter_Max(atomic_uint_least64_t* counter, uint64_t value)
+{
+    if (value > atomic_load_explicit(counter, memory_order_relaxed))
+        atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static void MidiTimingMonitor_Clear(MidiTimingMonitor_t* monitor)
+{
+    for (uint32_t m = 0; m < Midi_Timing_Metrics; m++)
+        for (uint32_t b = 0; b < MIDI_HISTOGRAM_BUCKETS; b++)
+            atomic_store_explicit(&monitor->histogram[m][b], 0, memory_order_relaxed);
+
+    atomic_store_explicit(&monitor->ticks, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->events, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->missed, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->dropped, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->minLateness, UINT64_MAX, memory_order_relaxed);
+    atomic_store_explicit(&monitor->maxLateness, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->maxDispatch, 0, memory_order_relaxed);
+    atomic_store_explicit(&monitor->maxDevice, 0, memory_order_relaxed);
+}
+
+// called by the playing thread once per tick, never blocks nor allocates
+static void MidiTimingMonitor_Record(MidiTimingMonitor_t* monitor, const MidiTimingSample_t* sample)
+{
+    if (atomic_exchange_explicit(&monitor->resetRequested, 0, memory_order_acquire))
+        MidiTimingMonitor_Clear(monitor);
+
+    uint64_t lateness = (sample->WokeNs > sample->DeadlineNs) ? sample->WokeNs - sample->DeadlineNs : 0;
+    const uint64_t values[Midi_Timing_Metrics] = {lateness, sample->DispatchNs, sample->DeviceNs};
+
+    for (uint32_t m = 0; m < Midi_Timing_Metrics; m++)
+        MidiCounter_Add(&monitor->histogram[m][MidiHistogram_Bucket(values[m])], 1);
+
+    MidiCounter_Add(&monitor->ticks, 1);
+    MidiCounter_Add(&monitor->events, sample->Events);
+
+    if (lateness > monitor->budgetNs)
+        MidiCounter_Add(&monitor->missed, 1);
+
+    if (lateness < atomic_load_explicit(&monitor->minLateness, memory_order_relaxed))
+        atomic_store_explicit(&monitor->minLateness, lateness, memory_order_relaxed);
+
+    MidiCounter_Max(&monitor->maxLateness, lateness);
+    MidiCounter_Max(&monitor->maxDispatch, sample->DispatchNs);
+    MidiCounter_Max(&monitor->maxDevice, sample->DeviceNs);
+
+    if (monitor->hasTrace && MidiRing_Push(&monitor->trace, sample) != 0)
+        MidiCounter_Add(&monitor->dropped, 1); // never wait for the reader
+}
+
+MidiTimingMonitor_t* MidiTimingMonitor_Create(uint32_t traceCapacity, uint32_t budgetUs)
+{
+    MidiTimingMonitor_t* monitor = (MidiTimingMonitor_t*)calloc(1, sizeof(MidiTimingMonitor_t));
+    if (monitor == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating timing monitor");
+        return NULL;
+    }
+
+    if (traceCapacity > 0)
+    {
+        if (MidiRing_Init(&monitor->trace, sizeof(MidiTimingSample_t), traceCapacity) != 0)
+        {
+            free(monitor);
+            return NULL;
+        }
+
+        monitor->hasTrace = 1;
+    }
+
+    monitor->budgetNs = (uint64_t)budgetUs * 1000;
+    atomic_init(&monitor->resetRequested, 0);
+    MidiTimingMonitor_Clear(monitor);
+
+    return monitor;
+}
+
+void MidiTimingMonitor_Destroy(MidiTimingMonitor_t* monitor)
+{
+    if (monitor == NULL)
+        return;
+
+    if (monitor->hasTrace)
+        MidiRing_Free(&monitor->trace);
+
+    free(monitor);
+}
+
+void MidiTimingMonitor_Reset(MidiTimingMonitor_t* monitor)
+{
+    if (monitor)
+        atomic_store_explicit(&monitor->resetRequested, 1, memory_order_release);
+}
+
+// the counters are read one by one while they may still change, so the snapshot is only approximately coherent
+void MidiTimingMonitor_GetStats(const MidiTimingMonitor_t* monitor, MidiTimingStats_t* stats)
+{
+    MidiTimingMonitor_t* m = (MidiTimingMonitor_t*)monitor; // atomic loads need a non-const object
+    *stats = (MidiTimingStats_t){0};
+
+    if (m == NULL || atomic_load_explicit(&m->resetRequested, memory_order_acquire))
+        return;
+
+    stats->Ticks = atomic_load_explicit(&m->ticks, memory_order_relaxed);
+    stats->Events = atomic_load_explicit(&m->events, memory_order_relaxed);
+    stats->MissedDeadlines = atomic_load_explicit(&m->missed, memory_order_relaxed);
+    stats->DroppedSamples = atomic_load_explicit(&m->dropped, memory_order_relaxed);
+    stats->MaxLatenessNs = atomic_load_explicit(&m->maxLateness, memory_order_relaxed);
+    stats->MaxDispatchNs = atomic_load_explicit(&m->maxDispatch, memory_order_relaxed);
+    stats->MaxDeviceNs = atomic_load_explicit(&m->maxDevice, memory_order_relaxed);
+
+    uint64_t minLateness = atomic_load_explicit(&m->minLateness, memory_order_relaxed);
+    if (stats->Ticks > 0 && minLateness <= stats->MaxLatenessNs)
+    {
+        stats->MinLatenessNs = minLateness;
+        stats->MaxJitterNs = stats->MaxLatenessNs - minLateness;
+    }
+}
+
+uint64_t MidiTimingMonitor_GetPercentile(const MidiTimingMonitor_t* monitor, MidiTimingMetric_t metric, double percentile)
+{
+    MidiTimingMonitor_t* m = (MidiTimingMonitor_t*)monitor;
+
+    if (m == NULL || metric >= Midi_Timing_Metrics || atomic_load_explicit(&m->resetRequested, memory_order_acquire))
+        return 0;
+
+    // copy first, so the total and the walk agree even if the player is recording meanwhile
+    uint64_t counts[MIDI_HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+
+    for (uint32_t b = 0; b < MIDI_HISTOGRAM_BUCKETS; b++)
+        total += (counts[b] = atomic_load_explicit(&m->histogram[metric][b], memory_order_relaxed));
+
+    if (total == 0)
+        return 0;
+
+    if (percentile < 0)
+        percentile = 0;
+    else if (percentile > 100)
+        percentile = 100;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < MIDI_HISTOGRAM_BUCKETS; b++)
+        if ((seen += counts[b]) >= rank)
+            return MidiHistogram_UpperBound(b);
+
+    return MidiHistogram_UpperBound(MIDI_HISTOGRAM_BUCKETS - 1);
+}
+
+int MidiTimingMonitor_PollSample(MidiTimingMonitor_t* monitor, MidiTimingSample_t* sample)
+{
+    if (monitor == NULL || !monitor->hasTrace)
+        return 0;
+
+    return MidiRing_Pop(&monitor->trace, sample);
+}
+
+// PLAYER
+// ===================================================================
+
+#if defined(unix) || defined(__unix__) || defined(__unix)
+
+// apt-get install fluidsynth; apt-get install libfluidsynth-dev;
+// must include "-lfluidsynth" in linker options
+#include <fluidsynth.h>
+
+struct MidiDevice {
+    fluid_settings_t* settings;
+    fluid_synth_t* synth;
+    fluid_audio_driver_t* adriver;
+};
+
+#define SOUND_FONT_PATH "/usr/share/sounds/sf2/FluidR3_GM.sf2"
+
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+uint64_t MidiClock_NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// blocks in the kernel until the absolute deadline, no matter how far ahead it is
+static void MidiClock_KernelSleepUntil(uint64_t deadlineNs)
+{
+    struct timespec ts = {
+        .tv_sec = deadlineNs / 1000000000ull,
+        .tv_nsec = deadlineNs % 1000000000ull,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ; // interrupted by a signal: the deadline is absolute, so just go back to sleep
+}
+
+typedef struct MidiThreadPriority {
+    int policy;
+    struct sched_param param;
+    uint8_t raised;
+} MidiThreadPriority_t;
+
+static void MidiThread_RaisePriority(MidiThreadPriority_t* saved)
+{
+    saved->raised = 0;
+
+    if (pthread_getschedparam(pthread_self(), &saved->policy, &saved->param) != 0)
+        return;
+
+    // high enough to preempt normal threads, low enough to leave room for the audio and IRQ threads
+    struct sched_param rt = {.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2};
+
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &rt) != 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCould not raise the player to realtime priority (missing CAP_SYS_NICE / rtprio limit?)");
+        return;
+    }
+
+    saved->raised = 1;
+}
+
+static void MidiThread_RestorePriority(const MidiThreadPriority_t* saved)
+{
+    if (saved->raised)
+        pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+}
+
+MidiDevice_t* MidiDevice_Create()
+{
+    MidiDevice_t* device = (MidiDevice_t*)calloc(1, sizeof(MidiDevice_t));
+    if (device == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating MIDI device");
+        return NULL;
+    }
+
+    device->settings = new_fluid_settings();
+    fluid_settings_setstr(device->settings, "audio.driver", "alsa");
+
+    device->synth = new_fluid_synth(device->settings);
+    fluid_synth_sfload(device->synth, SOUND_FONT_PATH, 1);
+
+    device->adriver = new_fluid_audio_driver(device->settings, device->synth);
+
+    return device;
+}
+
+void MidiDevice_ResetEx(MidiDevice_t* device)
+{
+    for (uint8_t ch = 0; ch < 16; ch++)
+        fluid_synth_all_sounds_off(device->synth, ch);
+}
+
+int MidiDevice_SilenceChannel(MidiDevice_t* device, uint8_t channel)
+{
+    return (fluid_synth_all_sounds_off(device->synth, channel & 0x0F) == FLUID_OK) ? 0 : -1;
+}
+
+void MidiDevice_Destroy(MidiDevice_t* device)
+{
+    if (device == NULL)
+        return;
+
+    delete_fluid_audio_driver(device->adriver);
+    delete_fluid_synth(device->synth);
+    delete_fluid_settings(device->settings);
+    free(device);
+}
+
+int MidiDevice_SetChannelInstrumentEx(MidiDevice_t* device, uint8_t channel, uint8_t instrument)
+{
+     return (fluid_synth_program_change(device->synth, channel, instrument) == FLUID_OK) ? 0 : -1;
+}
+
+int MidiDevice_PlayNoteEx(MidiDevice_t* device, uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state)
+{
+    int result;
+
+    if (state)
+        result = fluid_synth_noteon(device->synth, channel, key, velocity);
+    else
+        result = fluid_synth_noteoff(device->synth, channel, key);
+
+    return (result == FLUID_OK) ? 0 : -1;
+}
+
+int MidiDevice_SendMessage(MidiDevice_t* device, const uint8_t* msg, uint32_t length)
+{
+    fluid_synth_t* synth = device->synth;
+    int ch = msg[0] & 0x0F;
+    int result;
+
+    switch (msg[0] & 0xF0)
+    {
+        case Midi_Event_Type_NoteOff:               result = fluid_synth_noteoff(synth, ch, msg[1]); break;
+        case Midi_Event_Type_NoteOn:                result = fluid_synth_noteon(synth, ch, msg[1], msg[2]); break;
+        case Midi_Event_Type_PolyphonicKeyPressure: result = fluid_synth_key_pressure(synth, ch, msg[1], msg[2]); break;
+        case Midi_Event_Type_ControlChange:         result = fluid_synth_cc(synth, ch, msg[1], msg[2]); break;
+        case Midi_Event_Type_ProgramChange:         result = fluid_synth_program_change(synth, ch, msg[1]); break;
+        case Midi_Event_Type_ChannelPressure:       result = fluid_synth_channel_pressure(synth, ch, msg[1]); break;
+        case Midi_Event_Type_PitchWheelChange:      result = fluid_synth_pitch_bend(synth, ch, msg[1] | (msg[2] << 7)); break;
+
+        case Midi_Event_Type_SysEx2: // fluidsynth takes the payload without the F0 ... F7 framing
+            if (msg[0] != Midi_Event_Type_SysEx2 || length < 2)
+                return -1;
+
+            result = fluid_synth_sysex(synth, (const char*)&msg[1], length - 2, NULL, NULL, NULL, 0);
+            break;
+
+        default:
+            return -1;
+    }
+
+    return (result == FLUID_OK) ? 0 : -1;
+}
+
+#endif
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+
+#include <windows.h>
+#include <mmsystem.h> // must include "-lwinmm" in linker options
+
+#define MIDI_SYSEX_SLOTS 4 // SysEx messages the driver may hold at once
+
+// a SysEx message in flight: the driver owns the copy until it marks the header done
+typedef struct MidiSysExSlot {
+    MIDIHDR header;
+    char* buffer;
+    uint32_t capacity;
+    uint8_t busy;
+} MidiSysExSlot_t;
+
+struct MidiDevice {
+    HMIDIOUT handle;
+    HANDLE done; // signalled by the driver each time it is done with a buffer
+    MidiSysExSlot_t sysex[MIDI_SYSEX_SLOTS];
+};
+
+uint64_t MidiClock_NowNs()
+{
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    // split into seconds and remainder so the multiplication cannot overflow
+    uint64_t sec = now.QuadPart / freq.QuadPart;
+    uint64_t rem = now.QuadPart % freq.QuadPart;
+
+    return sec * 1000000000ull + rem * 1000000000ull / freq.QuadPart;
+}
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // missing from older SDK headers
+#endif
+
+// blocks in the kernel until the absolute deadline, no matter how far ahead it is
+static void MidiClock_KernelSleepUntil(uint64_t deadlineNs)
+{
+    // one timer per thread, kept for the lifetime of the thread
+    static _Thread_local HANDLE timer = NULL;
+
+    if (timer == NULL)
+    {
+        timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+        if (timer == NULL) // high resolution timers need Windows 10 1803 or later
+            timer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+    }
+
+    uint64_t now = MidiClock_NowNs();
+    if (now >= deadlineNs)
+        return;
+
+    // waitable timers take absolute times in wall clock, so convert to a relative wait (negative, in 100ns units)
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)((deadlineNs - now) / 100);
+
+    if ((timer != NULL) && (due.QuadPart < 0) && SetWaitableTimer(timer, &due, 0, NULL, NULL, FALSE))
+        WaitForSingleObject(timer, INFINITE);
+    else if ((deadlineNs - now) >= 1000000)
+        Sleep((deadlineNs - now) / 1000000); // never call Sleep with 0 because it will relinquish time slice for unknown amount of time
+}
+
+typedef struct MidiThreadPriority {
+    int priority;
+    uint8_t raised;
+} MidiThreadPriority_t;
+
+static void MidiThread_RaisePriority(MidiThreadPriority_t* saved)
+{
+    saved->priority = GetThreadPriority(GetCurrentThread());
+    saved->raised = 0;
+
+    if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCould not raise the player to realtime priority");
+        return;
+    }
+
+    saved->raised = 1;
+}
+
+static void MidiThread_RestorePriority(const MidiThreadPriority_t* saved)
+{
+    if (saved->raised)
+        SetThreadPriority(GetCurrentThread(), saved->priority);
+}
+
+MidiDevice_t* MidiDevice_Create()
+{
+    const UINT devid = -1;
+
+    MidiDevice_t* device = (MidiDevice_t*)calloc(1, sizeof(MidiDevice_t));
+    if (device == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating MIDI device");
+        return NULL;
+    }
+
+    if ((device->done = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError creating MIDI device event");
+        free(device);
+        return NULL;
+    }
+
+    if ( midiOutOpen(&device->handle, devid, (DWORD_PTR)device->done, 0, CALLBACK_EVENT) != MMSYSERR_NOERROR )
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError opening MIDI output device");
+        CloseHandle(device->done);
+        free(device);
+        return NULL;
+    }
+
+    MIDIOUTCAPS     moc;
+    if (!midiOutGetDevCaps(devid, &moc, sizeof(MIDIOUTCAPS)))
+    {
+        Midi_Log(MIDI_LOG_INFO, "\nOPENED MIDI DEVICE: %s", moc.szPname);
+    }
+
+    return device;
+}
+
+// unprepares the SysEx buffers the driver is done with, so their slots can be used again; returns how many are still in flight
+static int MidiDevice_ReclaimSysEx(MidiDevice_t* device)
+{
+    int pending = 0;
+
+    for (int i = 0; i < MIDI_SYSEX_SLOTS; i++)
+    {
+        MidiSysExSlot_t* slot = &device->sysex[i];
+
+        if (slot->busy && (slot->header.dwFlags & MHDR_DONE))
+        {
+            midiOutUnprepareHeader(device->handle, &slot->header, sizeof(MIDIHDR));
+            slot->busy = 0;
+        }
+
+        pending += slot->busy;
+    }
+
+    return pending;
+}
+
+void MidiDevice_ResetEx(MidiDevice_t* device)
+{
+    midiOutReset(device->handle); // stop all notes, and return the pending SysEx buffers
+    MidiDevice_ReclaimSysEx(device);
+}
+
+void MidiDevice_Destroy(MidiDevice_t* device)
+{
+    if (device == NULL)
+        return;
+
+    MidiDevice_ResetEx(device);
+
+    // the buffers may only be freed once the driver has returned them
+    for (int tries = 0; tries < 100 && MidiDevice_ReclaimSysEx(device) > 0; tries++)
+        WaitForSingleObject(device->done, 10);
+
+    midiOutClose(device->handle); // release resources
+    CloseHandle(device->done);
+
+    for (int i = 0; i < MIDI_SYSEX_SLOTS; i++)
+        free(device->sysex[i].buffer);
+
+    free(device);
+}
+
+int MidiSendShortMessage(MidiDevice_t* device, uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3)
+{
+    union
+     {
+         uint32_t raw;
+         uint8_t data[4];
+     } midiMessage;
+
+     midiMessage.data[0] = d0;
+     midiMessage.data[1] = d1;
+     midiMessage.data[2] = d2;
+     midiMessage.data[3] = d3;
+
+     if (midiOutShortMsg(device->handle, midiMessage.raw ) != MMSYSERR_NOERROR)
+     {
+         Midi_Log(MIDI_LOG_ERRORS, "\nError sending midi-message [%.8x]", midiMessage.raw);
+         return -1;
+     }
+
+     return 0;
+}
+
+int MidiDevice_SilenceChannel(MidiDevice_t* device, uint8_t channel)
+{
+    return MidiSendShortMessage(device, 0xB0 + (channel & 0x0F), 120, 0, 0); // CC 120: all sound off
+}
+
+int MidiDevice_SetChannelInstrumentEx(MidiDevice_t* device, uint8_t channel, uint8_t instrument)
+{
+    return MidiSendShortMessage(device, 0xC0 + (channel & 0x0F), instrument, 0, 0);
+}
+
+int MidiDevice_PlayNoteEx(MidiDevice_t* device, uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state)
+{
+     return MidiSendShortMessage(device, (state ? 0x90 : 0x80) + (channel & 0x0F), key, velocity, 0);
+}
+
+// sends without waiting for the driver: the message is copied into a free slot, which is reclaimed once the driver is done
+// only blocks, on the driver's event rather than spinning, when every slot is still in flight
+static int MidiSendLongMessage(MidiDevice_t* device, const uint8_t* msg, uint32_t length)
+{
+    MidiSysExSlot_t* slot = NULL;
+
+    while (slot == NULL)
+    {
+        MidiDevice_ReclaimSysEx(device);
+
+        for (int i = 0; i < MIDI_SYSEX_SLOTS && slot == NULL; i++)
+            if (!device->sysex[i].busy)
+                slot = &device->sysex[i];
+
+        if (slot == NULL)
+            WaitForSingleObject(device->done, 10); // with a timeout: the event also fires for other messages
+    }
+
+    if (slot->capacity < length)
+    {
+        char* buffer = (char*)realloc(slot->buffer, length);
+        if (buffer == NULL)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %u bytes for SysEx", length);
+            return -1;
+        }
+
+        slot->buffer = buffer;
+        slot->capacity = length;
+    }
+
+    memcpy(slot->buffer, msg, length);
+    slot->header = (MIDIHDR){
+        .lpData = slot->buffer,
+        .dwBufferLength = length,
+        .dwBytesRecorded = length,
+    };
+
+    if (midiOutPrepareHeader(device->handle, &slot->header, sizeof(MIDIHDR)) != MMSYSERR_NOERROR)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError preparing SysEx of %u bytes", length);
+        return -1;
+    }
+
+    if (midiOutLongMsg(device->handle, &slot->header, sizeof(MIDIHDR)) != MMSYSERR_NOERROR)
+    {
+        midiOutUnprepareHeader(device->handle, &slot->header, sizeof(MIDIHDR));
+        Midi_Log(MIDI_LOG_ERRORS, "\nError sending SysEx of %u bytes", length);
+        return -1;
+    }
+
+    slot->busy = 1;
+    return 0;
+}
+
+int MidiDevice_SendMessage(MidiDevice_t* device, const uint8_t* msg, uint32_t length)
+{
+    if (msg[0] == Midi_Event_Type_SysEx2)
+        return MidiSendLongMessage(device, msg, length);
+
+    return MidiSendShortMessage(device, msg[0], (length > 1) ? msg[1] : 0, (length > 2) ? msg[2] : 0, 0);
+}
+
+#endif
+
+// size of the complete message starting at msg, 0 if it is not a valid message
+static uint32_t MidiMessage_Length(const uint8_t* msg, uint32_t available)
+{
+    if (available == 0 || !(msg[0] & 0x80))
+        return 0;
+
+    if (msg[0] == Midi_Event_Type_SysEx2)
+    {
+        for (uint32_t i = 1; i < available; i++)
+            if (msg[i] == 0xF7)
+                return i + 1;
+
+        return 0; // unterminated
+    }
+
+    uint32_t length = ((msg[0] & 0xF0) == Midi_Event_Type_ProgramChange || (msg[0] & 0xF0) == Midi_Event_Type_ChannelPressure) ? 2 : 3;
+
+    return (length <= available) ? length : 0;
+}
+
+// neither backend has a multi-message call that fits (FluidSynth has no public batch, WinMM would need stream mode): one call per message
+int MidiDevice_SendBatch(MidiDevice_t* device, const uint8_t* messages, uint32_t length)
+{
+    int result = 0;
+
+    for (uint32_t offset = 0, size; offset < length; offset += size)
+    {
+        if ((size = MidiMessage_Length(&messages[offset], length - offset)) == 0)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nMalformed message at offset %u of batch", offset);
+            return -1;
+        }
+
+        if (MidiDevice_SendMessage(device, &messages[offset], size) != 0)
+            result = -1; // keep going, one bad message should not drop the rest of the chord
+    }
+
+    return result;
+}
+
+// the device behind the original global API
+static MidiDevice_t* defaultDevice = NULL;
+
+MidiDevice_t* MidiDevice_GetDefault()
+{
+    return defaultDevice;
+}
+
+int MidiDevice_Open()
+{
+    if (defaultDevice != NULL)
+        return 0; // already open
+
+    return ((defaultDevice = MidiDevice_Create()) != NULL) ? 0 : -1;
+}
+
+void MidiDevice_Close()
+{
+    MidiDevice_Destroy(defaultDevice);
+    defaultDevice = NULL;
+}
+
+void MidiDevice_Reset()
+{
+    if (defaultDevice)
+        MidiDevice_ResetEx(defaultDevice);
+}
+
+int MidiDevice_SetChannelInstrument(uint8_t channel, uint8_t instrument)
+{
+    return (defaultDevice) ? MidiDevice_SetChannelInstrumentEx(defaultDevice, channel, instrument) : -1;
+}
+
+int MidiDevice_PlayNote(uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state)
+{
+    return (defaultDevice) ? MidiDevice_PlayNoteEx(defaultDevice, key, channel, velocity, state) : -1;
+}
+
+// sleeps until the absolute monotonic deadline, so time spent elsewhere is never added on top
+// the kernel wakes us spinUs early and the rest is busy-waited, trading a little CPU for less jitter
+void MidiClock_SleepUntil(uint64_t deadlineNs, uint32_t spinUs)
+{
+    uint64_t spinNs = (uint64_t)spinUs * 1000;
+
+    if (deadlineNs > spinNs)
+        MidiClock_KernelSleepUntil(deadlineNs - spinNs);
+
+    while (MidiClock_NowNs() < deadlineNs)
+        ; // spin
+}
+
+int trivial_callback(MidiEvent_t* event, uint16_t track, uint32_t index, uint64_t timeTicks, uint64_t timeUs, void* user)
+{
+    return Player_Callback_PlayEvent;
+}
+
+// adapts the original 32-bit callback
+typedef struct MidiLegacyCallback {
+    playerCallback func;
+} MidiLegacyCallback_t;
+
+static int legacy_callback(MidiEvent_t* event, uint16_t track, uint32_t index, uint64_t timeTicks, uint64_t timeUs, void* user)
+{
+    const MidiLegacyCallback_t* legacy = (const MidiLegacyCallback_t*)user;
+
+    return legacy->func(event, track, (uint32_t)timeTicks, (uint32_t)timeUs);
+}
+
+static void MidiPlaybackStats_Record(MidiPlaybackStats_t* stats, int64_t latenessUs)
+{
+    if (stats->Events == 0 || latenessUs > stats->MaxLatenessUs)
+        stats->MaxLatenessUs = latenessUs;
+
+    stats->Events++;
+    stats->LastLatenessUs = latenessUs;
+    stats->TotalLatenessUs += latenessUs;
+}
+
+static inline uint8_t MidiPlayer_MapChannel(const MidiPlayOptions_t* options, uint8_t channel)
+{
+    return (options->ChannelMap) ? (options->ChannelMap[channel & 0x0F] & 0x0F) : channel;
+}
+
+// every message due at the same instant is collected here and handed to the device after a single wait
+#define MIDI_BATCH_CAPACITY 1024
+
+typedef struct MidiMessageBatch {
+    uint32_t length;
+    uint8_t timed; // measure the device calls into deviceNs (timing monitor)
+    uint64_t deviceNs;
+    uint8_t data[MIDI_BATCH_CAPACITY];
+} MidiMessageBatch_t;
+
+static void MidiMessageBatch_Send(MidiMessageBatch_t* batch, MidiDevice_t* device, const uint8_t* messages, uint32_t length, uint8_t single)
+{
+    uint64_t startNs = (batch->timed) ? MidiClock_NowNs() : 0;
+
+    if (single)
+        MidiDevice_SendMessage(device, messages, length);
+    else
+        MidiDevice_SendBatch(device, messages, length);
+
+    if (batch->timed)
+        batch->deviceNs += MidiClock_NowNs() - startNs;
+}
+
+static void MidiMessageBatch_Flush(MidiMessageBatch_t* batch, MidiDevice_t* device)
+{
+    if (batch->length > 0 && device != NULL)
+        MidiMessageBatch_Send(batch, device, batch->data, batch->length, 0);
+
+    batch->length = 0;
+}
+
+// encodes a channel event or F0 SysEx as it goes on the wire, returns 0 for events that are not sent (meta)
+// msg must hold 3 bytes, or the SysEx payload plus 2
+static uint32_t MidiEvent_ToMessage(const MidiEvent_t* event, uint8_t* msg, const MidiPlayOptions_t* options)
+{
+    int type = event->interface->type;
+
+    if (type == Midi_Event_Type_SysEx2)
+    {
+        const MidiEventData_SysEx_t* sysex = (const MidiEventData_SysEx_t*)event->data;
+        uint32_t length = sysex->length;
+
+        msg[0] = Midi_Event_Type_SysEx2;
+        memcpy(&msg[1], sysex->text, length);
+
+        if (length == 0 || (uint8_t)sysex->text[length - 1] != 0xF7) // the file may leave the terminator out
+            msg[1 + length++] = 0xF7;
+
+        return 1 + length;
+    }
+
+    if (!(type & 0x80))
+        return 0;
+
+    uint32_t length = MidiEvent_WriteData((char*)msg, event);
+    msg[0] = (msg[0] & 0xF0) | MidiPlayer_MapChannel(options, msg[0] & 0x0F);
+
+    return length;
+}
+
+// queues the message of an event, in order with the ones already queued
+// SysEx bigger than a whole batch is sent on its own, from a buffer of its size
+static void MidiMessageBatch_Add(MidiMessageBatch_t* batch, MidiDevice_t* device, const MidiEvent_t* event, const MidiPlayOptions_t* options)
+{
+    if (event->interface->type == Midi_Event_Type_SysEx2 && ((const MidiEventData_SysEx_t*)event->data)->length + 2 > MIDI_BATCH_CAPACITY)
+    {
+        MidiMessageBatch_Flush(batch, device);
+
+        uint8_t* msg = (uint8_t*)malloc(((const MidiEventData_SysEx_t*)event->data)->length + 2);
+        if (msg == NULL)
+            return;
+
+        uint32_t length = MidiEvent_ToMessage(event, msg, options);
+
+        if (device != NULL)
+            MidiMessageBatch_Send(batch, device, msg, length, 1);
+
+        free(msg);
+        return;
+    }
+
+    uint8_t msg[MIDI_BATCH_CAPACITY];
+    uint32_t length = MidiEvent_ToMessage(event, msg, options);
+
+    if (length == 0)
+        return;
+
+    if (batch->length + length > MIDI_BATCH_CAPACITY)
+        MidiMessageBatch_Flush(batch, device);
+
+    memcpy(&batch->data[batch->length], msg, length);
+    batch->length += length;
+}
+
+// runs the callback on an event then queues it for the device, unless the callback declined
+// chased events restore the state of the channels but never sound a note
+static int MidiPlayer_Dispatch(const MidiTimelineEvent_t* next, uint8_t chasing, playerCallback64 cbFunc, const MidiPlayOptions_t* options, MidiDevice_t* device, MidiMessageBatch_t* batch)
+{
+    MidiEvent_t *event = next->event;
+    MidiEventType_t type = MidiEvent_GetType(event);
+
+    int cbResult = cbFunc(event, next->track, next->index, next->ticks, next->usec, options->UserData);
+
+    if (cbResult == Player_Callback_Abort || cbResult == Player_Callback_IgnoreEvent) // tempo is always applied by the timeline
+        return cbResult;
+
+    if (chasing && (type == Midi_Event_Type_NoteOn || type == Midi_Event_Type_NoteOff))
+        return cbResult;
+
+    MidiMessageBatch_Add(batch, device, event, options);
+
+    return cbResult;
+}
+
+// dispatches next and every event after it at the same tick, then sends them all as one batch
+// on return, *pending tells whether next holds the first event of a later tick (otherwise the timeline is over)
+static int MidiPlayer_DispatchTick(MidiTimeline_t* timeline, MidiTimelineEvent_t* next, uint8_t* pending, playerCallback64 cbFunc, const MidiPlayOptions_t* options, MidiDevice_t* device, uint64_t deadlineNs, MidiRing_t* observers, atomic_uint* dropped)
+{
+    MidiMessageBatch_t batch = {.length = 0, .timed = (options->Monitor != NULL), .deviceNs = 0};
+    const uint64_t ticks = next->ticks;
+    const uint64_t wokeNs = MidiClock_NowNs();
+    const int64_t latenessUs = ((int64_t)(wokeNs - deadlineNs)) / 1000;
+    int result = Player_Callback_PlayEvent;
+    uint32_t events = 0;
+
+    do
+    {
+        events++;
+
+        if (options->Stats)
+            MidiPlaybackStats_Record(options->Stats, latenessUs);
+
+        if (MidiPlayer_Dispatch(next, 0, cbFunc, options, device, &batch) == Player_Callback_Abort)
+        {
+            result = Player_Callback_Abort;
+            *pending = 0;
+            break;
+        }
+
+        if (observers && MidiRing_Push(observers, next) != 0)
+            atomic_fetch_add(dropped, 1); // never wait for the observer
+
+        *pending = MidiTimeline_Next(timeline, next);
+    }
+    while (*pending && next->ticks == ticks);
+
+    MidiMessageBatch_Flush(&batch, device);
+
+    if (options->Monitor)
+    {
+        uint64_t busyNs = MidiClock_NowNs() - wokeNs;
+
+        MidiTimingMonitor_Record(options->Monitor, &(MidiTimingSample_t){
+            .Ticks = ticks,
+            .DeadlineNs = deadlineNs,
+            .WokeNs = wokeNs,
+            .Events = events,
+            .DispatchNs = (uint32_t)(busyNs - batch.deviceNs),
+            .DeviceNs = (uint32_t)batch.deviceNs,
+        });
+    }
+
+    return result;
+}
+
+// stops the notes of this player only, so players sharing a device do not cut each other off
+static void MidiPlayer_Silence(const MidiPlayOptions_t* options, MidiDevice_t* device)
+{
+    if (device == NULL)
+        return;
+
+    if (options->ChannelMap == NULL)
+    {
+        MidiDevice_ResetEx(device);
+        return;
+    }
+
+    for (uint8_t ch = 0; ch < 16; ch++)
+        MidiDevice_SilenceChannel(device, MidiPlayer_MapChannel(options, ch));
+}
+
+void MidiFile_PlayEx(const MidiFile_t* midi, const MidiPlayOptions_t* options)
+{
+    // sanity check
+    if (midi == NULL || options == NULL)
+        return;
+
+    playerCallback64 cbFunc = (options->Callback) ? options->Callback : trivial_callback;
+    MidiDevice_t* device = (options->DryRun) ? NULL : (options->Device) ? options->Device : MidiDevice_GetDefault();
+    MidiPlaybackStats_t* stats = options->Stats;
+
+    if (stats)
+        *stats = (MidiPlaybackStats_t){0};
+
+    MidiTimeline_t* timeline = MidiTimeline_Create(midi);
+    if (timeline == NULL)
+        return;
+
+    MidiThreadPriority_t priority = {0};
+    if (options->Realtime)
+        MidiThread_RaisePriority(&priority);
+
+    // jump straight to the start time, then restore the state of the channels at that point
+    const MidiTimelineEvent_t* chase = NULL;
+    uint32_t numChase = 0;
+
+    if (options->StartUs > 0)
+    {
+        if (MidiTimeline_Seek(timeline, options->StartUs, &chase, &numChase) != 0)
+            goto finish;
+    }
+
+    // every deadline is relative to this single anchor, never to the previous event
+    const uint64_t startNs = options->StartUs * 1000;
+    const uint64_t anchorNs = MidiClock_NowNs();
+
+    MidiMessageBatch_t batch = {.length = 0};
+
+    for (uint32_t i = 0; i < numChase; i++)
+        if (MidiPlayer_Dispatch(&chase[i], 1, cbFunc, options, device, &batch) == Player_Callback_Abort)
+            goto finish;
+
+    MidiMessageBatch_Flush(&batch, device);
+
+    MidiTimelineEvent_t next;
+    uint8_t pending = MidiTimeline_Next(timeline, &next);
+
+    while (pending)
+    {
+        uint64_t deadlineNs = anchorNs + ((next.nsec > startNs) ? (next.nsec - startNs) : 0);
+
+        if (!options->DryRun)
+            MidiClock_SleepUntil(deadlineNs, options->SpinUs); // wait for the event
+
+        if (MidiPlayer_DispatchTick(timeline, &next, &pending, cbFunc, options, device, deadlineNs, NULL, NULL) == Player_Callback_Abort)
+            break;
+    }
+
+    finish:
+    MidiThread_RestorePriority(&priority);
+    MidiTimeline_Destroy(timeline);
+}
+
+void MidiFile_Play(const MidiFile_t* midi, uint32_t start_usec, playerCallback cbFunc)
+{
+    MidiLegacyCallback_t legacy = {.func = cbFunc};
+
+    MidiPlayOptions_t options = {
+        .StartUs = start_usec,
+        .Callback = (cbFunc) ? legacy_callback : NULL,
+        .UserData = &legacy,
+        .Stats = NULL,
+        .SpinUs = MIDI_PLAY_DEFAULT_SPIN_US,
+        .Realtime = 0,
+    };
+
+    MidiFile_PlayEx(midi, &options);
+}
+
+// ASYNC PLAYER
+// ===================================================================
+// the playback thread owns the timeline and the device; the controlling thread only talks to it through two rings
+#define MIDI_PLAYER_COMMAND_RING 64
+#define MIDI_PLAYER_EVENT_RING 4096
+#define MIDI_PLAYER_POLL_NS 2000000 // commands are picked up at least this often while waiting
+
+typedef enum MidiPlayerCommandType {
+    Midi_Player_Command_Pause,
+    Midi_Player_Command_Resume,
+    Midi_Player_Command_Seek,
+    Midi_Player_Command_TempoScale,
+    Midi_Player_Command_Stop,
+} MidiPlayerCommandType_t;
+
+typedef struct MidiPlayerCommand {
+    MidiPlayerCommandType_t type;
+    union {
+        uint64_t usec; // seek
+        double scale; // tempo scale
+    };
+} MidiPlayerCommand_t;
+
+struct MidiPlayer {
+    MidiPlayOptions_t options;
+    MidiDevice_t* device;
+    uint8_t channelMap[16]; // private copy, options.ChannelMap points here when set
+    MidiTimeline_t* timeline;
+    MidiThread_t thread;
+    MidiRing_t commands; // controlling thread -> playback thread
+    MidiRing_t events; // playback thread -> observer
+    atomic_uint droppedEvents; // events the observer was too slow to take
+    atomic_int state; // MidiPlayerState_t
+    uint8_t started;
+};
+
+// restores the channels at the new position; the caller resets the clock
+static int MidiPlayer_SeekTo(MidiPlayer_t* player, uint64_t usec, playerCallback64 cbFunc)
+{
+    const MidiTimelineEvent_t* chase = NULL;
+    uint32_t numChase = 0;
+
+    if (MidiTimeline_Seek(player->timeline, usec, &chase, &numChase) != 0)
+        return -1;
+
+    MidiPlayer_Silence(&player->options, player->device); // silence whatever was sounding at the old position
+
+    MidiMessageBatch_t batch = {.length = 0};
+
+    for (uint32_t i = 0; i < numChase; i++)
+        if (MidiPlayer_Dispatch(&chase[i], 1, cbFunc, &player->options, player->device, &batch) == Player_Callback_Abort)
+            return -1;
+
+    MidiMessageBatch_Flush(&batch, player->device);
+
+    return 0;
+}
+
+static void MidiPlayer_Thread(void* arg)
+{
+    MidiPlayer_t* player = (MidiPlayer_t*)arg;
+    const MidiPlayOptions_t* options = &player->options;
+
+    playerCallback64 cbFunc = (options->Callback) ? options->Callback : trivial_callback;
+    MidiPlaybackStats_t* stats = options->Stats;
+
+    if (stats)
+        *stats = (MidiPlaybackStats_t){0};
+
+    MidiThreadPriority_t priority = {0};
+    if (options->Realtime)
+        MidiThread_RaisePriority(&priority);
+
+    // the song is at songNs at the instant anchorNs, and advances scale times faster than the clock from there
+    uint64_t songNs = 0, anchorNs;
+    double scale = 1.0;
+    uint8_t paused = 0, finished = 0, pending = 0, running = 1;
+    MidiTimelineEvent_t next;
+
+    if (options->StartUs > 0)
+    {
+        running = (MidiPlayer_SeekTo(player, options->StartUs, cbFunc) == 0);
+        songNs = options->StartUs * 1000;
+    }
+
+    anchorNs = MidiClock_NowNs();
+    atomic_store(&player->state, Midi_Player_State_Playing);
+
+    while (running)
+    {
+        MidiPlayerCommand_t command;
+        while (running && MidiRing_Pop(&player->commands, &command))
+        {
+            uint64_t now = MidiClock_NowNs();
+            uint64_t position = (paused || finished) ? songNs : songNs + (uint64_t)((now - anchorNs) * scale);
+
+            switch (command.type)
+            {
+                case Midi_Player_Command_Pause:
+                    if (!paused)
+                        MidiPlayer_Silence(options, player->device);
+                    songNs = position;
+                    paused = 1;
+                    break;
+
+                case Midi_Player_Command_Resume:
+                    songNs = position; // a no-op when already playing, instead of rewinding to the last anchor
+                    anchorNs = now;
+                    paused = 0;
+                    break;
+
+                case Midi_Player_Command_TempoScale:
+                    songNs = position;
+                    anchorNs = now;
+                    scale = command.scale;
+                    break;
+
+                case Midi_Player_Command_Seek:
+                    if (MidiPlayer_SeekTo(player, command.usec, cbFunc) != 0)
+                        running = 0;
+
+                    songNs = command.usec * 1000;
+                    anchorNs = MidiClock_NowNs(); // chasing may have taken a while
+                    pending = 0;
+                    finished = 0;
+                    break;
+
+                case Midi_Player_Command_Stop:
+                    running = 0;
+                    break;
+            }
+
+            atomic_store(&player->state, (paused) ? Midi_Player_State_Paused : (finished) ? Midi_Player_State_Finished : Midi_Player_State_Playing);
+        }
+
+        if (!running)
+            break;
+
+        if (!pending && !paused && !finished)
+        {
+            if (MidiTimeline_Next(player->timeline, &next))
+                pending = 1;
+            else
+            {
+                finished = 1; // stay around: a seek can still bring us back
+                atomic_store(&player->state, Midi_Player_State_Finished);
+            }
+        }
+
+        uint64_t now = MidiClock_NowNs();
+
+        if (paused || finished)
+        {
+            MidiClock_SleepUntil(now + MIDI_PLAYER_POLL_NS, 0); // wait for commands
+            continue;
+        }
+
+        uint64_t deadlineNs = anchorNs + ((next.nsec > songNs) ? (uint64_t)((next.nsec - songNs) / scale) : 0);
+
+        if (now < deadlineNs)
+        {
+            if (deadlineNs - now > MIDI_PLAYER_POLL_NS)
+            {
+                MidiClock_SleepUntil(now + MIDI_PLAYER_POLL_NS, 0); // wake up to check for commands
+                continue;
+            }
+
+            MidiClock_SleepUntil(deadlineNs, options->SpinUs); // wait for the event
+        }
+
+        if (MidiPlayer_DispatchTick(player->timeline, &next, &pending, cbFunc, options, player->device, deadlineNs, &player->events, &player->droppedEvents) == Player_Callback_Abort)
+            break;
+    }
+
+    MidiPlayer_Silence(options, player->device);
+    MidiThread_RestorePriority(&priority);
+    atomic_store(&player->state, Midi_Player_State_Stopped);
+}
+
+MidiPlayer_t* MidiPlayer_Create(const MidiFile_t* midi, const MidiPlayOptions_t* options)
+{
+    // sanity check
+    if (midi == NULL)
+        return NULL;
+
+    MidiPlayer_t* player = (MidiPlayer_t*)calloc(1, sizeof(MidiPlayer_t));
+    if (player == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating player");
+        return NULL;
+    }
+
+    if (options)
+        player->options = *options;
+
+    if (player->options.ChannelMap)
+    {
+        memcpy(player->channelMap, player->options.ChannelMap, sizeof(player->channelMap));
+        player->options.ChannelMap = player->channelMap;
+    }
+
+    player->device = (player->options.Device) ? player->options.Device : MidiDevice_GetDefault();
+
+    atomic_init(&player->droppedEvents, 0);
+    atomic_init(&player->state, Midi_Player_State_Idle);
+
+    if ((player->timeline = MidiTimeline_Create(midi)) == NULL)
+        goto fail;
+
+    if (MidiRing_Init(&player->commands, sizeof(MidiPlayerCommand_t), MIDI_PLAYER_COMMAND_RING) != 0)
+        goto fail;
+
+    if (MidiRing_Init(&player->events, sizeof(MidiTimelineEvent_t), MIDI_PLAYER_EVENT_RING) != 0)
+        goto fail;
+
+    return player;
+
+    fail:
+    MidiPlayer_Destroy(player);
+    return NULL;
+}
+
+int MidiPlayer_Start(MidiPlayer_t* player)
+{
+    if (player == NULL || player->started)
+        return -1;
+
+    if (MidiThread_Start(&player->thread, MidiPlayer_Thread, player) != 0)
+        return -1;
+
+    player->started = 1;
+    return 0;
+}
+
+static int MidiPlayer_Post(MidiPlayer_t* player, MidiPlayerCommand_t command)
+{
+    if (player == NULL)
+        return -1;
+
+    if (MidiRing_Push(&player->commands, &command) != 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nPlayer command queue is full");
+        return -1;
+    }
+
+    return 0;
+}
+
+int MidiPlayer_Pause(MidiPlayer_t* player)
+{
+    return MidiPlayer_Post(player, (MidiPlayerCommand_t){.type = Midi_Player_Command_Pause});
+}
+
+int MidiPlayer_Resume(MidiPlayer_t* player)
+{
+    return MidiPlayer_Post(player, (MidiPlayerCommand_t){.type = Midi_Player_Command_Resume});
+}
+
+int MidiPlayer_Seek(MidiPlayer_t* player, uint64_t usec)
+{
+    return MidiPlayer_Post(player, (MidiPlayerCommand_t){.type = Midi_Player_Command_Seek, .usec = usec});
+}
+
+int MidiPlayer_SetTempoScale(MidiPlayer_t* player, double scale)
+{
+    if (!(scale > 0))
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nTempo scale must be positive");
+        return -1;
+    }
+
+    return MidiPlayer_Post(player, (MidiPlayerCommand_t){.type = Midi_Player_Command_TempoScale, .scale = scale});
+}
+
+int MidiPlayer_Stop(MidiPlayer_t* player)
+{
+    return MidiPlayer_Post(player, (MidiPlayerCommand_t){.type = Midi_Player_Command_Stop});
+}
+
+int MidiPlayer_PollEvent(MidiPlayer_t* player, MidiTimelineEvent_t* event)
+{
+    return MidiRing_Pop(&player->events, event);
+}
+
+uint32_t MidiPlayer_GetDroppedEvents(const MidiPlayer_t* player)
+{
+    return atomic_load(&((MidiPlayer_t*)player)->droppedEvents);
+}
+
+MidiPlayerState_t MidiPlayer_GetState(const MidiPlayer_t* player)
+{
+    return (MidiPlayerState_t)atomic_load(&((MidiPlayer_t*)player)->state);
+}
+
+void MidiPlayer_Destroy(MidiPlayer_t* player)
+{
+    if (player == NULL)
+        return;
+
+    if (player->started)
+    {
+        // the queue may be momentarily full, keep trying until the thread takes the stop
+        while (MidiRing_Push(&player->commands, &(MidiPlayerCommand_t){.type = Midi_Player_Command_Stop}) != 0)
+            MidiClock_SleepUntil(MidiClock_NowNs() + MIDI_PLAYER_POLL_NS, 0);
+
+        MidiThread_Join(&player->thread);
+    }
+
+    MidiRing_Free(&player->commands);
+    MidiRing_Free(&player->events);
+    MidiTimeline_Destroy(player->timeline);
+    free(player);
+}
+
+// MIDI INPUT
+// ===================================================================
+// the driver side (the WinMM callback, or the thread reading the ALSA sequencer) only timestamps each message and pushes it into a ring
+// it never allocates nor locks: the messages become events later, on the thread that drains them into a track
+#define MIDI_INPUT_DEFAULT_CAPACITY 4096
+#define MIDI_INPUT_POLL_MS 50 // the ALSA reader checks for a stop at least this often
+#define MIDI_INPUT_DECODE_LEN 64
+
+#if defined(__linux__)
+// apt-get install libasound2-dev
+// must include "-lasound" in linker options
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#endif
+
+struct MidiInput {
+    MidiRing_t ring;
+    atomic_uint dropped;
+    uint8_t started;
+
+    #if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+    HMIDIIN handle;
+    #elif defined(__linux__)
+    snd_seq_t* seq;
+    snd_midi_event_t* parser;
+    int port;
+    uint8_t realtime;
+    atomic_int running;
+    MidiThread_t thread;
+    #endif
+};
+
+// system messages (SysEx, clock, active sensing ...) are not recorded
+static void MidiInput_Push(MidiInput_t* input, const uint8_t* msg, uint32_t length, uint64_t timeNs)
+{
+    if (length == 0 || length > 3 || msg[0] >= 0xF0)
+        return;
+
+    MidiInputMessage_t message = {.TimeNs = timeNs, .Length = (uint8_t)length};
+    memcpy(message.Data, msg, length);
+
+    if (MidiRing_Push(&input->ring, &message) != 0)
+        atomic_fetch_add_explicit(&input->dropped, 1, memory_order_relaxed); // never wait for the reader
+}
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+
+// runs on the driver thread
+static void CALLBACK MidiInput_Callback(HMIDIIN handle, UINT msg, DWORD_PTR instance, DWORD_PTR param1, DWORD_PTR param2)
+{
+    if (msg != MIM_DATA && msg != MIM_MOREDATA)
+        return;
+
+    // the timestamp of the driver (param2) only has millisecond resolution
+    uint64_t now = MidiClock_NowNs();
+    uint8_t data[3] = {param1 & 0xFF, (param1 >> 8) & 0xFF, (param1 >> 16) & 0xFF};
+
+    MidiInput_Push((MidiInput_t*)instance, data, MidiMessage_Length(data, 3), now);
+}
+
+static int MidiInput_OpenDriver(MidiInput_t* input, const MidiInputOptions_t* options)
+{
+    UINT devid = (options->Device >= 0) ? (UINT)options->Device : 0;
+
+    if (midiInOpen(&input->handle, devid, (DWORD_PTR)MidiInput_Callback, (DWORD_PTR)input, CALLBACK_FUNCTION) != MMSYSERR_NOERROR)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError opening MIDI input device %u", devid);
+        return -1;
+    }
+
+    MIDIINCAPS mic;
+    if (!midiInGetDevCaps(devid, &mic, sizeof(MIDIINCAPS)))
+        Midi_Log(MIDI_LOG_INFO, "\nOPENED MIDI INPUT: %s", mic.szPname);
+
+    return 0;
+}
+
+static int MidiInput_StartDriver(MidiInput_t* input)
+{
+    return (midiInStart(input->handle) == MMSYSERR_NOERROR) ? 0 : -1;
+}
+
+static void MidiInput_StopDriver(MidiInput_t* input)
+{
+    midiInStop(input->handle);
+    midiInReset(input->handle);
+}
+
+static void MidiInput_CloseDriver(MidiInput_t* input)
+{
+    midiInClose(input->handle);
+}
+
+#elif defined(__linux__)
+
+static void MidiInput_Thread(void* arg)
+{
+    MidiInput_t* input = (MidiInput_t*)arg;
+
+    MidiThreadPriority_t priority = {0};
+    if (input->realtime)
+        MidiThread_RaisePriority(&priority);
+
+    struct pollfd fds[8];
+    int numFds = snd_seq_poll_descriptors(input->seq, fds, sizeof(fds) / sizeof(fds[0]), POLLIN);
+
+    while (atomic_load_explicit(&input->running, memory_order_acquire))
+    {
+        if (poll(fds, numFds, MIDI_INPUT_POLL_MS) <= 0)
+            continue;
+
+        snd_seq_event_t* ev;
+        int result;
+
+        // the sequencer was opened non-blocking: read until it has nothing more
+        while ((result = snd_seq_event_input(input->seq, &ev)) != -EAGAIN)
+        {
+            if (result == -ENOSPC) // the kernel queue overflowed, and its events are lost
+            {
+                atomic_fetch_add_explicit(&input->dropped, 1, memory_order_relaxed);
+                continue;
+            }
+
+            if (result < 0)
+                break;
+
+            uint64_t now = MidiClock_NowNs();
+            uint8_t msg[MIDI_INPUT_DECODE_LEN];
+            long length = snd_midi_event_decode(input->parser, msg, sizeof(msg), ev);
+
+            if (length > 0)
+                MidiInput_Push(input, msg, (uint32_t)length, now);
+        }
+    }
+
+    MidiThread_RestorePriority(&priority);
+}
+
+static int MidiInput_OpenDriver(MidiInput_t* input, const MidiInputOptions_t* options)
+{
+    if (snd_seq_open(&input->seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError opening the ALSA sequencer");
+        return -1;
+    }
+
+    snd_seq_set_client_name(input->seq, "ezMidi");
+
+    // other clients can connect to this port, e.g. with aconnect
+    input->port = snd_seq_create_simple_port(input->seq, "ezMidi input",
+                                             SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                             SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (input->port < 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError creating the ALSA sequencer port");
+        goto error;
+    }
+
+    if (options->Device >= 0 && snd_seq_connect_from(input->seq, input->port, options->Device, options->Port) < 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError connecting from ALSA client %d:%d", options->Device, options->Port);
+        goto error;
+    }
+
+    if (snd_midi_event_new(MIDI_INPUT_DECODE_LEN, &input->parser) < 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError creating the ALSA event decoder");
+        goto error;
+    }
+
+    snd_midi_event_no_status(input->parser, 1); // every message with its own status byte
+
+    input->realtime = options->Realtime;
+    atomic_init(&input->running, 0);
+
+    return 0;
+
+    error:
+    snd_seq_close(input->seq);
+    return -1;
+}
+
+static int MidiInput_StartDriver(MidiInput_t* input)
+{
+    atomic_store_explicit(&input->running, 1, memory_order_release);
+
+    if (MidiThread_Start(&input->thread, MidiInput_Thread, input) != 0)
+    {
+        atomic_store_explicit(&input->running, 0, memory_order_release);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void MidiInput_StopDriver(MidiInput_t* input)
+{
+    atomic_store_explicit(&input->running, 0, memory_order_release);
+    MidiThread_Join(&input->thread);
+}
+
+static void MidiInput_CloseDriver(MidiInput_t* input)
+{
+    snd_midi_event_free(input->parser);
+    snd_seq_close(input->seq);
+}
+
+#else
+
+static int MidiInput_OpenDriver(MidiInput_t* input, const MidiInputOptions_t* options)
+{
+    Midi_Log(MIDI_LOG_ERRORS, "\nMIDI input requires WinMM (windows) or the ALSA sequencer (linux)");
+    return -1;
+}
+
+static int MidiInput_StartDriver(MidiInput_t* input) { return -1; }
+static void MidiInput_StopDriver(MidiInput_t* input) { }
+static void MidiInput_CloseDriver(MidiInput_t* input) { }
+
+#endif
+
+MidiInput_t* MidiInput_Open(const MidiInputOptions_t* options)
+{
+    MidiInputOptions_t defaults = {.Device = -1, .Port = 0, .Capacity = 0, .Realtime = 0};
+    if (options == NULL)
+        options = &defaults;
+
+    MidiInput_t* input = (MidiInput_t*)calloc(1, sizeof(MidiInput_t));
+    if (input == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating MIDI input");
+        return NULL;
+    }
+
+    atomic_init(&input->dropped, 0);
+
+    if (MidiRing_Init(&input->ring, sizeof(MidiInputMessage_t), (options->Capacity) ? options->Capacity : MIDI_INPUT_DEFAULT_CAPACITY) != 0)
+    {
+        free(input);
+        return NULL;
+    }
+
+    if (MidiInput_OpenDriver(input, options) != 0)
+    {
+        MidiRing_Free(&input->ring);
+        free(input);
+        return NULL;
+    }
+
+    return input;
+}
+
+int MidiInput_Start(MidiInput_t* input)
+{
+    if (input == NULL || input->started)
+        return -1;
+
+    if (MidiInput_StartDriver(input) != 0)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError starting MIDI input");
+        return -1;
+    }
+
+    input->started = 1;
+    return 0;
+}
+
+int MidiInput_Stop(MidiInput_t* input)
+{
+    if (input == NULL || !input->started)
+        return -1;
+
+    MidiInput_StopDriver(input);
+    input->started = 0;
+
+    return 0;
+}
+
+int MidiInput_Poll(MidiInput_t* input, MidiInputMessage_t* message)
+{
+    return MidiRing_Pop(&input->ring, message);
+}
+
+uint32_t MidiInput_GetDroppedMessages(const MidiInput_t* input)
+{
+    return atomic_load(&((MidiInput_t*)input)->dropped);
+}
+
+void MidiInput_Close(MidiInput_t* input)
+{
+    if (input == NULL)
+        return;
+
+    MidiInput_Stop(input);
+    MidiInput_CloseDriver(input);
+    MidiRing_Free(&input->ring);
+    free(input);
+}
+
+// RECORDER
+// turns the messages of an input into events at the end of a track, converting their arrival times to delta ticks
+#define MIDI_RECORDER_MIN_CAPACITY 256
+#define MIDI_RECORDER_MAX_DELTA 0x0FFFFFFF // largest variable-length quantity
+
+struct MidiRecorder {
+    MidiFile_t* midi;
+    uint16_t track;
+    uint32_t capacity; // of the events array of the track
+    uint32_t usPerQuarter;
+    uint64_t startNs; // arrival time of tick 0, 0 until the first message when not given
+    uint64_t lastTicks; // of the last event in the track
+    uint64_t endTicks; // of the End of Track the track had, so its trailing silence is kept
+};
+
+static int MidiRecorder_Reserve(MidiRecorder_t* recorder, MidiTrack_t* track)
+{
+    if (track->NumEvents < recorder->capacity)
+        return 0;
+
+    uint32_t capacity = (recorder->capacity < MIDI_RECORDER_MIN_CAPACITY) ? MIDI_RECORDER_MIN_CAPACITY : 2*recorder->capacity;
+
+    MidiEvent_t* events = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * capacity);
+    if (events == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %u recorded events", capacity);
+        return -1;
+    }
+
+    track->Events = events;
+    recorder->capacity = capacity;
+
+    return 0;
+}
+
+MidiRecorder_t* MidiRecorder_Create(MidiFile_t* midi, uint16_t track, uint32_t usPerQuarter, uint64_t startNs)
+{
+    if (midi == NULL || track >= midi->nTrks || midi->PulsesPerQuarterNote == 0 || (midi->PulsesPerQuarterNote & 0x8000))
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nCannot record into track %u: the file needs the track and a pulses-per-quarter-note timebase", track);
+        return NULL;
+    }
+
+    MidiRecorder_t* recorder = (MidiRecorder_t*)malloc(sizeof(MidiRecorder_t));
+    if (recorder == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating recorder");
+        return NULL;
+    }
+
+    MidiTrack_t* t = &midi->Tracks[track];
+    uint64_t endTicks = (t->NumEvents > 0) ? MidiTrack_GetTicks(t, t->NumEvents - 1) : 0;
+
+    // the recording goes into the existing events, so the end of track is written again by MidiRecorder_Finish
+    if (MidiTrack_HasEnd(t))
+    {
+        t->NumEvents--;
+
+        if (!midi->Arena)
+            free(t->Events[t->NumEvents].data);
+
+        MidiFile_InvalidateTrack(midi, track);
+    }
+
+    *recorder = (MidiRecorder_t){
+        .midi = midi,
+        .track = track,
+        .capacity = t->NumEvents,
+        .usPerQuarter = (usPerQuarter) ? usPerQuarter : 500000, // the SMF default of 120 bpm
+        .startNs = startNs,
+        .lastTicks = (t->NumEvents > 0) ? MidiTrack_GetTicks(t, t->NumEvents - 1) : 0,
+        .endTicks = endTicks,
+    };
+
+    return recorder;
+}
+
+int MidiRecorder_Drain(MidiRecorder_t* recorder, MidiInput_t* input)
+{
+    if (recorder == NULL || input == NULL)
+        return -1;
+
+    MidiFile_t* midi = recorder->midi;
+    MidiTrack_t* track = &midi->Tracks[recorder->track];
+    const uint64_t nsPerQuarter = (uint64_t)recorder->usPerQuarter * 1000;
+    MidiInputMessage_t message;
+    int count = 0;
+
+    while (MidiInput_Poll(input, &message))
+    {
+        const MidiEventInterface_t* interface = MidiEvent_GetInterface(message.Data[0], 0);
+        if (interface == NULL)
+            continue;
+
+        if (recorder->startNs == 0)
+            recorder->startNs = message.TimeNs;
 
-        {
-            int variablelen = ReadVariableLength(&buffer[read], length - read, &deltaTime); // returns number of bytes read or error code
-            if (variablelen <= 0)
-            {
-                fprintf(stderr, "\nError reading delta-time!");
-                return;
-            }
-            else
-                read += variablelen;
-        }
+        uint64_t elapsedNs = (message.TimeNs > recorder->startNs) ? message.TimeNs - recorder->startNs : 0;
+        uint64_t ticks = elapsedNs * midi->PulsesPerQuarterNote / nsPerQuarter;
 
-        // read the status byte ("type" of the event)
-        uint8_t meta = 0;
-        uint8_t statusByte = buffer[read++];
+        MidiEvent_t event;
 
-        if (statusByte == 0xFF) // this is a META event
+        if (MidiEvent_Init(&event, interface, 0, 1, midi->Arena) != 0)
         {
-            statusByte = buffer[read++]; // read the actual type
-            meta = 1;
+            count = -1;
+            break;
         }
-        else
+
+        if (MidiEvent_ReadData(interface, (const char*)&message.Data[1], message.Length - 1, message.Data[0], event.data) < 0)
         {
-            // not a meta event
-            if (statusByte < 0x80) // running status is in effect
-            {
-                statusByte = running_status;
-                read--; // we actually read the first data byte ... let's go back
-            }
-            else
-                running_status = statusByte;
+            if (!midi->Arena)
+                free(event.data);
+
+            continue; // incomplete message
         }
 
-        // expand the list so it fits one more event
+        if (ticks < recorder->lastTicks)
         {
-            MidiEvent_t *new_list = (MidiEvent_t*)realloc(track->Events, sizeof(MidiEvent_t) * (track->NumEvents + 1));
-            if (new_list == NULL)
+            // played over the events the track already had: merged in time order
+            if (MidiTrack_Place(track, event, ticks) < 0)
             {
-                fprintf(stderr, "\nError reallocating list of events for track");
+                if (!midi->Arena)
+                    free(event.data);
+
+                count = -1;
                 break;
             }
-            else
-            {
-                track->Events = new_list;
-                track->NumEvents++;
-            }
-        }
 
-        MidiEvent_t* new_event = &track->Events[track->NumEvents - 1];
+            recorder->capacity = track->NumEvents; // the array was resized to fit
+            count++;
+            continue;
+        }
 
-        if (MidiEvent_Create(new_event, ((meta) ? statusByte : (statusByte & 0xF0)), deltaTime, 1) != 0)
+        if (MidiRecorder_Reserve(recorder, track) != 0)
         {
-            fprintf(stderr, "\nAborted reading of track because event size is unknown!");
+            if (!midi->Arena)
+                free(event.data);
+
+            count = -1;
             break;
         }
 
-        read += new_event->interface->read_data(&buffer[read], statusByte, new_event->data); //MidiEvent_Read(new_event, &buffer[read]);
-        //MidiEvent_Print(stdout, new_event);
+        uint64_t delta = ticks - recorder->lastTicks;
+        if (delta > MIDI_RECORDER_MAX_DELTA) // a silence of days: shorten it rather than write an invalid file
+            delta = MIDI_RECORDER_MAX_DELTA;
+
+        event.deltaTime = (uint32_t)delta;
+        track->Events[track->NumEvents++] = event;
+        recorder->lastTicks += delta;
+        count++;
     }
-    while (read < length);
+
+    if (count != 0)
+        MidiFile_InvalidateTrack(midi, recorder->track);
+
+    return count;
 }
 
-// MIDI FILES
+int MidiRecorder_Finish(MidiRecorder_t* recorder)
+{
+    if (recorder == NULL)
+        return -1;
+
+    MidiFile_t* midi = recorder->midi;
+    MidiTrack_t* track = &midi->Tracks[recorder->track];
+    int result = -1;
+
+    // no earlier than the End of Track the track had before the recording
+    uint64_t delta = (recorder->endTicks > recorder->lastTicks) ? recorder->endTicks - recorder->lastTicks : 0;
+    if (delta > MIDI_RECORDER_MAX_DELTA)
+        delta = MIDI_RECORDER_MAX_DELTA;
+
+    if (MidiRecorder_Reserve(recorder, track) == 0 && MidiEvent_Create(&track->Events[track->NumEvents], Midi_Event_Type_EndOfTrack, (uint32_t)delta, 1, midi->Arena) == 0)
+    {
+        track->NumEvents++;
+        MidiFile_InvalidateTrack(midi, recorder->track);
+        result = 0;
+    }
+
+    free(recorder);
+    return result;
+}
+
+// OFFLINE RENDER
 // ===================================================================
+#if defined(unix) || defined(__unix__) || defined(__unix)
 
-void MidiFile_Close(MidiFile_t *close)
-{
-    // sanity check
-    if (!close)
-        return;
+#define MIDI_RENDER_DEFAULT_SAMPLE_RATE 44100
+#define MIDI_RENDER_DEFAULT_BLOCK 512
+#define MIDI_RENDER_DEFAULT_OVERLAP_MS 2000
+#define MIDI_RENDER_SEGMENT_MS 10000 // length of the segments rendered in parallel: memory grows with Threads times this
+
+typedef int (*MidiRenderSink_t)(void* ctx, const int16_t* samples, uint32_t frames);
+
+typedef struct MidiRenderJob {
+    const MidiFile_t* midi;
+    const MidiRenderOptions_t* options;
+    uint64_t firstFrame; // note-ons from here (inclusive) ...
+    uint64_t lastFrame; // ... to here (exclusive) are played
+    uint64_t tailFrames; // keep rendering this long after lastFrame (or after the notes are released), only releasing notes
+    uint8_t followNotes; // the tail starts when the notes played by this job have all been released, not at lastFrame
+    uint64_t segmentFrames; // length of the segments the song is split into
+    uint64_t handFrame; // notes still held here are struck again by the job starting here, UINT64_MAX if there is none
+    uint64_t stopFrame; // never render past the end of the song and its TailMs
+    MidiRenderSink_t sink;
+    void* ctx;
+    int result;
+} MidiRenderJob_t;
 
-    // make sure there are tracks
-    if (close->Tracks && close->nTrks)
+// a synth with no audio driver: samples are only produced when pulled with fluid_synth_write_s16
+static MidiDevice_t* MidiRender_CreateSynth(const MidiRenderOptions_t* options)
+{
+    MidiDevice_t* device = (MidiDevice_t*)calloc(1, sizeof(MidiDevice_t));
+    if (device == NULL)
     {
-        for (int t = 0; t < close->nTrks; t++)
-        {
-            // make sure there are events
-            if (!close->Tracks[t].Events || !close->Tracks[t].NumEvents)
-                continue;
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating synthesizer");
+        return NULL;
+    }
 
-            for (int e = 0; e < close->Tracks[t].NumEvents; e++)
-                free(close->Tracks[t].Events[e].data); // free the data for each event
+    device->settings = new_fluid_settings();
+    fluid_settings_setnum(device->settings, "synth.sample-rate", options->SampleRate);
 
-            // free the list of events in each track
-            free(close->Tracks[t].Events);
-        }
+    device->synth = new_fluid_synth(device->settings);
 
-        // free the list of tracks
-        free(close->Tracks);
+    if (fluid_synth_sfload(device->synth, (options->SoundFont) ? options->SoundFont : SOUND_FONT_PATH, 1) == FLUID_FAILED)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError loading sound font");
+        delete_fluid_synth(device->synth);
+        delete_fluid_settings(device->settings);
+        free(device);
+        return NULL;
     }
 
-    // free the file
-    free(close);
+    return device;
 }
 
-MidiFile_t *MidiFile_Open(const char* filename)
+static void MidiRender_DestroySynth(MidiDevice_t* device)
 {
-    // sanity check
-    if (filename == NULL)
-        return NULL;
+    delete_fluid_synth(device->synth);
+    delete_fluid_settings(device->settings);
+    free(device);
+}
 
-    // open the file
-    FILE* fp;
-    if ((fp = fopen(filename, "rb+")) == NULL)
+static inline uint64_t MidiRender_UsToFrames(const MidiRenderOptions_t* options, uint64_t usec)
+{
+    return usec * options->SampleRate / 1000000;
+}
+
+// renders the synth up to the given frame (relative to the start of the job), one block at a time
+static int MidiRender_Advance(MidiRenderJob_t* job, MidiDevice_t* device, int16_t* block, uint64_t* frame, uint64_t target)
+{
+    while (*frame < target)
     {
-        fprintf(stderr, "\nFailed to open MIDI file %s: %d %s", filename, errno, strerror(errno));
-        return NULL;
+        uint32_t frames = (target - *frame > job->options->BlockFrames) ? job->options->BlockFrames : (uint32_t)(target - *frame);
+
+        fluid_synth_write_s16(device->synth, frames, block, 0, 2, block, 1, 2); // interleaved stereo
+
+        if (job->sink(job->ctx, block, frames) != 0)
+            return -1; // aborted
+
+        *frame += frames;
     }
 
-    // read to the midi file structure
-    MidiFile_t *mf;
-    if ((mf = (MidiFile_t*)malloc(sizeof(MidiFile_t))) == NULL)
+    return 0;
+}
+
+#define MIDI_RENDER_SUSTAIN 64 // the damper pedal controller
+#define MIDI_RENDER_ALL_SOUND_OFF 120
+#define MIDI_RENDER_ALL_NOTES_OFF 123
+
+// the notes that still sound, which the tail of a job has to wait for
+typedef struct MidiRenderNote {
+    uint8_t held; // 1 while the key is down, 2 while only the sustain pedal holds it
+    uint8_t velocity;
+    uint32_t segment; // the segment that struck the note, or took it over
+} MidiRenderNote_t;
+
+typedef struct MidiRenderNotes {
+    MidiRenderNote_t keys[16][128];
+    uint8_t pedal[16];
+    uint32_t count;
+} MidiRenderNotes_t;
+
+static void MidiRenderNotes_Strike(MidiRenderNotes_t* notes, uint8_t channel, uint8_t key, uint8_t velocity, uint32_t segment)
+{
+    notes->count += (notes->keys[channel][key].held == 0);
+    notes->keys[channel][key].held = 1;
+    notes->keys[channel][key].velocity = velocity;
+    notes->keys[channel][key].segment = segment;
+}
+
+static void MidiRenderNotes_Release(MidiRenderNotes_t* notes, uint8_t channel, uint8_t key)
+{
+    if (notes->keys[channel][key].held != 0)
     {
-        fprintf(stderr, "\nAllocation error!");
-        fclose(fp);
-        return NULL;
+        notes->keys[channel][key].held = 0;
+        notes->count--;
     }
+}
+
+// a key let go is still held by the pedal
+static void MidiRenderNotes_KeyUp(MidiRenderNotes_t* notes, uint8_t channel, uint8_t key)
+{
+    if (notes->keys[channel][key].held == 1 && notes->pedal[channel])
+        notes->keys[channel][key].held = 2;
     else
+        MidiRenderNotes_Release(notes, channel, key);
+}
+
+// follows the controllers that end notes
+static void MidiRenderNotes_Control(MidiRenderNotes_t* notes, const MidiEvent_t* event)
+{
+    if (event->interface->type != Midi_Event_Type_ControlChange)
+        return;
+
+    const MidiEventData_ControlChange_t* cc = (const MidiEventData_ControlChange_t*)event->data;
+    uint8_t channel = cc->channel & 0x0F;
+
+    if (cc->control == MIDI_RENDER_SUSTAIN)
+        notes->pedal[channel] = (cc->value >= 64);
+    else if (cc->control != MIDI_RENDER_ALL_SOUND_OFF && cc->control != MIDI_RENDER_ALL_NOTES_OFF)
+        return;
+
+    for (uint8_t key = 0; key < 128; key++)
+        if (cc->control == MIDI_RENDER_ALL_SOUND_OFF || (cc->control == MIDI_RENDER_SUSTAIN && !notes->pedal[channel] && notes->keys[channel][key].held == 2))
+            MidiRenderNotes_Release(notes, channel, key);
+        else if (cc->control == MIDI_RENDER_ALL_NOTES_OFF)
+            MidiRenderNotes_KeyUp(notes, channel, key);
+}
+
+// a job follows its notes for one more segment at most, then the job starting there strikes those still held again
+static void MidiRenderNotes_HandOver(MidiRenderNotes_t* notes, uint32_t segment)
+{
+    for (uint8_t channel = 0; channel < 16; channel++)
+        for (uint8_t key = 0; key < 128; key++)
+            if (notes->keys[channel][key].held != 0 && notes->keys[channel][key].segment + 2 == segment)
+                notes->keys[channel][key].segment = segment;
+}
+
+// plays the song up to the start of the job as a single synth would, to find the notes handed over to it
+static void MidiRender_ScanNotes(const MidiRenderJob_t* job, MidiTimeline_t* timeline, MidiRenderNotes_t* song)
+{
+    const uint32_t first = job->firstFrame / job->segmentFrames;
+    uint32_t boundary = 1;
+
+    MidiTimelineEvent_t next;
+    while (MidiTimeline_Next(timeline, &next))
     {
-        // make sure we start fresh on the file
-        (*mf) = (MidiFile_t){0, 0, 0, NULL};
+        uint64_t eventFrame = MidiRender_UsToFrames(job->options, next.usec);
+
+        if (eventFrame >= job->firstFrame)
+            break;
+
+        for (; boundary * job->segmentFrames <= eventFrame; boundary++)
+            MidiRenderNotes_HandOver(song, boundary);
+
+        if (next.event->interface->type == Midi_Event_Type_NoteOn || next.event->interface->type == Midi_Event_Type_NoteOff)
+        {
+            const MidiEventData_NoteEvent_t* note = (const MidiEventData_NoteEvent_t*)next.event->data;
+
+            if (next.event->interface->type == Midi_Event_Type_NoteOff || note->velocity == 0)
+                MidiRenderNotes_KeyUp(song, note->channel & 0x0F, note->key & 0x7F);
+            else
+                MidiRenderNotes_Strike(song, note->channel & 0x0F, note->key & 0x7F, note->velocity, eventFrame / job->segmentFrames);
+        }
+        else
+            MidiRenderNotes_Control(song, next.event);
     }
 
-    uint8_t trackNumber = 0;
+    for (; boundary <= first; boundary++)
+        MidiRenderNotes_HandOver(song, boundary);
+}
 
-    // Read chunks
-    while (feof(fp) == 0) // read until end of file
+// lets every note of the job go, where they are handed over to a later one
+static void MidiRender_ReleaseAll(MidiDevice_t* device, MidiRenderNotes_t* notes)
+{
+    for (uint8_t channel = 0; channel < 16; channel++)
     {
-        // read chunk type
-        #define MIDI_CHUNK_SIZE 4
-        char chunktype[MIDI_CHUNK_SIZE];
-        int readlen;
+        fluid_synth_cc(device->synth, channel, MIDI_RENDER_SUSTAIN, 0);
+        fluid_synth_all_notes_off(device->synth, channel);
+    }
 
-        if ( (readlen = fread(chunktype, sizeof(char),MIDI_CHUNK_SIZE, fp)) != MIDI_CHUNK_SIZE)
-        {
-            if (feof(fp)) // Could not read because end of file is reached
-                break; // exit read loop without error
+    memset(notes->keys, 0, sizeof(notes->keys));
+    notes->count = 0;
+}
 
-            fprintf(stderr, "\nError reading chunk: read %d of expected %d: %d %s", readlen, MIDI_CHUNK_SIZE, errno, strerror(errno));
-            goto error;
+static void MidiRender_RunJob(void* arg)
+{
+    MidiRenderJob_t* job = (MidiRenderJob_t*)arg;
+    const MidiRenderOptions_t* options = job->options;
+    const MidiPlayOptions_t noRemap = {0};
+
+    job->result = -1;
+
+    MidiDevice_t* device = MidiRender_CreateSynth(options);
+    if (device == NULL)
+        return;
+
+    MidiTimeline_t* timeline = MidiTimeline_Create(job->midi);
+    int16_t* block = (int16_t*)malloc(sizeof(int16_t) * 2 * options->BlockFrames);
+    MidiRenderNotes_t* notes = (MidiRenderNotes_t*)calloc(2, sizeof(MidiRenderNotes_t)); // the job's own, and the whole song's
+    MidiRenderNotes_t* song = &notes[1];
+
+    if (timeline == NULL || block == NULL || notes == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating renderer");
+        goto finish;
+    }
+
+    MidiMessageBatch_t batch = {.length = 0};
+
+    // restore the state of the channels where this job starts
+    if (job->firstFrame > 0)
+    {
+        const MidiTimelineEvent_t* chase = NULL;
+        uint32_t numChase = 0;
+
+        if (job->segmentFrames > 0)
+            MidiRender_ScanNotes(job, timeline, song);
+
+        if (MidiTimeline_Seek(timeline, job->firstFrame * 1000000 / options->SampleRate, &chase, &numChase) != 0)
+            goto finish;
+
+        for (uint32_t i = 0; i < numChase; i++)
+        {
+            MidiMessageBatch_Add(&batch, device, chase[i].event, &noRemap);
+            MidiRenderNotes_Control(notes, chase[i].event);
         }
 
-        // read chunk length
-        #define MIDI_CHUNK_LEN_BYTES 4
-        uint8_t __chunklength[MIDI_CHUNK_LEN_BYTES];
-        fread(__chunklength, sizeof(uint8_t), MIDI_CHUNK_LEN_BYTES, fp); // MThd|MTrk len-len-len-len <data>
-        uint32_t chunklength = u32fromarray(__chunklength);
+        MidiMessageBatch_Flush(&batch, device);
+
+        // strike the notes handed over to this job, those already let go come back under the pedal
+        for (uint8_t channel = 0; channel < 16; channel++)
+            for (uint8_t key = 0; key < 128; key++)
+                if (song->keys[channel][key].held != 0 && song->keys[channel][key].segment == job->firstFrame / job->segmentFrames)
+                {
+                    MidiRenderNotes_Strike(notes, channel, key, song->keys[channel][key].velocity, 0);
+                    fluid_synth_noteon(device->synth, channel, key, song->keys[channel][key].velocity);
+
+                    if (song->keys[channel][key].held == 2)
+                    {
+                        MidiRenderNotes_KeyUp(notes, channel, key);
+                        fluid_synth_noteoff(device->synth, channel, key);
+                    }
+                }
+    }
+
+    uint64_t endFrame = (job->followNotes) ? UINT64_MAX : job->lastFrame + job->tailFrames;
+    uint64_t releaseFrame = job->lastFrame; // when the last note of this job was released, once past lastFrame
+    uint64_t frame = 0; // relative to firstFrame
 
-        // treat chunk type accordingly
-        #define MIDI_CHUNK_HEADER "MThd"
-        #define MIDI_CHUNK_TRACK "MTrk"
+    MidiTimelineEvent_t next;
+    while (MidiTimeline_Next(timeline, &next))
+    {
+        uint64_t eventFrame = MidiRender_UsToFrames(options, next.usec);
 
-        if (memcmp(&chunktype, &MIDI_CHUNK_HEADER, sizeof(chunktype)) == 0) // MThd (header chunk)
+        if (endFrame == UINT64_MAX && notes->count > 0 && eventFrame >= job->handFrame)
         {
-            #define MIDI_CHUNK_HEADER_LEN 6
-            if (chunklength != MIDI_CHUNK_HEADER_LEN) // header is comprised of 3 words of 16-bits
-            {
-                fprintf(stderr, "\nError reading header: expected size is 6 but got %u", chunklength);
-                goto error;
-            }
+            // the job starting there strikes the notes still held again, here they only release
+            MidiMessageBatch_Flush(&batch, device);
 
+            if (MidiRender_Advance(job, device, block, &frame, job->handFrame - job->firstFrame) != 0)
+                goto finish;
 
-            uint8_t header[MIDI_CHUNK_HEADER_LEN];
+            MidiRender_ReleaseAll(device, notes);
+            releaseFrame = job->handFrame;
+        }
 
-            if (fread(header, 1, MIDI_CHUNK_HEADER_LEN, fp) != MIDI_CHUNK_HEADER_LEN)
-            {
-                fprintf(stderr, "\nError reading header");
-                goto error;
-            }
+        if (endFrame == UINT64_MAX && eventFrame >= job->lastFrame && notes->count == 0)
+            endFrame = (releaseFrame + job->tailFrames < job->stopFrame) ? releaseFrame + job->tailFrames : job->stopFrame;
 
-            mf->Format = u16fromarray(&header[0]);
-            mf->nTrks = u16fromarray(&header[2]);
-            mf->PulsesPerQuarterNote = u16fromarray(&header[4]);
+        if (eventFrame >= endFrame)
+            break;
 
-            if ((mf->Format == MIDI_FORMAT_SINGLE_TRACK) && (mf->nTrks != 1))
-            {
-                fprintf(stderr, "\nFile format is 'Single track' but number of tracks is %u ", mf->nTrks);
-                goto error;
-            }
+        const MidiEvent_t* event = next.event;
+        MidiEventData_NoteEvent_t off;
+        MidiEvent_t release;
+        uint32_t sounding = notes->count;
 
-            mf->Tracks = (MidiTrack_t*)calloc(mf->nTrks, sizeof(MidiTrack_t));
-            if (!mf->Tracks)
+        if (event->interface->type == Midi_Event_Type_NoteOn || event->interface->type == Midi_Event_Type_NoteOff)
+        {
+            const MidiEventData_NoteEvent_t* note = (const MidiEventData_NoteEvent_t*)event->data;
+            uint8_t channel = note->channel & 0x0F;
+            uint8_t key = note->key & 0x7F;
+            uint8_t isOff = (event->interface->type == Midi_Event_Type_NoteOff || note->velocity == 0);
+
+            if (!isOff && eventFrame >= job->firstFrame && eventFrame < job->lastFrame)
+                MidiRenderNotes_Strike(notes, channel, key, note->velocity, 0);
+            else if (!isOff && notes->keys[channel][key].held == 0)
+                continue; // notes started before this job belong to the previous one, notes started after it to the next one
+            else if (!isOff)
             {
-                fprintf(stderr, "\nError trying to allocate memory for tracks: %u x %u bytes ", mf->nTrks, (unsigned int)sizeof(MidiTrack_t));
-                goto error;
+                // the next job strikes a note this one still sounds, where a single synth would end it
+                // (unless the pedal is down: then this voice only stops with the pedal)
+                off = *note;
+                off.velocity = 0;
+                release = *event;
+                release.data = &off;
+                event = &release;
+                isOff = 1;
             }
+
+            if (isOff)
+                MidiRenderNotes_KeyUp(notes, channel, key);
         }
-        else if (memcmp( &chunktype, &MIDI_CHUNK_TRACK, sizeof(chunktype)) == 0) // MTrk (track chunk)
+        else
+            MidiRenderNotes_Control(notes, event);
+
+        if (sounding > 0 && notes->count == 0 && eventFrame > releaseFrame)
+            releaseFrame = eventFrame;
+
+        uint64_t target = (eventFrame > job->firstFrame) ? eventFrame - job->firstFrame : 0;
+
+        if (target > frame)
         {
-            // sanity check
-            if (!mf->Tracks)
-            {
-                 fprintf(stderr, "\nFound track before header!");
-                 goto error;
-            }
-            else if (trackNumber >= mf->nTrks)
-            {
-                fprintf(stderr, "\nFound more tracks than specified in header!");
-                goto error;
-            }
+            MidiMessageBatch_Flush(&batch, device); // everything due before this instant
 
-            // read the track to buffer
-            char* track_buff;
-            if( ( track_buff = (char*)malloc(chunklength) ) == NULL )
-            {
-                fprintf(stderr, "\nError allocating buffer of %u bytes to read track", chunklength);
-                goto error;
-            }
+            if (MidiRender_Advance(job, device, block, &frame, target) != 0)
+                goto finish;
+        }
 
-            if ( (readlen = fread(track_buff, sizeof(char), chunklength, fp)) != chunklength)
-            {
-                fprintf(stderr, "\nError reading track: read %d of expected %u", readlen, chunklength);
-                free(track_buff);
-                goto error;
-            }
+        MidiMessageBatch_Add(&batch, device, event, &noRemap);
+    }
+
+    MidiMessageBatch_Flush(&batch, device);
+
+    if (endFrame == UINT64_MAX && notes->count > 0 && job->handFrame != UINT64_MAX)
+    {
+        // the events ended first, but the job starting there still takes the notes over
+        if (MidiRender_Advance(job, device, block, &frame, job->handFrame - job->firstFrame) != 0)
+            goto finish;
 
-            // actually read the track
-            printf("\n\nReading track #%u:", trackNumber);
-            MidiTrack_t *track = &mf->Tracks[trackNumber++];
-            MidiTrack_Read(track_buff, chunklength, track);
-            free(track_buff);
+        MidiRender_ReleaseAll(device, notes);
+        endFrame = (job->handFrame + job->tailFrames < job->stopFrame) ? job->handFrame + job->tailFrames : job->stopFrame;
+    }
+    else if (endFrame == UINT64_MAX) // the song ended first: notes never released ring as long as in a single pass
+        endFrame = job->stopFrame;
+
+    if (MidiRender_Advance(job, device, block, &frame, endFrame - job->firstFrame) != 0)
+        goto finish;
+
+    job->result = 0;
+
+    finish:
+    free(notes);
+    free(block);
+    MidiTimeline_Destroy(timeline);
+    MidiRender_DestroySynth(device);
+}
+
+static uint64_t MidiRender_GetDurationUs(const MidiFile_t* midi)
+{
+    MidiTempoMap_t* tempo = MidiTempoMap_Create(midi);
+    if (tempo == NULL)
+        return 0;
+
+    uint64_t duration = 0;
+
+    for (uint16_t t = 0; t < midi->nTrks; t++)
+    {
+        uint64_t ticks = 0;
+
+        for (uint32_t e = 0; e < midi->Tracks[t].NumEvents; e++)
+            ticks += midi->Tracks[t].Events[e].deltaTime;
+
+        uint64_t usec = MidiTempoMap_TicksToUs(tempo, ticks);
+
+        if (usec > duration)
+            duration = usec;
+    }
+
+    MidiTempoMap_Destroy(tempo);
+    return duration;
+}
+
+// collects the samples of one segment in memory, its length is only known when its notes are released
+typedef struct MidiRenderBuffer {
+    int16_t* samples;
+    uint64_t frames;
+    uint64_t capacity;
+} MidiRenderBuffer_t;
+
+static int MidiRenderBuffer_Sink(void* ctx, const int16_t* samples, uint32_t frames)
+{
+    MidiRenderBuffer_t* buffer = (MidiRenderBuffer_t*)ctx;
+
+    if (buffer->frames + frames > buffer->capacity)
+    {
+        uint64_t capacity = (buffer->capacity * 2 > buffer->frames + frames) ? buffer->capacity * 2 : buffer->frames + frames;
+        int16_t* grown = (int16_t*)realloc(buffer->samples, sizeof(int16_t) * 2 * capacity);
+
+        if (grown == NULL)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %llu frames for a segment", (unsigned long long)capacity);
+            return -1;
         }
-        else
+
+        buffer->samples = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(&buffer->samples[buffer->frames * 2], samples, sizeof(int16_t) * 2 * frames);
+    buffer->frames += frames;
+
+    return 0;
+}
+
+// the segments mixed together, starting at the first frame not delivered yet
+typedef struct MidiRenderMix {
+    int32_t* samples;
+    uint64_t base; // frame of the song at samples[0]
+    uint64_t frames;
+    uint64_t capacity;
+} MidiRenderMix_t;
+
+static int MidiRenderMix_Add(MidiRenderMix_t* mix, uint64_t firstFrame, const MidiRenderBuffer_t* buffer)
+{
+    uint64_t offset = firstFrame - mix->base; // segments never start before what was delivered
+    uint64_t frames = offset + buffer->frames;
+
+    if (frames > mix->capacity)
+    {
+        int32_t* grown = (int32_t*)realloc(mix->samples, sizeof(int32_t) * 2 * frames);
+
+        if (grown == NULL)
         {
-            printf("\nUnknown chunk type %.*s", MIDI_CHUNK_SIZE, chunktype);
-            goto error;
+            Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %llu frames for the mix", (unsigned long long)frames);
+            return -1;
         }
+
+        mix->samples = grown;
+        mix->capacity = frames;
     }
 
-    // cleanup and return
-    fclose(fp);
-    return mf;
+    if (frames > mix->frames)
+    {
+        memset(&mix->samples[mix->frames * 2], 0, sizeof(int32_t) * 2 * (frames - mix->frames));
+        mix->frames = frames;
+    }
 
-    error:
-    MidiFile_Close(mf);
-    fclose(fp);
-    return NULL;
+    for (uint64_t k = 0; k < buffer->frames * 2; k++)
+        mix->samples[offset * 2 + k] += buffer->samples[k];
+
+    return 0;
+}
+
+// hands the samples before the given frame to the callback: no segment left to render reaches back there
+static int MidiRenderMix_Deliver(MidiRenderMix_t* mix, const MidiRenderOptions_t* options, int16_t* block, uint64_t upTo)
+{
+    uint64_t frames = (upTo - mix->base < mix->frames) ? upTo - mix->base : mix->frames;
+
+    for (uint64_t offset = 0; offset < frames; offset += options->BlockFrames)
+    {
+        uint32_t count = (frames - offset > options->BlockFrames) ? options->BlockFrames : (uint32_t)(frames - offset);
+
+        for (uint32_t k = 0; k < count * 2; k++)
+        {
+            int32_t mixed = mix->samples[offset * 2 + k];
+            block[k] = (mixed > INT16_MAX) ? INT16_MAX : (mixed < INT16_MIN) ? INT16_MIN : mixed;
+        }
+
+        if (options->Callback(block, count, options->UserData) != 0)
+            return -1;
+    }
+
+    memmove(mix->samples, &mix->samples[frames * 2], sizeof(int32_t) * 2 * (mix->frames - frames));
+    mix->frames -= frames;
+    mix->base += frames;
+
+    return 0;
 }
 
-int MidiFile_Save(const char* filename, const MidiFile_t *save)
+// splits the song into segments, and renders them in windows of one segment per thread, each starting from chased channel state
+// a segment keeps rendering past its end until the notes it started are released, then for OverlapMs more, and the overlaps are mixed
+// a window is delivered once it is rendered, so only the window and the overlaps reaching past it are held in memory
+static int MidiFile_RenderSegments(const MidiFile_t* midi, const MidiRenderOptions_t* options, uint64_t totalFrames, uint64_t tailFrames)
 {
-    if (filename == NULL || save == NULL)
-        return -1;
+    uint32_t numThreads = options->Threads;
+    uint64_t releaseFrames = MidiRender_UsToFrames(options, (uint64_t)options->OverlapMs * 1000);
+    uint64_t segmentFrames = MidiRender_UsToFrames(options, (uint64_t)MIDI_RENDER_SEGMENT_MS * 1000);
 
-    FILE* fp;
-    if ((fp = fopen(filename, "wb+")) == NULL)
-    {
-        fprintf(stderr, "\nFailed to open/create MIDI file %s: %d %s", filename, errno, strerror(errno));
-        return -1;
-    }
+    if (segmentFrames * numThreads > totalFrames) // a short song is still split among all the threads
+        segmentFrames = (totalFrames + numThreads - 1) / numThreads;
 
-    // write header
-    {
-        uint8_t header_data[MIDI_CHUNK_HEADER_LEN];
-        u16toarray(save->Format, &header_data[0]);
-        u16toarray(save->nTrks, &header_data[2]);
-        u16toarray(save->PulsesPerQuarterNote, &header_data[4]);
+    uint64_t numSegments = (totalFrames + segmentFrames - 1) / segmentFrames;
 
-        fwrite(MIDI_CHUNK_HEADER, 1, 4, fp); // header name
-        fwrite((uint8_t[]){0x00, 0x00, 0x00, 0x06}, 1, 4, fp); // header size
-        fwrite(header_data, sizeof(uint8_t), MIDI_CHUNK_HEADER_LEN, fp); // header content
-    }
+    MidiRenderJob_t* jobs = (MidiRenderJob_t*)calloc(numThreads, sizeof(MidiRenderJob_t));
+    MidiRenderBuffer_t* buffers = (MidiRenderBuffer_t*)calloc(numThreads, sizeof(MidiRenderBuffer_t));
+    MidiThread_t* threads = (MidiThread_t*)calloc(numThreads, sizeof(MidiThread_t));
+    uint8_t* started = (uint8_t*)calloc(numThreads, sizeof(uint8_t));
+    int16_t* block = (int16_t*)malloc(sizeof(int16_t) * 2 * options->BlockFrames);
+    MidiRenderMix_t mix = {.samples = NULL};
+    int result = -1;
 
-    for (uint16_t t = 0; t < save->nTrks; t++)
+    if (!jobs || !buffers || !threads || !started || !block)
     {
-        uint32_t trackLen = 0;
-        MidiTrack_t* track = &save->Tracks[t];
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating render segments");
+        goto finish;
+    }
 
-        long allocSize = 1024;
-        char* buffer = (char*)malloc(allocSize);
+    for (uint64_t first = 0; first < numSegments; first += numThreads)
+    {
+        uint32_t numJobs = (numSegments - first > numThreads) ? numThreads : (uint32_t)(numSegments - first);
 
-        for (int e = 0; e < track->NumEvents; e++)
+        for (uint32_t i = 0; i < numJobs; i++)
         {
-            if (allocSize - trackLen < 128)
-                allocSize += 1024, buffer = (char*)realloc(buffer, allocSize);
+            uint8_t last = (first + i + 1 == numSegments);
+
+            jobs[i] = (MidiRenderJob_t){
+                .midi = midi,
+                .options = options,
+                .firstFrame = (first + i) * segmentFrames,
+                .lastFrame = (last) ? totalFrames : (first + i + 1) * segmentFrames,
+                .tailFrames = (last) ? tailFrames : releaseFrames,
+                .followNotes = !last,
+                .segmentFrames = segmentFrames,
+                .handFrame = (first + i + 2 < numSegments) ? (first + i + 2) * segmentFrames : UINT64_MAX,
+                .stopFrame = totalFrames + tailFrames,
+                .sink = MidiRenderBuffer_Sink,
+                .ctx = &buffers[i],
+                .result = -1,
+            };
+
+            buffers[i].frames = 0; // the memory is kept for the next window
+        }
 
-            MidiEvent_t* event = &track->Events[e];
+        for (uint32_t i = 0; i < numJobs; i++)
+            started[i] = (MidiThread_Start(&threads[i], MidiRender_RunJob, &jobs[i]) == 0);
 
-            trackLen += WriteVariableLength(&buffer[trackLen], 5, event->deltaTime);
-            trackLen += event->interface->write_data(&buffer[trackLen], event);
-        }
+        for (uint32_t i = 0; i < numJobs; i++)
+            if (started[i])
+                MidiThread_Join(&threads[i]);
 
-        uint8_t arrlen[4];
-        u32toarray(trackLen, arrlen);
+        for (uint32_t i = 0; i < numJobs; i++)
+            if (!started[i] || jobs[i].result != 0)
+                goto finish;
 
-        fwrite(MIDI_CHUNK_TRACK, 1, 4, fp); // chunk tag
-        fwrite(arrlen, 1, 4, fp); // chunk length
-        fwrite(buffer, sizeof(char), trackLen, fp); // write data
-        free(buffer);
+        for (uint32_t i = 0; i < numJobs; i++)
+            if (MidiRenderMix_Add(&mix, jobs[i].firstFrame, &buffers[i]) != 0)
+                goto finish;
+
+        // the next window starts here, after the last one everything is due
+        uint64_t upTo = (first + numJobs == numSegments) ? UINT64_MAX : jobs[numJobs - 1].lastFrame;
+
+        if (MidiRenderMix_Deliver(&mix, options, block, upTo) != 0)
+            goto finish;
     }
 
+    result = 0;
 
-    fclose(fp);
-    return 0;
+    finish:
+    if (buffers)
+        for (uint32_t i = 0; i < numThreads; i++)
+            free(buffers[i].samples);
+
+    free(mix.samples);
+    free(block);
+    free(jobs);
+    free(buffers);
+    free(threads);
+    free(started);
+
+    return result;
 }
 
-// TIME MAP
-// ===================================================================
-uint32_t Midi_MapAbsoluteTime(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi)
+static int MidiRender_CallbackSink(void* ctx, const int16_t* samples, uint32_t frames)
 {
-    if (*list != NULL)
-    {
-        fprintf(stderr, "\nMake sure your pointer starts NULL!");
+    const MidiRenderOptions_t* options = (const MidiRenderOptions_t*)ctx;
+
+    return options->Callback(samples, frames, options->UserData);
+}
+
+int MidiFile_Render(const MidiFile_t* midi, const MidiRenderOptions_t* userOptions)
+{
+    // sanity check
+    if (midi == NULL || userOptions == NULL || userOptions->Callback == NULL)
         return -1;
-    }
 
-    uint32_t numEvents = 0;
-    MidiAbsoluteTimeMap_t* addMap()
-    {
-        MidiAbsoluteTimeMap_t* new_list = (MidiAbsoluteTimeMap_t*)realloc((*list), sizeof(MidiAbsoluteTimeMap_t)*(numEvents+1));
+    MidiRenderOptions_t options = *userOptions;
 
-        if (new_list == NULL)
-            return NULL; // failed to realloc - original pointer still good
+    if (options.SampleRate == 0)
+        options.SampleRate = MIDI_RENDER_DEFAULT_SAMPLE_RATE;
 
-        *list = new_list; // update old pointer
-        numEvents++;
+    if (options.BlockFrames == 0)
+        options.BlockFrames = MIDI_RENDER_DEFAULT_BLOCK;
 
-        return &new_list[numEvents - 1];
-    }
+    if (options.OverlapMs == 0)
+        options.OverlapMs = MIDI_RENDER_DEFAULT_OVERLAP_MS;
 
-    int playerCb(MidiEvent_t* event, uint16_t track, uint32_t timeTicks, uint32_t timeUs)
-    {
-        if ((event->interface->type == Midi_Event_Type_NoteOff) || (event->interface->type == Midi_Event_Type_NoteOn))
-        {
-            if (!event->data) // sanity check
-                goto bail;
+    uint64_t totalFrames = MidiRender_UsToFrames(&options, MidiRender_GetDurationUs(midi)) + 1; // the last event is inside
+    uint64_t tailFrames = MidiRender_UsToFrames(&options, (uint64_t)options.TailMs * 1000);
 
-            MidiEventData_NoteEvent_t* this_note = (MidiEventData_NoteEvent_t*)event->data;
+    if (options.Threads > 1 && totalFrames >= options.Threads)
+        return MidiFile_RenderSegments(midi, &options, totalFrames, tailFrames);
 
-            if ((this_note->OnOff == Midi_Event_Type_NoteOff) || (this_note->velocity == 0))
-            {
-                // NOTE OFF
-                // find a matching unterminated note event in the list
-                for (int i = numEvents - 1; i >= 0; i--)
-                {
-                    MidiAbsoluteTimeMap_t* match = &((*list)[i]);
+    MidiRenderJob_t job = {
+        .midi = midi,
+        .options = &options,
+        .firstFrame = 0,
+        .lastFrame = totalFrames,
+        .tailFrames = tailFrames,
+        .handFrame = UINT64_MAX,
+        .stopFrame = totalFrames + tailFrames,
+        .sink = MidiRender_CallbackSink,
+        .ctx = &options,
+        .result = -1,
+    };
 
-                    if (match->OffEvent != NULL)
-                        continue;
+    MidiRender_RunJob(&job);
+    return job.result;
+}
 
-                    MidiEventData_NoteEvent_t* match_data = (MidiEventData_NoteEvent_t*)match->OnEvent->data;
+typedef struct MidiWavWriter {
+    FILE* file;
+    uint64_t frames;
+} MidiWavWriter_t;
 
-                    if (match_data == NULL) // sanity check
-                        continue;
+static int MidiWavWriter_Write(const int16_t* samples, uint32_t frames, void* user)
+{
+    MidiWavWriter_t* writer = (MidiWavWriter_t*)user;
 
-                    if ((match_data->channel == this_note->channel) && (match->track == track) && (match_data->key == this_note->key) && (match_data->OnOff == Midi_Event_Type_NoteOn))
-                    {
-                        match->OffEvent = event;
-                        match->endTime = timeUs; // found an "unterminated" note on with same key and channel
-                        break;
-                    }
-                }
-            }
-            else
-            {
-                // NOTE ON
-                MidiAbsoluteTimeMap_t* new_entry = addMap();
-
-                if (new_entry == NULL) // some allocation error
-                    goto bail;
-
-                (*new_entry) = (MidiAbsoluteTimeMap_t) {
-                    .OnEvent = event,
-                    .OffEvent = NULL,
-                    .track = track,
-                    .startTime = timeUs,
-                    .endTime = UINT32_MAX, // we figure out end time when we get the note-off
-                };
-            }
+    // WAV is little-endian
+    uint8_t bytes[MIDI_RENDER_DEFAULT_BLOCK * 4];
+
+    for (uint32_t done = 0; done < frames; )
+    {
+        uint32_t count = (frames - done > MIDI_RENDER_DEFAULT_BLOCK) ? MIDI_RENDER_DEFAULT_BLOCK : frames - done;
+
+        for (uint32_t k = 0; k < count * 2; k++)
+        {
+            uint16_t sample = (uint16_t)samples[done * 2 + k];
+            bytes[2*k] = sample & 0xFF;
+            bytes[2*k + 1] = sample >> 8;
         }
 
-        bail:
-        return Player_Callback_IgnoreEvent;
-    }
+        if (fwrite(bytes, 4, count, writer->file) != count)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nError writing samples");
+            return -1;
+        }
 
-    MidiFile_Play(midi, UINT32_MAX, playerCb);
+        done += count;
+    }
 
-    return numEvents;
+    writer->frames += frames;
+    return 0;
 }
 
-// PLAYER
-// ===================================================================
+static void MidiWav_WriteHeader(FILE* file, uint32_t sampleRate, uint64_t frames)
+{
+    uint32_t dataSize = (frames * 4 > UINT32_MAX - 36) ? UINT32_MAX - 36 : (uint32_t)(frames * 4);
+    uint8_t header[44];
+
+    #define put_u32le(offset, value) { header[offset] = (value) & 0xFF; header[offset+1] = ((value) >> 8) & 0xFF; header[offset+2] = ((value) >> 16) & 0xFF; header[offset+3] = ((value) >> 24) & 0xFF; }
+    #define put_u16le(offset, value) { header[offset] = (value) & 0xFF; header[offset+1] = ((value) >> 8) & 0xFF; }
+
+    memcpy(&header[0], "RIFF", 4);
+    put_u32le(4, 36 + dataSize);
+    memcpy(&header[8], "WAVEfmt ", 8);
+    put_u32le(16, 16); // size of the fmt chunk
+    put_u16le(20, 1); // PCM
+    put_u16le(22, 2); // channels
+    put_u32le(24, sampleRate);
+    put_u32le(28, sampleRate * 4); // byte rate
+    put_u16le(32, 4); // block align
+    put_u16le(34, 16); // bits per sample
+    memcpy(&header[36], "data", 4);
+    put_u32le(40, dataSize);
+
+    #undef put_u32le
+    #undef put_u16le
+
+    fwrite(header, 1, sizeof(header), file);
+}
 
-#if defined(unix) || defined(__unix__) || defined(__unix)
+int MidiFile_RenderWav(const MidiFile_t* midi, const char* filename, const MidiRenderOptions_t* userOptions)
+{
+    MidiRenderOptions_t options = (userOptions) ? *userOptions : (MidiRenderOptions_t){0};
 
-// apt-get install fluidsynth; apt-get install libfluidsynth-dev;
-// must include "-lfluidsynth" in linker options
-#include <fluidsynth.h>
+    if (options.SampleRate == 0)
+        options.SampleRate = MIDI_RENDER_DEFAULT_SAMPLE_RATE;
 
-fluid_settings_t* settings;
-fluid_synth_t* synth;
-fluid_audio_driver_t* adriver;
+    MidiWavWriter_t writer = {.file = fopen(filename, "wb"), .frames = 0};
 
-#define SOUND_FONT_PATH "/usr/share/sounds/sf2/FluidR3_GM.sf2"
+    if (writer.file == NULL)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open file '%s' for writing", filename);
+        return -1;
+    }
 
-#include <unistd.h>
-void SLEEPUS(uint32_t us) { usleep(us); }
+    MidiWav_WriteHeader(writer.file, options.SampleRate, 0); // sizes are patched once known
 
-int MidiDevice_Open()
-{
-    settings = new_fluid_settings();
-    fluid_settings_setstr(settings, "audio.driver", "alsa");
+    options.Callback = MidiWavWriter_Write;
+    options.UserData = &writer;
 
-    synth = new_fluid_synth(settings);
-    fluid_synth_sfload(synth, SOUND_FONT_PATH, 1);
+    int result = MidiFile_Render(midi, &options);
 
-    adriver = new_fluid_audio_driver(settings, synth);
+    fseek(writer.file, 0, SEEK_SET);
+    MidiWav_WriteHeader(writer.file, options.SampleRate, writer.frames);
 
-    return 0;
+    fclose(writer.file);
+    return result;
 }
 
-void MidiDevice_Reset()
+#else
+
+int MidiFile_Render(const MidiFile_t* midi, const MidiRenderOptions_t* options)
 {
-    for (uint8_t ch = 0; ch < 16; ch++)
-        fluid_synth_all_sounds_off(synth, ch);
+    Midi_Log(MIDI_LOG_ERRORS, "\nOffline rendering requires FluidSynth, which is only used on unix");
+    return -1;
 }
 
-void MidiDevice_Close()
+int MidiFile_RenderWav(const MidiFile_t* midi, const char* filename, const MidiRenderOptions_t* options)
 {
-    delete_fluid_audio_driver(adriver);
-    delete_fluid_synth(synth);
-    delete_fluid_settings(settings);
+    return MidiFile_Render(midi, options);
 }
 
-int MidiDevice_SetChannelInstrument(uint8_t channel, uint8_t instrument)
+#endif
+
+// BATCH
+// ===================================================================
+// the files are split in equal ranges, one per worker; a worker that finishes its range steals half of the range of another one
+// a range is a single atomic word (first job in the upper half, end in the lower half), so taking and stealing are both one CAS
+typedef struct MidiBatchWorker {
+    _Alignas(64) atomic_uint_least64_t range;
+    MidiThread_t thread;
+    struct MidiBatch* batch;
+    uint32_t id;
+    MidiArena_t* arena; // holds the events of the file being processed, reset after each one
+    MidiBatchStats_t stats;
+} MidiBatchWorker_t;
+
+typedef struct MidiBatch {
+    const char* const* filenames;
+    const MidiBatchOptions_t* options;
+    MidiBatchWorker_t* workers;
+    uint32_t numWorkers;
+} MidiBatch_t;
+
+#define MIDI_BATCH_RANGE(first, end) (((uint64_t)(first) << 32) | (uint32_t)(end))
+
+// takes the first job of the own range
+static int MidiBatchWorker_Pop(MidiBatchWorker_t* worker, uint32_t* job)
 {
-     return (fluid_synth_program_change(synth, channel, instrument) == FLUID_OK) ? 0 : -1;
+    uint64_t range = atomic_load(&worker->range);
+
+    for (;;)
+    {
+        uint32_t first = (uint32_t)(range >> 32), end = (uint32_t)range;
+
+        if (first >= end)
+            return 0;
+
+        if (atomic_compare_exchange_weak(&worker->range, &range, MIDI_BATCH_RANGE(first + 1, end)))
+        {
+            *job = first;
+            return 1;
+        }
+    }
 }
 
-int MidiDevice_PlayNote(uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state)
+// moves the second half of the range of the victim to the (empty) range of the thief
+static int MidiBatchWorker_Steal(MidiBatchWorker_t* thief, MidiBatchWorker_t* victim)
 {
-    int result;
+    uint64_t range = atomic_load(&victim->range);
 
-    if (state)
-        result = fluid_synth_noteon(synth, channel, key, velocity);
-    else
-        result = fluid_synth_noteoff(synth, channel, key);
+    for (;;)
+    {
+        uint32_t first = (uint32_t)(range >> 32), end = (uint32_t)range;
 
-    return (result == FLUID_OK) ? 0 : -1;
+        if (first >= end)
+            return 0;
+
+        uint32_t half = first + (end - first) / 2;
+
+        if (atomic_compare_exchange_weak(&victim->range, &range, MIDI_BATCH_RANGE(first, half)))
+        {
+            atomic_store(&thief->range, MIDI_BATCH_RANGE(half, end));
+            return 1;
+        }
+    }
 }
 
-#endif
+// output directory + the name of the file (without its own directory)
+static char* MidiBatch_OutputPath(const char* directory, const char* filename)
+{
+    const char* name = filename;
 
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
+    for (const char* c = filename; *c; c++)
+        if (*c == '/' || *c == '\\')
+            name = c + 1;
 
-#include <windows.h>
-#include <mmsystem.h> // must include "-lwinmm" in linker options
+    size_t length = strlen(directory);
+    char* path = (char*)malloc(length + strlen(name) + 2);
 
-HMIDIOUT    midiOutHandle;
+    if (path != NULL)
+        sprintf(path, "%s%s%s", directory, (length > 0 && directory[length - 1] != '/' && directory[length - 1] != '\\') ? "/" : "", name);
+
+    return path;
+}
 
-void SLEEPUS(uint32_t us)
+static int MidiBatch_RunJob(MidiBatchWorker_t* worker, const char* filename)
 {
-    LARGE_INTEGER freq, start, current;
-    QueryPerformanceFrequency(&freq);
-    QueryPerformanceCounter(&start);
+    const MidiBatchOptions_t* options = worker->batch->options;
+
+    // the payloads can point into the mapping, it stays open until the file is released
+    MidiMapping_t map;
+    if (MidiMapping_Open(filename, 1, &map) != 0)
+        return -1;
 
-    // because sleep is not precise, let's sleep short of actual value and let performance counter fill-in the rest
-    uint32_t sleepfunc = us / 1500;
+    int result = -1;
+    MidiFile_t* mf = MidiFile_Parse(map.data, map.size, options->OpenFlags | MIDI_OPEN_ZERO_COPY, worker->arena);
 
-    if (sleepfunc > 0)
-        Sleep(sleepfunc); // never call Sleep with 0 because it will relinquish time slice for unknown amount of time
+    if (mf == NULL)
+        goto finish;
 
-    // busy-wait remaining microseconds
-    do
+    worker->stats.BytesRead += map.size;
+
+    for (uint16_t t = 0; t < mf->nTrks; t++)
+        worker->stats.Events += mf->Tracks[t].NumEvents;
+
+    result = (options->Callback) ? options->Callback(mf, filename, worker->id, options->UserData) : Batch_Callback_Save;
+
+    if (result == Batch_Callback_Save && options->OutputDir)
     {
-        QueryPerformanceCounter(&current);
+        char* path = MidiBatch_OutputPath(options->OutputDir, filename);
+        int size = MidiFile_GetEncodedSize(mf, options->SaveFlags);
+
+        if (path == NULL || size < 0 || MidiFile_SaveEx(path, mf, options->SaveFlags) != 0)
+            result = Batch_Callback_Error;
+        else
+            worker->stats.BytesWritten += size;
+
+        free(path);
     }
-    while ( ((current.QuadPart - start.QuadPart)*1e6)/freq.QuadPart < us );
+
+    finish:
+    MidiFile_Free(mf, 0);
+    MidiArena_Reset(worker->arena);
+    MidiMapping_Close(&map);
+
+    return (result == Batch_Callback_Error) ? -1 : 0;
 }
 
-int MidiDevice_Open()
+static void MidiBatch_Worker(void* arg)
 {
-    const UINT devid = -1;
+    MidiBatchWorker_t* worker = (MidiBatchWorker_t*)arg;
+    MidiBatch_t* batch = worker->batch;
+
+    int cap = threadLogCap;
+    threadLogCap = MIDI_LOG_WARNINGS; // progress messages from many threads would only contend for the console
+
+    for (;;)
+    {
+        uint32_t job;
+
+        while (MidiBatchWorker_Pop(worker, &job))
+        {
+            if (MidiBatch_RunJob(worker, batch->filenames[job]) == 0)
+                worker->stats.Files++;
+            else
+                worker->stats.Failed++;
+        }
+
+        // out of work: look for a victim, starting from the next worker so thieves spread out
+        uint8_t stolen = 0;
+
+        for (uint32_t i = 1; i < batch->numWorkers && !stolen; i++)
+            stolen = MidiBatchWorker_Steal(worker, &batch->workers[(worker->id + i) % batch->numWorkers]);
+
+        if (!stolen)
+            break;
+    }
+
+    threadLogCap = cap;
+}
+
+int Midi_ProcessFiles(const char* const* filenames, uint32_t count, const MidiBatchOptions_t* options, MidiBatchStats_t* stats)
+{
+    if ((filenames == NULL && count > 0) || options == NULL)
+        return -1;
+
+    uint64_t start = MidiClock_NowNs();
 
-    if ( midiOutOpen(&midiOutHandle, devid, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR )
+    uint32_t numWorkers = (options->Threads) ? options->Threads : Midi_GetCpuCount();
+    if (numWorkers > count)
+        numWorkers = count;
+    if (numWorkers == 0)
+        numWorkers = 1;
+
+    MidiBatch_t batch = {
+        .filenames = filenames,
+        .options = options,
+        .numWorkers = numWorkers,
+    };
+
+    if ((batch.workers = (MidiBatchWorker_t*)calloc(numWorkers, sizeof(MidiBatchWorker_t))) == NULL)
     {
-        fprintf(stderr, "\nError opening MIDI output device");
+        Midi_Log(MIDI_LOG_ERRORS, "\nError allocating %u batch workers", numWorkers);
         return -1;
     }
 
-    MIDIOUTCAPS     moc;
-    if (!midiOutGetDevCaps(devid, &moc, sizeof(MIDIOUTCAPS)))
+    int result = -1;
+
+    for (uint32_t w = 0; w < numWorkers; w++)
     {
-        printf("\nOPENED MIDI DEVICE: %s", moc.szPname);
+        MidiBatchWorker_t* worker = &batch.workers[w];
+
+        worker->batch = &batch;
+        worker->id = w;
+        atomic_init(&worker->range, MIDI_BATCH_RANGE((uint64_t)count * w / numWorkers, (uint64_t)count * (w + 1) / numWorkers));
+
+        if ((worker->arena = MidiArena_Create(0)) == NULL)
+        {
+            Midi_Log(MIDI_LOG_ERRORS, "\nError allocating arena for batch worker %u", w);
+            goto finish;
+        }
     }
 
-    return 0;
-}
+    // the calling thread is worker 0; if a thread cannot start, its range is stolen by the others
+    uint32_t started = 1;
+    while (started < numWorkers && MidiThread_Start(&batch.workers[started].thread, MidiBatch_Worker, &batch.workers[started]) == 0)
+        started++;
 
-void MidiDevice_Reset()
-{
-    midiOutReset(midiOutHandle); // stop all notes
-}
+    MidiBatch_Worker(&batch.workers[0]);
 
-void MidiDevice_Close()
-{
-    midiOutReset(midiOutHandle); // stop all notes
-    midiOutClose(midiOutHandle); // release resources
-}
+    for (uint32_t w = 1; w < started; w++)
+        MidiThread_Join(&batch.workers[w].thread);
 
-int MidiSendShortMessage(uint8_t d0, uint8_t d1, uint8_t d2, uint8_t d3)
-{
-    union
-     {
-         uint32_t raw;
-         uint8_t data[4];
-     } midiMessage;
+    // a worker that never started still owns its range
+    for (uint32_t w = started; w < numWorkers; w++)
+        MidiBatch_Worker(&batch.workers[w]);
 
-     midiMessage.data[0] = d0;
-     midiMessage.data[1] = d1;
-     midiMessage.data[2] = d2;
-     midiMessage.data[3] = d3;
+    result = 0;
 
-     if (midiOutShortMsg(midiOutHandle, midiMessage.raw ) != MMSYSERR_NOERROR)
-     {
-         fprintf(stderr, "\nError sending midi-message [%.8x]", midiMessage.raw);
-         return -1;
-     }
+    finish:
+    {
+        MidiBatchStats_t total = {0};
 
-     return 0;
-}
+        for (uint32_t w = 0; w < numWorkers; w++)
+        {
+            total.Files += batch.workers[w].stats.Files;
+            total.Failed += batch.workers[w].stats.Failed;
+            total.Events += batch.workers[w].stats.Events;
+            total.BytesRead += batch.workers[w].stats.BytesRead;
+            total.BytesWritten += batch.workers[w].stats.BytesWritten;
 
-int MidiDevice_SetChannelInstrument(uint8_t channel, uint8_t instrument)
-{
-    return MidiSendShortMessage(0xC0 + (channel & 0x0F), instrument, 0, 0);
+            MidiArena_Destroy(batch.workers[w].arena);
+        }
+
+        total.ElapsedUs = (MidiClock_NowNs() - start) / 1000;
+
+        if (total.ElapsedUs > 0)
+        {
+            total.FilesPerSecond = (total.Files + total.Failed) * 1e6 / total.ElapsedUs;
+            total.BytesPerSecond = total.BytesRead * 1e6 / total.ElapsedUs;
+        }
+
+        if (stats)
+            (*stats) = total;
+
+        if (result == 0)
+            result = (int)total.Failed;
+    }
+
+    free(batch.workers);
+    return result;
 }
 
-int MidiDevice_PlayNote(uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state)
+static int MidiBatch_IsMidiFile(const char* name)
 {
-     return MidiSendShortMessage((state ? 0x90 : 0x80) + (channel & 0x0F), key, velocity, 0);
-}
+    const char* extension = strrchr(name, '.');
 
-#endif
+    if (extension == NULL || strlen(extension) > 5)
+        return 0;
 
-int trivial_callback(MidiEvent_t* event, uint16_t track, uint32_t timeTicks, uint32_t timeUs)
-{
-    return Player_Callback_PlayEvent;
+    char lower[6] = "";
+    for (int i = 0; i < 5 && extension[i]; i++)
+        lower[i] = (extension[i] >= 'A' && extension[i] <= 'Z') ? extension[i] - 'A' + 'a' : extension[i];
+
+    return (strcmp(lower, ".mid") == 0) || (strcmp(lower, ".midi") == 0);
 }
 
-void MidiFile_Play(const MidiFile_t* midi, uint32_t start_usec, playerCallback cbFunc)
+static int MidiBatch_ComparePaths(const void* a, const void* b)
 {
-    // sanity check
-    if (midi == NULL)
-        return;
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
 
-    if (cbFunc == NULL)
-        cbFunc = trivial_callback;
+// appends directory/name to a growing list of paths
+static int MidiBatch_AddPath(char*** paths, uint32_t* count, uint32_t* capacity, const char* directory, const char* name)
+{
+    if (*count >= *capacity)
+    {
+        uint32_t new_capacity = (*capacity) ? (*capacity) * 2 : 64;
+        char** new_paths = (char**)realloc(*paths, sizeof(char*) * new_capacity);
+        if (new_paths == NULL)
+            return -1;
 
-    uint32_t waitTicks[midi->nTrks]; // how many ticks before the next event for each track
-    uint32_t minimumWaitTicks = 0; // the smallest number in list above
+        *paths = new_paths;
+        *capacity = new_capacity;
+    }
 
-    uint16_t countFinishedTracks = 0; // how many tracks have finished already
-    uint16_t currentEvent[midi->nTrks]; // the index of the event queue to play next, for each track
+    if (((*paths)[*count] = MidiBatch_OutputPath(directory, name)) == NULL)
+        return -1;
 
-    uint32_t TickDurationUs = 2602; // conversion from tick to actual time
+    (*count)++;
+    return 0;
+}
 
-    for (uint16_t trackIndex = 0; trackIndex < midi->nTrks; trackIndex++) // initialization
-        currentEvent[trackIndex] = 0, waitTicks[trackIndex] = 0;
+#if defined(unix) || defined(__unix__) || defined(__unix)
 
-    // converting between ticks and seconds is not trivial because "SetTempo" events may change the conversion factor several times along the song
-    uint32_t currentTotalTime_Ticks = 0;
-    uint32_t currentTotalTime_Usecs = 0;
+#include <dirent.h>
 
-    while (countFinishedTracks < midi->nTrks)
+static int MidiBatch_ListDirectory(const char* directory, char*** paths, uint32_t* count)
+{
+    DIR* dir = opendir(directory);
+    if (dir == NULL)
     {
-        // keep track of the time we're waiting
-        currentTotalTime_Ticks += minimumWaitTicks;
-        currentTotalTime_Usecs += TickDurationUs*minimumWaitTicks;
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open directory %s: %d %s", directory, errno, strerror(errno));
+        return -1;
+    }
 
-        if (currentTotalTime_Usecs >= start_usec)
-            SLEEPUS(TickDurationUs*minimumWaitTicks); // fast-forward to the start time
+    uint32_t capacity = 0;
+    int result = 0;
 
-        uint32_t decrementTicks = minimumWaitTicks;
-        minimumWaitTicks = UINT32_MAX;
+    for (struct dirent* entry; result == 0 && (entry = readdir(dir)) != NULL; )
+        if (MidiBatch_IsMidiFile(entry->d_name))
+            result = MidiBatch_AddPath(paths, count, &capacity, directory, entry->d_name);
 
-        for (uint16_t trackIndex = 0; trackIndex < midi->nTrks; trackIndex++)
-        {
-            waitTicks[trackIndex] -= decrementTicks;
+    closedir(dir);
+    return result;
+}
 
-            if (waitTicks[trackIndex] != 0)
-            {
-                minimumWaitTicks = min(minimumWaitTicks, waitTicks[trackIndex]);
-                continue;
-            }
+#endif
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(__WIN32__)
 
-            MidiEvent_t *event = &midi->Tracks[trackIndex].Events[currentEvent[trackIndex]];
-            MidiEventType_t type = MidiEvent_GetType(event);
+static int MidiBatch_ListDirectory(const char* directory, char*** paths, uint32_t* count)
+{
+    char* pattern = MidiBatch_OutputPath(directory, "*");
+    if (pattern == NULL)
+        return -1;
 
-            int cbResult = cbFunc(event, trackIndex, currentTotalTime_Ticks, currentTotalTime_Usecs);
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA(pattern, &entry);
+    free(pattern);
 
-            if (cbResult == Player_Callback_Abort)
-                return;
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        Midi_Log(MIDI_LOG_ERRORS, "\nFailed to open directory %s: error %lu", directory, GetLastError());
+        return -1;
+    }
 
-            if ((cbResult == Player_Callback_IgnoreEvent) && (type != Midi_Event_Type_SetTempo)) // we may never ignore tempo events
-                goto ignore;
+    uint32_t capacity = 0;
+    int result = 0;
 
-            if ((type == Midi_Event_Type_NoteOn || type == Midi_Event_Type_NoteOff) && (currentTotalTime_Usecs >= start_usec)) // don't play notes when skipping ahead to start time
-            {
-                MidiEventData_NoteEvent_t* data = (MidiEventData_NoteEvent_t*)event->data;
-                MidiDevice_PlayNote(data->key, data->channel, data->velocity, (type == Midi_Event_Type_NoteOn) );
-            }
-            else if (type == Midi_Event_Type_SetTempo)
-            {
-                MidiEventData_SetTempo_t* data = (MidiEventData_SetTempo_t*)event->data;
+    do {
+        if (!(entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && MidiBatch_IsMidiFile(entry.cFileName))
+            result = MidiBatch_AddPath(paths, count, &capacity, directory, entry.cFileName);
+    } while (result == 0 && FindNextFileA(find, &entry));
 
-                TickDurationUs = (data->tempo / midi->PulsesPerQuarterNote); // convert to micro-seconds
+    FindClose(find);
+    return result;
+}
 
-                //printf("\nSet tick duration = %u us", TickDurationUs);
-            }
-            else if (type == Midi_Event_Type_ProgramChange)
-            {
-                MidiEventData_ProgramChange_t* data = (MidiEventData_ProgramChange_t*)event->data;
+#endif
 
-                MidiDevice_SetChannelInstrument(data->channel, data->program);
-                //printf("\nSet instrument Ch=%d P=%d %s", data->channel, data->program, Midi_GetInstrumentName(data->program));
-            }
+int Midi_ProcessDirectory(const char* directory, const MidiBatchOptions_t* options, MidiBatchStats_t* stats)
+{
+    if (directory == NULL)
+        return -1;
 
-            ignore:
-            currentEvent[trackIndex]++;
-            if (currentEvent[trackIndex] >= midi->Tracks[trackIndex].NumEvents)
-                waitTicks[trackIndex] = UINT32_MAX, countFinishedTracks++;
-            else
-                waitTicks[trackIndex] = midi->Tracks[trackIndex].Events[currentEvent[trackIndex]].deltaTime;
+    char** paths = NULL;
+    uint32_t count = 0;
+    int result = MidiBatch_ListDirectory(directory, &paths, &count);
 
-            minimumWaitTicks = min(minimumWaitTicks, waitTicks[trackIndex]);
-        }
+    if (result == 0)
+    {
+        qsort(paths, count, sizeof(char*), MidiBatch_ComparePaths); // the order of the directory is arbitrary
+        result = Midi_ProcessFiles((const char* const*)paths, count, options, stats);
     }
+
+    for (uint32_t i = 0; i < count; i++)
+        free(paths[i]);
+
+    free(paths);
+    return result;
 }
 
 // ADDITIONAL FEATURES
@@ -1482,25 +7626,15 @@ const MidiTranspositionData_t* Midi_GetKeySignatureTranspositionInfo(const MidiE
     return NULL;
 }
 
+// the earliest key signature of the file
 MidiEventData_KeySignature_t* Midi_GetKeySignature(const MidiFile_t* midi)
 {
-    if (midi == NULL)
-        return NULL;
-
-    for (uint16_t t = 0; t< midi->nTrks; t++)
-    {
-        for (uint32_t e = 0; e < midi->Tracks[t].NumEvents; e++)
-        {
-            MidiEvent_t* event = &midi->Tracks[t].Events[e];
+    const MidiTimelineEvent_t* events;
 
-            if (MidiEvent_GetType(event) == Midi_Event_Type_KeySignature)
-            {
-                return ((MidiEventData_KeySignature_t*)event->data);
-            }
-        }
-    }
+    if (Midi_FindEvents(midi, Midi_Event_Type_KeySignature, &events) <= 0)
+        return NULL;
 
-    return NULL;
+    return ((MidiEventData_KeySignature_t*)events[0].event->data);
 }
 
 int8_t Midi_Transpose(MidiFile_t* file, const MidiTranspositionData_t* newKey)
@@ -1508,7 +7642,7 @@ int8_t Midi_Transpose(MidiFile_t* file, const MidiTranspositionData_t* newKey)
     if (file == NULL)
     {
         error:
-        fprintf(stderr, "Midi_Transpose was passed a NULL pointer!");
+        Midi_Log(MIDI_LOG_ERRORS, "Midi_Transpose was passed a NULL pointer!");
         return 0;
     }
 
@@ -1520,7 +7654,7 @@ int8_t Midi_Transpose(MidiFile_t* file, const MidiTranspositionData_t* newKey)
 
     if (newKey->mi != oldKey->mi)
     {
-        fprintf(stderr, "\nCannot transpose Major <-> Minor or vice-versa!");
+        Midi_Log(MIDI_LOG_ERRORS, "\nCannot transpose Major <-> Minor or vice-versa!");
         return 0;
     }
 
@@ -1545,6 +7679,8 @@ int8_t Midi_Transpose(MidiFile_t* file, const MidiTranspositionData_t* newKey)
     midi_ks->mi = newKey->mi;
     midi_ks->sf = newKey->sf;
 
+    MidiFile_Invalidate(file); // the keys of the notes changed
+
     return delta;
 }
 
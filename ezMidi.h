@@ -59,11 +59,11 @@ typedef enum MidiEventType {
     Midi_Event_Type_PitchWheelChange       = 0xE0,   // 1110nnnn 0lllllll 0mmmmmmm
 } MidiEventType_t;
 
+// text and SysEx payloads of any length; the bytes are owned by the file (or point into it with MIDI_OPEN_ZERO_COPY)
 typedef struct MidiEventData_Text
 {
-    #define MidiEventData_Text_Max_Length 255
-    uint8_t length;
-    char text[MidiEventData_Text_Max_Length];
+    uint32_t length;
+    const char* text; // NUL-terminated, except when it points into the file (MIDI_OPEN_ZERO_COPY)
 } MidiEventData_Text_t;
 
 typedef struct MidiEventData_SequenceNumber
@@ -166,6 +166,43 @@ typedef struct MidiEvent
 
 MidiEventType_t MidiEvent_GetType(const MidiEvent_t* event);
 
+// ERRORS
+// ===================================================================
+// the cause of the last parsing failure, recorded per thread
+typedef enum MidiError {
+    MIDI_OK = 0,
+    MIDI_ERROR_TRUNCATED, // the data ends in the middle of an event or chunk
+    MIDI_ERROR_BAD_VLQ, // variable-length quantity longer than 4 bytes
+    MIDI_ERROR_BAD_LENGTH, // the length of a meta event is not valid for its type
+    MIDI_ERROR_UNKNOWN_EVENT, // the status byte or meta type is not supported, so the size of the event is unknown
+    MIDI_ERROR_RUNNING_STATUS, // a data byte where a status byte was expected, without running status in effect
+    MIDI_ERROR_BAD_HEADER, // the header chunk is missing, repeated or malformed
+    MIDI_ERROR_BAD_CHUNK, // unknown chunk type, or more track chunks than declared in the header
+    MIDI_ERROR_ALLOCATION,
+    MIDI_ERROR_IO, // the file could not be opened, mapped or read
+} MidiError_t;
+
+typedef struct MidiErrorInfo {
+    MidiError_t Code;
+    int32_t Track; // index of the track being decoded, or -1 if the error is not inside a track
+    uint32_t Offset; // where the bad event starts, in bytes from the start of the track chunk data
+} MidiErrorInfo_t;
+
+// messages printed by the library; the default is MIDI_LOG_INFO
+typedef enum MidiLogLevel {
+    MIDI_LOG_SILENT = 0,
+    MIDI_LOG_ERRORS = 1, // to stderr
+    MIDI_LOG_WARNINGS = 2, // to stderr: suspicious but usable data
+    MIDI_LOG_INFO = 3, // to stdout: progress, like each track being read
+} MidiLogLevel_t;
+
+void Midi_SetLogLevel(MidiLogLevel_t level);
+MidiLogLevel_t Midi_GetLogLevel();
+
+MidiErrorInfo_t Midi_GetLastError();
+void Midi_ClearError();
+const char* Midi_GetErrorString(MidiError_t error);
+
 
 // FILES AND TRACKS
 // ===================================================================
@@ -179,19 +216,181 @@ typedef enum MidiFileFormat {
 typedef struct MidiTrack {
     uint32_t NumEvents; // Number of events in the array
     MidiEvent_t *Events; // pointer to the first event in track
+    const uint8_t *Encoded; // the original bytes of the track (MIDI_OPEN_KEEP_SOURCE), saved verbatim; NULL once the track is edited (dirty)
+    uint32_t EncodedLength;
 } MidiTrack_t;
 
+// block allocator owning the event payloads of a file
+typedef struct MidiArena MidiArena_t;
+
+// lookup tables of the events of a file (see INDEX)
+typedef struct MidiIndex MidiIndex_t;
+
 typedef struct MidiFile {
     uint16_t Format;
     uint16_t nTrks; // must be 1 if format is 0
     uint16_t PulsesPerQuarterNote;
     MidiTrack_t *Tracks;
+    MidiArena_t *Arena; // if not NULL, all event->data belong to the arena and must not be free()'d individually
+    void *Source; // the file contents, kept in memory while text and SysEx payloads point into them (MIDI_OPEN_ZERO_COPY)
+    MidiIndex_t *Index; // built by the first query of the INDEX functions, dropped by MidiFile_Invalidate
 } MidiFile_t;
 
+typedef enum MidiFileOpenFlags {
+    MIDI_OPEN_DEFAULT = 0,
+    MIDI_OPEN_ARENA = 1 << 0, // allocate all event payloads from a per-file arena (released at once by MidiFile_Close)
+    MIDI_OPEN_MAPPED = 1 << 1, // memory-map the file (mmap / MapViewOfFile) and parse it in place instead of reading it to a buffer
+    MIDI_OPEN_PARALLEL = 1 << 2, // decode the track chunks concurrently, one track per task on a pool of threads
+    MIDI_OPEN_STRICT = 1 << 3, // fail if any track is malformed, instead of keeping the events that precede the error (which is still reported by Midi_GetLastError)
+    MIDI_OPEN_ZERO_COPY = 1 << 4, // text and SysEx payloads point into the file instead of being copied; with MidiFile_OpenMemory the buffer must outlive the file
+    MIDI_OPEN_KEEP_SOURCE = 1 << 5, // keep the bytes of each track, so saving copies the tracks that were not edited; with MidiFile_OpenMemory the buffer must outlive the file
+} MidiFileOpenFlags_t;
+
 MidiFile_t *MidiFile_Open(const char* filename);
+MidiFile_t *MidiFile_OpenEx(const char* filename, uint32_t flags);
+MidiFile_t *MidiFile_OpenMemory(const void* buffer, uint32_t length, uint32_t flags); // parses a file already in memory; the buffer is not referenced after returning, unless MIDI_OPEN_ZERO_COPY
+MidiFile_t *MidiFile_Create(uint16_t format, uint16_t nTrks, uint16_t ppq); // a file of empty tracks, released with MidiFile_Close
+typedef enum MidiFileSaveFlags {
+    MIDI_SAVE_DEFAULT = 0,
+    MIDI_SAVE_RUNNING_STATUS = 1 << 0, // omit repeated status bytes of consecutive channel events (smaller files); tracks saved verbatim keep their own encoding
+    MIDI_SAVE_REENCODE = 1 << 1, // encode every track from its events, even those kept with MIDI_OPEN_KEEP_SOURCE
+} MidiFileSaveFlags_t;
+
 int MidiFile_Save(const char* filename, const MidiFile_t *save);
+int MidiFile_SaveEx(const char* filename, const MidiFile_t *save, uint32_t flags);
+int MidiFile_GetEncodedSize(const MidiFile_t* midi, uint32_t flags); // exact size of the file MidiFile_SaveToBuffer will produce
+int MidiFile_SaveToBuffer(const MidiFile_t* midi, void* buffer, uint32_t capacity, uint32_t flags); // returns the number of bytes written, or -1
 void MidiFile_Close(MidiFile_t *close);
 
+// STREAMING READER
+// ===================================================================
+// pull-style reader: events are decoded on demand, in playback order (merged across tracks), using constant memory
+// text and SysEx payloads are never copied: text points into the file and is length-delimited, not NUL-terminated (as with MIDI_OPEN_ZERO_COPY)
+// a malformed event fails the open (if it is the first of its track) or MidiReader_Next, and Midi_GetLastError tells its track and offset
+typedef struct MidiReader MidiReader_t;
+
+MidiReader_t* MidiReader_Open(const char* filename); // the file is memory-mapped while the reader is open
+MidiReader_t* MidiReader_OpenMemory(const void* buffer, uint32_t length); // the buffer must outlive the reader
+const MidiFile_t* MidiReader_GetHeader(const MidiReader_t* reader); // Format, nTrks and PulsesPerQuarterNote only (Tracks is NULL)
+int MidiReader_Next(MidiReader_t* reader, MidiEvent_t** event, uint16_t* track, uint64_t* timeTicks); // returns 1 if an event was read, 0 at the end, -1 on error; the event is valid until the next call, its payload until MidiReader_Close
+void MidiReader_Close(MidiReader_t* reader);
+
+// PACKED TRACKS
+// ===================================================================
+// structure-of-arrays layout: scanning the notes touches only a few contiguous byte arrays instead of chasing a pointer per event
+
+typedef struct MidiPackedMeta {
+    uint32_t offset; // position of the payload in MidiPackedTrack_t.Payload
+    uint32_t length; // size of the payload, as encoded in the file: len <data>
+} MidiPackedMeta_t;
+
+typedef struct MidiPackedTrack {
+    uint32_t NumEvents;
+    uint32_t *DeltaTime; // ticks since the previous event
+    uint32_t *AbsoluteTicks; // ticks since the start of the track
+    uint8_t *Status; // 0x80-0xEF: status byte of a channel event (type | channel); 0xFF: meta event; 0xF0: SysEx
+    uint8_t *Data1; // channel events: 1st data byte (key, control, program, wheel lsb...); meta events: meta type
+    uint8_t *Data2; // channel events: 2nd data byte (velocity, value, wheel msb...) or 0
+    uint32_t NumMeta;
+    MidiPackedMeta_t *Meta; // one entry per meta / SysEx event, in the order they appear in the track
+    uint32_t PayloadSize;
+    uint8_t *Payload; // payloads of meta / SysEx events
+} MidiPackedTrack_t;
+
+typedef struct MidiPackedFile {
+    uint16_t Format;
+    uint16_t nTrks;
+    uint16_t PulsesPerQuarterNote;
+    MidiPackedTrack_t *Tracks;
+} MidiPackedFile_t;
+
+MidiPackedFile_t *MidiPackedFile_FromFile(const MidiFile_t* midi);
+MidiFile_t *MidiPackedFile_ToFile(const MidiPackedFile_t* packed, uint32_t flags); // only MIDI_OPEN_ARENA is meaningful in flags
+void MidiPackedFile_Close(MidiPackedFile_t* packed);
+
+// bulk edits of every track of a packed file, in place and in a single pass per array
+typedef struct MidiTransform {
+    int8_t Transpose; // semitones added to the keys of note on / off and polyphonic pressure, clamped to 0 - 127
+    uint16_t Channels; // bit n set: transpose and change the velocities of channel n; 0 means every channel
+    uint16_t VelocityScale; // note-on velocities times VelocityScale / 256, kept within 1 - 127; 0 leaves them as they are
+    const uint8_t* VelocityCurve; // if not NULL, 128 entries mapping each note-on velocity (after the scale) to a new one, kept within 1 - 127
+    const uint8_t* ChannelMap; // if not NULL, 16 entries: channel events of channel n are moved to ChannelMap[n] (applied last)
+    uint32_t Stretch; // ticks times Stretch / 65536 (16.16 fixed point); 0 leaves the timing as it is
+} MidiTransform_t;
+
+int MidiPackedFile_Transform(MidiPackedFile_t* packed, const MidiTransform_t* transform);
+
+// TIMELINE
+// ===================================================================
+// tempo-aware conversion between ticks and microseconds, computed offline (without waiting)
+typedef struct MidiTempoMapEntry {
+    uint64_t ticks; // absolute time (in ticks) where the tempo takes effect
+    uint64_t usec; // absolute time (in microseconds) of the same instant
+    uint64_t units; // same instant, exact, in 1/PulsesPerQuarterNote microseconds
+    uint32_t tempo; // microseconds per quarter-note from then on
+} MidiTempoMapEntry_t;
+
+typedef struct MidiTempoMap {
+    uint16_t PulsesPerQuarterNote; // with SMPTE division: ticks per second (and tempo is fixed at 1 second)
+    uint32_t NumEntries; // at least 1: the initial tempo at tick 0
+    MidiTempoMapEntry_t *Entries; // sorted by time
+} MidiTempoMap_t;
+
+MidiTempoMap_t* MidiTempoMap_Create(const MidiFile_t* midi);
+void MidiTempoMap_Destroy(MidiTempoMap_t* map);
+uint64_t MidiTempoMap_TicksToUs(const MidiTempoMap_t* map, uint64_t ticks);
+uint64_t MidiTempoMap_TicksToNs(const MidiTempoMap_t* map, uint64_t ticks);
+uint64_t MidiTempoMap_UsToTicks(const MidiTempoMap_t* map, uint64_t usec);
+
+// iterates over the events of all tracks merged in time order (ties go to the lowest track)
+typedef struct MidiTimelineEvent {
+    MidiEvent_t* event;
+    uint16_t track;
+    uint32_t index; // position of the event in its track
+    uint64_t ticks; // absolute time of the event
+    uint64_t usec;
+    uint64_t nsec; // same as usec, with sub-microsecond precision
+} MidiTimelineEvent_t;
+
+typedef struct MidiTimeline MidiTimeline_t;
+
+MidiTimeline_t* MidiTimeline_Create(const MidiFile_t* midi);
+const MidiTempoMap_t* MidiTimeline_GetTempoMap(const MidiTimeline_t* timeline);
+int MidiTimeline_Next(MidiTimeline_t* timeline, MidiTimelineEvent_t* next); // returns 1 if "next" was filled, 0 when all tracks are finished
+// moves to the first event at or after usec; if chase is not NULL, it receives the latest program / controller / pitch wheel / pressure
+// change of each channel before that point, in time order (valid until the next seek); the index is built once and cached in the timeline
+int MidiTimeline_Seek(MidiTimeline_t* timeline, uint64_t usec, const MidiTimelineEvent_t** chase, uint32_t* numChase);
+void MidiTimeline_Destroy(MidiTimeline_t* timeline);
+
+// INDEX
+// ===================================================================
+// events by type and notes by channel, looked up without walking the file; the index is built by the first query
+// after adding, removing or modifying events by hand call MidiFile_Invalidate, so the next query builds it again (the EDITING functions do it)
+// building the index is not thread-safe: concurrent queries on one file only after a first query has returned
+typedef struct MidiNoteRange {
+    uint32_t NumNotes; // note-on events with non-zero velocity
+    uint8_t LowestKey; // only meaningful if NumNotes > 0
+    uint8_t HighestKey;
+} MidiNoteRange_t;
+
+// the events returned are valid until the file is invalidated or closed
+int Midi_FindEvents(const MidiFile_t* midi, MidiEventType_t type, const MidiTimelineEvent_t** events); // every event of a type, in time order; returns how many, or -1
+int Midi_FindEventsInRange(const MidiFile_t* midi, MidiEventType_t type, uint64_t fromTicks, uint64_t toTicks, const MidiTimelineEvent_t** events); // only fromTicks <= ticks < toTicks
+int Midi_GetNoteRange(const MidiFile_t* midi, uint8_t channel, MidiNoteRange_t* range); // returns -1 on error
+void MidiFile_Invalidate(MidiFile_t* midi); // drops the index and marks every track as edited
+void MidiFile_InvalidateTrack(MidiFile_t* midi, uint16_t track); // drops the index and marks one track as edited
+
+// EDITING
+// ===================================================================
+// events addressed by absolute time: the delta times around the change are fixed so no other event moves
+// an event at the same tick as others goes after them, and the End of Track stays last (moving later if needed)
+// an End of Track is never placed before another event, and a track that has one cannot take a second
+uint64_t MidiTrack_GetTicks(const MidiTrack_t* track, uint32_t index); // absolute time of an event
+uint32_t MidiTrack_FindTicks(const MidiTrack_t* track, uint64_t ticks); // first event at or after ticks (NumEvents if none)
+int MidiFile_InsertEvent(MidiFile_t* midi, uint16_t track, uint64_t ticks, uint8_t type, const void* data); // data is the MidiEventData_..._t of the type (copied), may be NULL for End of Track; returns the index of the new event, or -1
+int MidiFile_DeleteEvent(MidiFile_t* midi, uint16_t track, uint32_t index);
+int MidiFile_MoveEvent(MidiFile_t* midi, uint16_t track, uint32_t index, uint64_t ticks); // returns the new index of the event, or -1 leaving the track unchanged
+
 // TIME MAP
 // ===================================================================
 typedef struct MidiAbsoluteTimeMap {
@@ -202,7 +401,38 @@ typedef struct MidiAbsoluteTimeMap {
     uint32_t endTime;
 } MidiAbsoluteTimeMap_t;
 
-uint32_t Midi_MapAbsoluteTime(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi);
+typedef struct MidiAbsoluteTimeMap64 {
+    uint16_t track;
+    MidiEvent_t* OnEvent;
+    MidiEvent_t* OffEvent;
+    uint64_t startTicks;
+    uint64_t endTicks;
+    uint64_t startTime; // microseconds
+    uint64_t endTime;
+} MidiAbsoluteTimeMap64_t;
+
+uint32_t Midi_MapAbsoluteTime(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi); // times saturate at UINT32_MAX (~71 minutes)
+uint32_t Midi_MapAbsoluteTimeEx(MidiAbsoluteTimeMap_t** list, const MidiFile_t* midi, uint32_t* orphans); // orphans receives how many note-ons were never terminated (OffEvent == NULL)
+uint32_t Midi_MapAbsoluteTime64(MidiAbsoluteTimeMap64_t** list, const MidiFile_t* midi, uint32_t* orphans);
+
+// CACHE
+// ===================================================================
+// the packed tracks and the tempo map of a file, stored so that loading them again is a memory mapping instead of a parse
+// a cache only serves the exact SMF file it was made from (same size and hash), and only on machines with the same byte order and layout
+typedef struct MidiCache MidiCache_t;
+
+typedef enum MidiCacheFlags {
+    MIDI_CACHE_DEFAULT = 0,
+    MIDI_CACHE_WRITE = 1 << 0, // when the cache is missing or stale, write it after decoding the source
+} MidiCacheFlags_t;
+
+MidiCache_t* MidiCache_Open(const char* cacheFile, const char* midiFile, uint32_t flags); // maps cacheFile if it is current, otherwise decodes midiFile
+const MidiPackedFile_t* MidiCache_GetPacked(const MidiCache_t* cache); // read-only, valid until MidiCache_Close; MidiPackedFile_ToFile gives a MidiFile_t
+const MidiTempoMap_t* MidiCache_GetTempoMap(const MidiCache_t* cache);
+uint8_t MidiCache_IsHit(const MidiCache_t* cache); // 1 if it was loaded from the cache file
+void MidiCache_Close(MidiCache_t* cache);
+
+uint64_t Midi_Hash(const void* data, uint32_t length); // FNV-1a, as stored in the cache
 
 // PLAYER
 // ===================================================================
@@ -214,13 +444,223 @@ typedef enum Player_Callback_Result
 } Player_Callback_Result_t;
 
 typedef int (*playerCallback)(MidiEvent_t* event, uint16_t track, uint32_t timeTicks, uint32_t timeUs);
-
+typedef int (*playerCallback64)(MidiEvent_t* event, uint16_t track, uint32_t index, uint64_t timeTicks, uint64_t timeUs, void* user); // index is the position of the event in its track
+
+// an output, either a software synthesizer (unix) or a MIDI out port (windows)
+typedef struct MidiDevice MidiDevice_t;
+
+typedef struct MidiTimingMonitor MidiTimingMonitor_t; // see TIMING MONITOR
+
+typedef struct MidiPlaybackStats {
+    uint64_t Events; // events dispatched on a deadline (chased events are not counted)
+    int64_t LastLatenessUs; // how late the last event was dispatched, in microseconds
+    int64_t MaxLatenessUs;
+    int64_t TotalLatenessUs; // divide by Events for the average
+} MidiPlaybackStats_t;
+
+typedef struct MidiPlayOptions {
+    uint64_t StartUs; // position to start playing from
+    playerCallback64 Callback; // may be NULL
+    void* UserData; // passed to the callback
+    MidiPlaybackStats_t* Stats; // optional, receives the lateness of each event
+    uint32_t SpinUs; // busy-wait this long before each deadline instead of sleeping (0 = never spin)
+    uint8_t Realtime; // raise the playing thread to realtime priority (may need privileges)
+    MidiDevice_t* Device; // where to play, NULL for the default device opened by MidiDevice_Open
+    const uint8_t* ChannelMap; // optional, 16 entries: file channel -> device channel, lets players share a device
+    uint8_t DryRun; // neither wait for the events nor send them: runs the schedule as fast as possible (benchmarks)
+    MidiTimingMonitor_t* Monitor; // optional, records the timing of every tick; nothing is measured when NULL
+} MidiPlayOptions_t;
+
+#define MIDI_PLAY_DEFAULT_SPIN_US 100 // spin window used by MidiFile_Play
+
+uint64_t MidiClock_NowNs(); // monotonic clock
+void MidiClock_SleepUntil(uint64_t deadlineNs, uint32_t spinUs);
+
+MidiDevice_t* MidiDevice_Create();
+void MidiDevice_Destroy(MidiDevice_t* device);
+void MidiDevice_ResetEx(MidiDevice_t* device);
+int MidiDevice_SilenceChannel(MidiDevice_t* device, uint8_t channel);
+int MidiDevice_SetChannelInstrumentEx(MidiDevice_t* device, uint8_t channel, uint8_t instrument);
+int MidiDevice_PlayNoteEx(MidiDevice_t* device, uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state);
+int MidiDevice_SendMessage(MidiDevice_t* device, const uint8_t* msg, uint32_t length); // one complete message: a channel message or F0 ... F7
+int MidiDevice_SendBatch(MidiDevice_t* device, const uint8_t* messages, uint32_t length); // complete messages back to back, each with its own status byte; sent one by one, the drivers have no batch call
+
+// the default device
 int MidiDevice_Open();
 void MidiDevice_Close();
 void MidiDevice_Reset();
 int MidiDevice_SetChannelInstrument(uint8_t channel, uint8_t instrument);
 int MidiDevice_PlayNote(uint8_t key, uint8_t channel, uint8_t velocity, uint8_t state);
+MidiDevice_t* MidiDevice_GetDefault(); // NULL until MidiDevice_Open
 void MidiFile_Play(const MidiFile_t* midi, uint32_t start_usec, playerCallback cbFunc);
+void MidiFile_PlayEx(const MidiFile_t* midi, const MidiPlayOptions_t* options);
+
+// TIMING MONITOR
+// ===================================================================
+// measures every tick played (all events due at the same instant): how late the player woke up, how long the callbacks took and how long the device calls took
+// the playing thread only writes, and any single other thread may read the statistics and poll the trace while it plays
+typedef enum MidiTimingMetric {
+    Midi_Timing_Lateness = 0, // wake-up time - deadline (sleep overshoot, plus the time spent in the previous tick)
+    Midi_Timing_Dispatch, // callbacks and encoding of the messages
+    Midi_Timing_Device, // fluid_synth_... / midiOut... calls
+    Midi_Timing_Metrics,
+} MidiTimingMetric_t;
+
+typedef struct MidiTimingSample {
+    uint64_t Ticks;
+    uint64_t DeadlineNs; // MidiClock_NowNs time the tick was due
+    uint64_t WokeNs; // MidiClock_NowNs time the player started dispatching it
+    uint32_t Events;
+    uint32_t DispatchNs;
+    uint32_t DeviceNs;
+} MidiTimingSample_t;
+
+typedef struct MidiTimingStats {
+    uint64_t Ticks;
+    uint64_t Events;
+    uint64_t MissedDeadlines; // ticks whose lateness exceeded the budget
+    uint64_t DroppedSamples; // trace samples discarded because they were not polled in time
+    uint64_t MinLatenessNs;
+    uint64_t MaxLatenessNs;
+    uint64_t MaxJitterNs; // spread of the lateness, MaxLatenessNs - MinLatenessNs
+    uint64_t MaxDispatchNs;
+    uint64_t MaxDeviceNs;
+} MidiTimingStats_t;
+
+MidiTimingMonitor_t* MidiTimingMonitor_Create(uint32_t traceCapacity, uint32_t budgetUs); // traceCapacity = samples kept for polling (0 = no trace)
+void MidiTimingMonitor_Destroy(MidiTimingMonitor_t* monitor); // not while a player uses it
+void MidiTimingMonitor_Reset(MidiTimingMonitor_t* monitor); // the statistics restart with the next tick played (the trace is kept)
+void MidiTimingMonitor_GetStats(const MidiTimingMonitor_t* monitor, MidiTimingStats_t* stats);
+uint64_t MidiTimingMonitor_GetPercentile(const MidiTimingMonitor_t* monitor, MidiTimingMetric_t metric, double percentile); // in ns, within 1/16 of the exact value; percentile from 0 to 100
+int MidiTimingMonitor_PollSample(MidiTimingMonitor_t* monitor, MidiTimingSample_t* sample); // returns 1 and the oldest sample, or 0 if none
+
+// ASYNC PLAYER
+// ===================================================================
+// plays on a dedicated thread, controlled with commands that never block
+// commands must be posted from a single thread, and events polled from a single (possibly other) thread
+// the callback in the options runs on the playback thread, as do all device calls
+typedef struct MidiPlayer MidiPlayer_t;
+
+typedef enum MidiPlayerState {
+    Midi_Player_State_Idle = 0, // not started yet
+    Midi_Player_State_Playing,
+    Midi_Player_State_Paused,
+    Midi_Player_State_Finished, // reached the end, a seek will resume playing
+    Midi_Player_State_Stopped, // the thread has exited
+} MidiPlayerState_t;
+
+MidiPlayer_t* MidiPlayer_Create(const MidiFile_t* midi, const MidiPlayOptions_t* options); // options may be NULL; the file must outlive the player
+int MidiPlayer_Start(MidiPlayer_t* player);
+int MidiPlayer_Pause(MidiPlayer_t* player);
+int MidiPlayer_Resume(MidiPlayer_t* player);
+int MidiPlayer_Seek(MidiPlayer_t* player, uint64_t usec);
+int MidiPlayer_SetTempoScale(MidiPlayer_t* player, double scale); // 2.0 plays twice as fast
+int MidiPlayer_Stop(MidiPlayer_t* player);
+int MidiPlayer_PollEvent(MidiPlayer_t* player, MidiTimelineEvent_t* event); // returns 1 and the next event played, or 0 if none
+uint32_t MidiPlayer_GetDroppedEvents(const MidiPlayer_t* player); // events discarded because they were not polled in time
+MidiPlayerState_t MidiPlayer_GetState(const MidiPlayer_t* player);
+void MidiPlayer_Destroy(MidiPlayer_t* player); // stops and joins the thread
+
+// MIDI INPUT
+// ===================================================================
+// an input port: WinMM midiIn on windows, a port of the ALSA sequencer on linux
+// the driver timestamps the messages and queues them without blocking; a single thread takes them with MidiInput_Poll or a recorder
+// only channel messages are captured, SysEx and system real-time messages are ignored
+typedef struct MidiInput MidiInput_t;
+
+typedef struct MidiInputOptions {
+    int32_t Device; // windows: midiIn device id (-1 = 0); linux: the ALSA client to connect from (-1 = none, connect to our port with aconnect)
+    int32_t Port; // linux: the port of that client
+    uint32_t Capacity; // messages queued between two polls (0 = 4096), the rest are dropped
+    uint8_t Realtime; // linux: raise the reader thread to realtime priority (may need privileges)
+} MidiInputOptions_t;
+
+typedef struct MidiInputMessage {
+    uint64_t TimeNs; // MidiClock_NowNs when the message arrived
+    uint8_t Length;
+    uint8_t Data[3]; // status byte and data bytes
+} MidiInputMessage_t;
+
+MidiInput_t* MidiInput_Open(const MidiInputOptions_t* options); // options may be NULL
+int MidiInput_Start(MidiInput_t* input);
+int MidiInput_Stop(MidiInput_t* input);
+int MidiInput_Poll(MidiInput_t* input, MidiInputMessage_t* message); // returns 1 and the oldest message, or 0 if none
+uint32_t MidiInput_GetDroppedMessages(const MidiInput_t* input); // messages lost because they were not polled in time
+void MidiInput_Close(MidiInput_t* input);
+
+// appends the messages of an input to a track as events, converting the arrival times to delta ticks at a fixed tempo
+// the track must not be changed by anything else while recording
+typedef struct MidiRecorder MidiRecorder_t;
+
+MidiRecorder_t* MidiRecorder_Create(MidiFile_t* midi, uint16_t track, uint32_t usPerQuarter, uint64_t startNs); // usPerQuarter 0 = 120 bpm; startNs = time of tick 0, or 0 to start at the first message
+// the events the track already has stay where they are: what is played before their end is merged in time order
+int MidiRecorder_Drain(MidiRecorder_t* recorder, MidiInput_t* input); // moves every queued message into the track, returns how many, or -1
+int MidiRecorder_Finish(MidiRecorder_t* recorder); // terminates the track with an End of Track event and releases the recorder
+
+// OFFLINE RENDER
+// ===================================================================
+// synthesizes a file to 16-bit stereo PCM as fast as possible (unix only, with FluidSynth)
+typedef int (*renderCallback)(const int16_t* samples, uint32_t frames, void* user); // interleaved left/right, return non-zero to abort
+
+typedef struct MidiRenderOptions {
+    uint32_t SampleRate; // 0 = 44100
+    const char* SoundFont; // NULL = the default sound font
+    uint32_t BlockFrames; // samples are produced in blocks of at most this many frames, 0 = 512
+    uint32_t TailMs; // keep rendering after the last event, so notes can ring out
+    uint32_t Threads; // render this many segments in parallel, 0 or 1 renders in a single pass
+    uint32_t OverlapMs; // how long a segment keeps rendering after the notes it started are released, 0 = 2000
+    renderCallback Callback; // receives the samples in order
+    void* UserData; // passed to the callback
+} MidiRenderOptions_t;
+
+int MidiFile_Render(const MidiFile_t* midi, const MidiRenderOptions_t* options);
+int MidiFile_RenderWav(const MidiFile_t* midi, const char* filename, const MidiRenderOptions_t* options); // options may be NULL, their callback is not used
+
+// BATCH
+// ===================================================================
+// open -> callback -> save over many files, on a pool of threads that steal work from each other when they run out
+// each worker reuses one arena for all its files, and library messages below warnings are not printed from workers
+typedef enum Batch_Callback_Result
+{
+    Batch_Callback_Save = 0, // save the file (if there is an output directory)
+    Batch_Callback_Skip = 1, // done with the file, do not save it
+    Batch_Callback_Error = -1, // count the file as failed
+} Batch_Callback_Result_t;
+
+// runs on the worker threads, concurrently: the file is only valid during the call; worker is 0 ... Threads - 1
+typedef int (*batchCallback)(MidiFile_t* midi, const char* filename, uint32_t worker, void* user);
+
+typedef struct MidiBatchOptions {
+    uint32_t Threads; // 0 = one per CPU
+    uint32_t OpenFlags; // MIDI_OPEN_... (payloads always come from the worker arena)
+    uint32_t SaveFlags; // MIDI_SAVE_...
+    const char* OutputDir; // if not NULL, each file is saved there under its own name
+    batchCallback Callback; // may be NULL, to just load and re-save
+    void* UserData; // passed to the callback
+} MidiBatchOptions_t;
+
+typedef struct MidiBatchStats {
+    uint32_t Files; // processed successfully
+    uint32_t Failed; // could not be read, parsed or saved, or failed in the callback
+    uint64_t Events;
+    uint64_t BytesRead;
+    uint64_t BytesWritten;
+    uint64_t ElapsedUs;
+    double FilesPerSecond;
+    double BytesPerSecond; // read
+} MidiBatchStats_t;
+
+int Midi_ProcessFiles(const char* const* filenames, uint32_t count, const MidiBatchOptions_t* options, MidiBatchStats_t* stats); // returns -1 on error, otherwise the number of failed files
+int Midi_ProcessDirectory(const char* directory, const MidiBatchOptions_t* options, MidiBatchStats_t* stats); // every .mid / .midi file directly in the directory
+
+// ALLOCATION STATISTICS
+// ===================================================================
+typedef struct MidiAllocStats {
+    uint64_t Count; // calls to malloc / calloc / realloc made by the library
+    uint64_t Bytes; // total requested by those calls
+} MidiAllocStats_t;
+
+MidiAllocStats_t Midi_GetAllocStats(); // always zero unless the library is built with EZMIDI_ALLOC_STATS
 
 // ADDITIONAL FEATURES
 // ===================================================================
@@ -0,0 +1,486 @@
+// ===================================================================================  //
+//    This program is free software: you can redistribute it and/or modify              //
+//    it under the terms of the GNU General Public License as published by              //
+//    the Free Software Foundation, either version 3 of the License, or                 //
+//    (at your option) any later version.                                               //
+//                                                                                      //
+//    This program is distributed in the hope that it will be useful,                   //
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of                    //
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the                     //
+//    GNU General Public License for more details.                                      //
+//                                                                                      //
+//    You should have received a copy of the GNU General Public License                 //
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.            //
+//                                                                                      //
+//    Copyright: Luiz Gustavo Pfitscher e Feldmann, 2020                                //
+// ===================================================================================  //
+
+#include "ezMidi.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// CHECKS
+// ===================================================================
+static uint32_t test_failures = 0;
+
+#define TEST_CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "\n%s:%d: check failed: %s", __FILE__, __LINE__, #condition); \
+            test_failures++; \
+        } \
+    } while (0)
+
+// same type, delta time and data; text and SysEx are compared by their bytes
+static int Test_SameEvent(const MidiEvent_t* a, const MidiEvent_t* b)
+{
+    MidiEventType_t type = MidiEvent_GetType(a);
+
+    if (type != MidiEvent_GetType(b) || a->deltaTime != b->deltaTime)
+        return 0;
+
+    switch (type)
+    {
+        case Midi_Event_Type_EndOfTrack: return 1;
+        case Midi_Event_Type_SequenceNumber: return !memcmp(a->data, b->data, sizeof(MidiEventData_SequenceNumber_t));
+        case Midi_Event_Type_ChannelPrefix: return !memcmp(a->data, b->data, sizeof(MidiEventData_ChannelPrefix_t));
+        case Midi_Event_Type_MidiPort: return !memcmp(a->data, b->data, sizeof(MidiEventData_MidiPort_t));
+        case Midi_Event_Type_SetTempo: return !memcmp(a->data, b->data, sizeof(MidiEventData_SetTempo_t));
+        case Midi_Event_Type_SMPTEoffset: return !memcmp(a->data, b->data, sizeof(MidiEventData_SMPTEoffset_t));
+        case Midi_Event_Type_TimeSignature: return !memcmp(a->data, b->data, sizeof(MidiEventData_TimeSignature_t));
+        case Midi_Event_Type_KeySignature: return !memcmp(a->data, b->data, sizeof(MidiEventData_KeySignature_t));
+        case Midi_Event_Type_NoteOn:
+        case Midi_Event_Type_NoteOff: return !memcmp(a->data, b->data, sizeof(MidiEventData_NoteEvent_t));
+        case Midi_Event_Type_PolyphonicKeyPressure: return !memcmp(a->data, b->data, sizeof(MidiEventData_PolyphonicKeyPressure_t));
+        case Midi_Event_Type_ControlChange: return !memcmp(a->data, b->data, sizeof(MidiEventData_ControlChange_t));
+        case Midi_Event_Type_ProgramChange: return !memcmp(a->data, b->data, sizeof(MidiEventData_ProgramChange_t));
+        case Midi_Event_Type_ChannelPressure: return !memcmp(a->data, b->data, sizeof(MidiEventData_ChannelPressure_t));
+
+        case Midi_Event_Type_PitchWheelChange:
+        {
+            const MidiEventData_PitchWheelChange_t* wa = (const MidiEventData_PitchWheelChange_t*)a->data;
+            const MidiEventData_PitchWheelChange_t* wb = (const MidiEventData_PitchWheelChange_t*)b->data;
+            return wa->channel == wb->channel && wa->wheel == wb->wheel;
+        }
+
+        default: // text and SysEx
+        {
+            const MidiEventData_Text_t* ta = (const MidiEventData_Text_t*)a->data;
+            const MidiEventData_Text_t* tb = (const MidiEventData_Text_t*)b->data;
+            return ta->length == tb->length && !memcmp(ta->text, tb->text, ta->length);
+        }
+    }
+}
+
+static int Test_SameTrack(const MidiTrack_t* a, const MidiTrack_t* b)
+{
+    if (a->NumEvents != b->NumEvents)
+        return 0;
+
+    for (uint32_t e = 0; e < a->NumEvents; e++)
+        if (!Test_SameEvent(&a->Events[e], &b->Events[e]))
+            return 0;
+
+    return 1;
+}
+
+static int Test_SameFile(const MidiFile_t* a, const MidiFile_t* b)
+{
+    if (a->Format != b->Format || a->nTrks != b->nTrks || a->PulsesPerQuarterNote != b->PulsesPerQuarterNote)
+        return 0;
+
+    for (uint16_t t = 0; t < a->nTrks; t++)
+        if (!Test_SameTrack(&a->Tracks[t], &b->Tracks[t]))
+            return 0;
+
+    return 1;
+}
+
+// saves to a new buffer, checking the size is the one announced
+static uint8_t* Test_Save(const MidiFile_t* midi, uint32_t flags, uint32_t* length)
+{
+    int size = MidiFile_GetEncodedSize(midi, flags);
+    TEST_CHECK(size > 0);
+
+    uint8_t* buffer = (size > 0) ? (uint8_t*)malloc(size) : NULL;
+    if (buffer == NULL)
+        return NULL;
+
+    int written = MidiFile_SaveToBuffer(midi, buffer, size, flags);
+    TEST_CHECK(written == size);
+    TEST_CHECK(MidiFile_SaveToBuffer(midi, buffer, size - 1, flags) == -1); // never past the capacity
+
+    *length = (uint32_t)size;
+    return buffer;
+}
+
+// SYNTHETIC FILES
+// ===================================================================
+// a format 1 file at 96 ppq, with an empty conductor track followed by the given track
+static uint32_t Test_MakeFile(uint8_t* file, const uint8_t* track, uint32_t length)
+{
+    static const uint8_t header[] = {'M','T','h','d', 0,0,0,6, 0,1, 0,2, 0,96, 'M','T','r','k', 0,0,0,4, 0x00,0xFF,0x2F,0x00};
+
+    memcpy(file, header, sizeof(header));
+    file += sizeof(header);
+
+    const uint8_t chunk[] = {'M','T','r','k', length >> 24, length >> 16, length >> 8, length};
+    memcpy(file, chunk, sizeof(chunk));
+    memcpy(file + sizeof(chunk), track, length);
+
+    return sizeof(header) + sizeof(chunk) + length;
+}
+
+// MALFORMED INPUT
+// ===================================================================
+// the second track is malformed: the file keeps the events before the error, strict opening fails, the reader stops there
+static void Test_MalformedTrack(const char* name, const uint8_t* track, uint32_t length, MidiError_t code, uint32_t offset, uint32_t kept)
+{
+    uint8_t file[256];
+    uint32_t size = Test_MakeFile(file, track, length);
+    uint32_t failures = test_failures;
+
+    Midi_ClearError();
+    MidiFile_t* midi = MidiFile_OpenMemory(file, size, MIDI_OPEN_DEFAULT);
+    MidiErrorInfo_t error = Midi_GetLastError();
+
+    TEST_CHECK(midi != NULL);
+    TEST_CHECK(error.Code == code && error.Track == 1 && error.Offset == offset);
+
+    if (midi)
+    {
+        TEST_CHECK(midi->nTrks == 2 && midi->Tracks[0].NumEvents == 1);
+        TEST_CHECK(midi->Tracks[1].NumEvents == kept);
+        MidiFile_Close(midi);
+    }
+
+    Midi_ClearError();
+    TEST_CHECK(MidiFile_OpenMemory(file, size, MIDI_OPEN_STRICT) == NULL);
+    error = Midi_GetLastError();
+    TEST_CHECK(error.Code == code && error.Track == 1 && error.Offset == offset);
+
+    Midi_ClearError();
+    MidiReader_t* reader = MidiReader_OpenMemory(file, size);
+
+    if (reader) // the error is reported when the reader gets to it
+    {
+        MidiEvent_t* event;
+        uint16_t t;
+        uint64_t ticks;
+        int result;
+        uint32_t read = 0;
+
+        while ((result = MidiReader_Next(reader, &event, &t, &ticks)) > 0)
+            read += (t == 1);
+
+        TEST_CHECK(result == -1 && read == kept);
+        MidiReader_Close(reader);
+    }
+    else
+        TEST_CHECK(kept == 0); // the first event of the track is the bad one
+
+    error = Midi_GetLastError();
+    TEST_CHECK(error.Code == code && error.Track == 1 && error.Offset == offset);
+
+    if (test_failures != failures)
+        fprintf(stderr, "\n    in %s (last error: %s, track %d, offset %u)", name, Midi_GetErrorString(error.Code), error.Track, error.Offset);
+}
+
+static void Test_Malformed()
+{
+    // the chunk ends in the middle of the second note
+    static const uint8_t truncated[] = {0x00, 0x90, 0x3C, 0x64, 0x00, 0x90, 0x3C};
+    Test_MalformedTrack("truncated event", truncated, sizeof(truncated), MIDI_ERROR_TRUNCATED, 4, 1);
+
+    // a data byte first, with no status to repeat
+    static const uint8_t noStatus[] = {0x00, 0x3C, 0x64, 0x00, 0xFF, 0x2F, 0x00};
+    Test_MalformedTrack("running status without a status", noStatus, sizeof(noStatus), MIDI_ERROR_RUNNING_STATUS, 0, 0);
+
+    // a delta time of 5 bytes
+    static const uint8_t longDelta[] = {0x00, 0x90, 0x3C, 0x64, 0x81, 0x81, 0x81, 0x81, 0x01, 0x80, 0x3C, 0x00, 0x00, 0xFF, 0x2F, 0x00};
+    Test_MalformedTrack("over-long delta time", longDelta, sizeof(longDelta), MIDI_ERROR_BAD_VLQ, 4, 1);
+
+    // a meta length of 5 bytes
+    static const uint8_t longLength[] = {0x00, 0xFF, 0x01, 0x81, 0x81, 0x81, 0x81, 0x01, 'a', 0x00, 0xFF, 0x2F, 0x00};
+    Test_MalformedTrack("over-long meta length", longLength, sizeof(longLength), MIDI_ERROR_BAD_VLQ, 0, 0);
+
+    // a text longer than the chunk
+    static const uint8_t longText[] = {0x00, 0x90, 0x3C, 0x64, 0x00, 0xFF, 0x01, 0x7F, 'a', 'b'};
+    Test_MalformedTrack("text past the chunk", longText, sizeof(longText), MIDI_ERROR_TRUNCATED, 4, 1);
+
+    // a chunk longer than the file
+    uint8_t file[256];
+    static const uint8_t track[] = {0x00, 0x90, 0x3C, 0x64, 0x00, 0xFF, 0x2F, 0x00};
+    uint32_t size = Test_MakeFile(file, track, sizeof(track));
+
+    Midi_ClearError();
+    TEST_CHECK(MidiFile_OpenMemory(file, size - 1, MIDI_OPEN_STRICT) == NULL);
+    TEST_CHECK(Midi_GetLastError().Code == MIDI_ERROR_TRUNCATED);
+    TEST_CHECK(MidiReader_OpenMemory(file, size - 1) == NULL);
+
+    // no header
+    Midi_ClearError();
+    TEST_CHECK(MidiFile_OpenMemory(file + 14, size - 14, MIDI_OPEN_DEFAULT) == NULL);
+    TEST_CHECK(Midi_GetLastError().Code == MIDI_ERROR_BAD_HEADER);
+}
+
+// SAVING
+// ===================================================================
+// open -> save -> reopen gives the same events, and the kept bytes of the tracks are saved as they were read
+static void Test_RoundTrip(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "\nCannot open %s", filename);
+        test_failures++;
+        return;
+    }
+
+    fseek(f, 0, SEEK_END);
+    uint32_t length = (uint32_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* original = (uint8_t*)malloc(length);
+    TEST_CHECK(original != NULL && fread(original, 1, length, f) == length);
+    fclose(f);
+
+    MidiFile_t* midi = MidiFile_OpenMemory(original, length, MIDI_OPEN_KEEP_SOURCE);
+    TEST_CHECK(midi != NULL && Midi_GetLastError().Code == MIDI_OK);
+
+    if (midi == NULL)
+    {
+        free(original);
+        return;
+    }
+
+    uint32_t verbatimLength, encodedLength, runningLength, againLength;
+
+    // every track kept: the file is saved as it was
+    uint8_t* verbatim = Test_Save(midi, MIDI_SAVE_DEFAULT, &verbatimLength);
+    TEST_CHECK(verbatim && verbatimLength == length && !memcmp(verbatim, original, length));
+
+    // encoded from the events
+    uint8_t* encoded = Test_Save(midi, MIDI_SAVE_REENCODE, &encodedLength);
+    MidiFile_t* reopened = (encoded) ? MidiFile_OpenMemory(encoded, encodedLength, MIDI_OPEN_STRICT) : NULL;
+    TEST_CHECK(reopened && Test_SameFile(midi, reopened));
+
+    // and once more: the encoding is stable
+    uint8_t* again = (reopened) ? Test_Save(reopened, MIDI_SAVE_DEFAULT, &againLength) : NULL;
+    TEST_CHECK(again && againLength == encodedLength && !memcmp(again, encoded, encodedLength));
+
+    // with running status: smaller, same events
+    uint8_t* running = Test_Save(midi, MIDI_SAVE_REENCODE | MIDI_SAVE_RUNNING_STATUS, &runningLength);
+    MidiFile_t* reopenedRunning = (running) ? MidiFile_OpenMemory(running, runningLength, MIDI_OPEN_STRICT | MIDI_OPEN_ARENA | MIDI_OPEN_ZERO_COPY) : NULL;
+    TEST_CHECK(running && runningLength < encodedLength);
+    TEST_CHECK(reopenedRunning && Test_SameFile(midi, reopenedRunning));
+
+    MidiFile_Close(reopenedRunning);
+    MidiFile_Close(reopened);
+    MidiFile_Close(midi);
+    free(running);
+    free(again);
+    free(encoded);
+    free(verbatim);
+    free(original);
+}
+
+// the repeated status bytes of channel events are dropped, and written again after meta events and SysEx
+static void Test_RunningStatus()
+{
+    static const uint8_t track[] = {
+        0x00, 0x90, 0x3C, 0x64,
+        0x10, 0x90, 0x3C, 0x00, // repeated
+        0x00, 0x80, 0x3E, 0x00, // another status
+        0x00, 0x80, 0x3E, 0x00, // repeated
+        0x00, 0xFF, 0x06, 0x01, 'a',
+        0x00, 0x80, 0x3E, 0x00, // after a meta event
+        0x00, 0xF0, 0x02, 0x7E, 0xF7,
+        0x00, 0x80, 0x3E, 0x00, // after SysEx
+        0x00, 0x81, 0x3E, 0x00, // another channel
+        0x00, 0xE1, 0x00, 0x40, // another type
+        0x00, 0xE1, 0x7F, 0x7F, // repeated
+        0x00, 0xFF, 0x2F, 0x00,
+    };
+
+    static const uint8_t expected[] = {
+        0x00, 0x90, 0x3C, 0x64,
+        0x10, 0x3C, 0x00,
+        0x00, 0x80, 0x3E, 0x00,
+        0x00, 0x3E, 0x00,
+        0x00, 0xFF, 0x06, 0x01, 'a',
+        0x00, 0x80, 0x3E, 0x00,
+        0x00, 0xF0, 0x02, 0x7E, 0xF7,
+        0x00, 0x80, 0x3E, 0x00,
+        0x00, 0x81, 0x3E, 0x00,
+        0x00, 0xE1, 0x00, 0x40,
+        0x00, 0x7F, 0x7F,
+        0x00, 0xFF, 0x2F, 0x00,
+    };
+
+    uint8_t file[256], expectedFile[256];
+    uint32_t size = Test_MakeFile(file, track, sizeof(track));
+    uint32_t expectedSize = Test_MakeFile(expectedFile, expected, sizeof(expected));
+    uint32_t fullLength, runningLength;
+
+    MidiFile_t* midi = MidiFile_OpenMemory(file, size, MIDI_OPEN_STRICT);
+    TEST_CHECK(midi != NULL);
+
+    if (midi == NULL)
+        return;
+
+    uint8_t* full = Test_Save(midi, MIDI_SAVE_DEFAULT, &fullLength);
+    TEST_CHECK(full && fullLength == size && !memcmp(full, file, size));
+
+    uint8_t* running = Test_Save(midi, MIDI_SAVE_RUNNING_STATUS, &runningLength);
+    TEST_CHECK(running && runningLength == expectedSize && !memcmp(running, expectedFile, expectedSize));
+
+    MidiFile_t* reopened = (running) ? MidiFile_OpenMemory(running, runningLength, MIDI_OPEN_STRICT) : NULL;
+    TEST_CHECK(reopened && Test_SameFile(midi, reopened));
+
+    MidiFile_Close(reopened);
+    MidiFile_Close(midi);
+    free(running);
+    free(full);
+}
+
+// EDITING
+// ===================================================================
+static void Test_Editing()
+{
+    MidiFile_t* midi = MidiFile_Create(MIDI_FORMAT_SINGLE_TRACK, 1, 96);
+    TEST_CHECK(midi != NULL);
+
+    if (midi == NULL)
+        return;
+
+    MidiTrack_t* track = &midi->Tracks[0];
+    MidiEventData_NoteEvent_t on = {.channel = 0, .key = 60, .velocity = 100, .OnOff = 0x90};
+    MidiEventData_NoteEvent_t off = {.channel = 0, .key = 60, .velocity = 0, .OnOff = 0x80};
+    MidiEventData_Text_t marker = {.length = 5, .text = "verse"};
+
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 0, Midi_Event_Type_EndOfTrack, NULL) == 0);
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 5, Midi_Event_Type_EndOfTrack, NULL) == -1); // only one
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 0, Midi_Event_Type_NoteOn, NULL) == -1); // needs data
+    TEST_CHECK(MidiFile_InsertEvent(midi, 1, 0, Midi_Event_Type_NoteOn, &on) == -1); // no such track
+    TEST_CHECK(track->NumEvents == 1);
+
+    // past the End of Track: it moves to the new event
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 192, Midi_Event_Type_NoteOff, &off) == 0);
+    TEST_CHECK(track->NumEvents == 2 && MidiTrack_GetTicks(track, 1) == 192);
+
+    // before an event: it keeps its time
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 96, Midi_Event_Type_NoteOn, &on) == 0);
+    TEST_CHECK(MidiTrack_GetTicks(track, 0) == 96 && MidiTrack_GetTicks(track, 1) == 192 && MidiTrack_GetTicks(track, 2) == 192);
+
+    // at the time of another event: after it
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 96, Midi_Event_Type_Marker, &marker) == 1);
+    TEST_CHECK(MidiEvent_GetType(&track->Events[1]) == Midi_Event_Type_Marker && track->Events[1].deltaTime == 0);
+    TEST_CHECK(((MidiEventData_Text_t*)track->Events[1].data)->text != marker.text); // copied
+
+    TEST_CHECK(MidiTrack_FindTicks(track, 0) == 0 && MidiTrack_FindTicks(track, 97) == 2 && MidiTrack_FindTicks(track, 193) == 4);
+
+    // the End of Track never goes before other events
+    TEST_CHECK(MidiFile_MoveEvent(midi, 0, 3, 0) == 3);
+    TEST_CHECK(MidiTrack_GetTicks(track, 3) == 192);
+
+    // moving the last note later pushes the End of Track
+    TEST_CHECK(MidiFile_MoveEvent(midi, 0, 2, 300) == 2);
+    TEST_CHECK(MidiTrack_GetTicks(track, 2) == 300 && MidiTrack_GetTicks(track, 3) == 300);
+
+    // moving earlier keeps the others in place
+    TEST_CHECK(MidiFile_MoveEvent(midi, 0, 1, 10) == 0);
+    TEST_CHECK(MidiEvent_GetType(&track->Events[0]) == Midi_Event_Type_Marker);
+    TEST_CHECK(MidiTrack_GetTicks(track, 0) == 10 && MidiTrack_GetTicks(track, 1) == 96 && MidiTrack_GetTicks(track, 2) == 300);
+
+    // a move that cannot be done leaves the track as it was
+    uint64_t before[4];
+    for (uint32_t e = 0; e < 4; e++)
+        before[e] = MidiTrack_GetTicks(track, e);
+
+    const void* payload = track->Events[1].data;
+    TEST_CHECK(MidiFile_MoveEvent(midi, 0, 1, 300 + 0x10000000) == -1); // the delta time does not fit a variable-length quantity
+    TEST_CHECK(MidiFile_MoveEvent(midi, 0, 4, 0) == -1);
+    TEST_CHECK(track->NumEvents == 4 && track->Events[1].data == payload);
+
+    for (uint32_t e = 0; e < 4; e++)
+        TEST_CHECK(MidiTrack_GetTicks(track, e) == before[e]);
+
+    // deleting keeps the next event in place
+    TEST_CHECK(MidiFile_DeleteEvent(midi, 0, 4) == -1);
+    TEST_CHECK(MidiFile_DeleteEvent(midi, 0, 1) == 0);
+    TEST_CHECK(track->NumEvents == 3 && MidiTrack_GetTicks(track, 1) == 300);
+
+    // the edits are saved
+    uint32_t length;
+    uint8_t* saved = Test_Save(midi, MIDI_SAVE_DEFAULT, &length);
+    MidiFile_t* reopened = (saved) ? MidiFile_OpenMemory(saved, length, MIDI_OPEN_STRICT) : NULL;
+    TEST_CHECK(reopened && Test_SameFile(midi, reopened));
+
+    MidiFile_Close(reopened);
+    free(saved);
+
+    while (track->NumEvents > 0)
+        TEST_CHECK(MidiFile_DeleteEvent(midi, 0, 0) == 0);
+
+    MidiFile_Close(midi);
+}
+
+// only the edited tracks are encoded again when the bytes of the others are kept
+static void Test_EditKeptSource()
+{
+    static const uint8_t track[] = {0x00, 0x90, 0x3C, 0x64, 0x60, 0x3C, 0x00, 0x00, 0xFF, 0x2F, 0x00}; // running status, kept as is
+    uint8_t file[256];
+    uint32_t size = Test_MakeFile(file, track, sizeof(track));
+
+    MidiFile_t* midi = MidiFile_OpenMemory(file, size, MIDI_OPEN_KEEP_SOURCE | MIDI_OPEN_ARENA);
+    TEST_CHECK(midi != NULL);
+
+    if (midi == NULL)
+        return;
+
+    TEST_CHECK(midi->Tracks[0].Encoded != NULL && midi->Tracks[1].Encoded != NULL);
+
+    MidiEventData_ControlChange_t sustain = {.channel = 0, .control = 64, .value = 127};
+    TEST_CHECK(MidiFile_InsertEvent(midi, 0, 48, Midi_Event_Type_ControlChange, &sustain) == 0);
+    TEST_CHECK(midi->Tracks[0].Encoded == NULL && midi->Tracks[1].Encoded != NULL);
+    TEST_CHECK(midi->Tracks[0].NumEvents == 2 && MidiTrack_GetTicks(&midi->Tracks[0], 1) == 48);
+
+    uint32_t length;
+    uint8_t* saved = Test_Save(midi, MIDI_SAVE_DEFAULT, &length);
+    TEST_CHECK(saved && length == size + 4);
+    TEST_CHECK(saved && !memcmp(saved + length - sizeof(track), track, sizeof(track))); // the second track is copied
+
+    MidiFile_t* reopened = (saved) ? MidiFile_OpenMemory(saved, length, MIDI_OPEN_STRICT) : NULL;
+    TEST_CHECK(reopened && Test_SameFile(midi, reopened));
+
+    MidiFile_Close(reopened);
+    MidiFile_Close(midi);
+    free(saved);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2)
+    {
+        fprintf(stderr, "\nUsage: [filename.mid]\n");
+        return -1;
+    }
+
+    Midi_SetLogLevel(MIDI_LOG_SILENT); // the malformed files are expected to fail
+
+    Test_Malformed();
+    Test_RoundTrip((argc > 1) ? argv[1] : "./midi/Barber_of_Seville.mid");
+    Test_RunningStatus();
+    Test_Editing();
+    Test_EditKeptSource();
+
+    if (test_failures > 0)
+    {
+        fprintf(stderr, "\n%u checks failed\n", test_failures);
+        return 1;
+    }
+
+    printf("All tests passed\n");
+    return 0;
+}